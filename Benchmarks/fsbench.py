@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+# Scripted workloads on a mounted HashiFUSE filesystem, one JSON object
+# per workload on stdout:
+#
+#   walk       threads each walk the whole tree, an op per readdir
+#   ls-l       threads list a dir and lstat every entry, an op per dir
+#   cat        threads read whole files, an op per open/read/close
+#   rsync-out  rsync -r the tree to a local dir, an op per file
+#   rsync-in   rsync -r generated files into --into, an op per file
+#
+# The first pass of walk, ls-l and cat is untimed so every build starts
+# from warm caches, and is reported as cold_seconds.  rsync is one process,
+# so its latencies come from the filesystem itself: with --metrics pointing
+# at its HASHIFUSE_METRICS endpoint, each workload also gets the FUSE op
+# histograms (and backend request count) for just its own run.
+#
+# Example:
+#   ./fsbench.py --threads 8 --seconds 10 --metrics unix:///tmp/c.sock ~/consul/kv/app
+
+import argparse
+import json
+import os
+import re
+import shutil
+import socket
+import stat
+import subprocess
+import tempfile
+import threading
+import time
+
+
+def percentile(sorted_lat, p):
+	if not sorted_lat:
+		return 0.0
+	return sorted_lat[min(len(sorted_lat) - 1, int(len(sorted_lat) * p))]
+
+
+def tree(root):
+	dirs, files = [root], []
+	for dirpath, dirnames, filenames in os.walk(root):
+		dirs += [os.path.join(dirpath, d) for d in dirnames]
+		for name in filenames:
+			path = os.path.join(dirpath, name)
+			try:
+				if stat.S_ISREG(os.lstat(path).st_mode):
+					files.append(path)
+			except OSError:
+				pass
+	return dirs, files
+
+
+def walkOnce(root):
+	count = 0
+	for _ in os.walk(root):
+		count += 1
+	return count
+
+
+def lsl(path):
+	for entry in os.scandir(path):
+		entry.stat(follow_symlinks=False)
+
+
+def cat(path):
+	with open(path, "rb") as f:
+		while f.read(1 << 20):
+			pass
+
+
+# Runs op over items from every thread until the deadline.
+def timed(op, items, threads, seconds):
+	results = []
+	deadline = time.perf_counter() + seconds
+
+	def worker(offset):
+		ops = errors = 0
+		lat = []
+		i = offset
+		while True:
+			start = time.perf_counter()
+			if start >= deadline:
+				break
+			try:
+				op(items[i % len(items)])
+			except OSError:
+				errors += 1
+			lat.append(time.perf_counter() - start)
+			ops += 1
+			i += 1
+		results.append((ops, errors, lat))
+
+	pool = [threading.Thread(target=worker, args=(n * len(items) // threads,)) for n in range(threads)]
+	for t in pool:
+		t.start()
+	for t in pool:
+		t.join()
+	lat = sorted(l for r in results for l in r[2])
+	return sum(r[0] for r in results), sum(r[1] for r in results), lat
+
+
+def rsync(src, dst):
+	start = time.perf_counter()
+	proc = subprocess.run(["rsync", "-r", "--inplace", "--stats", src.rstrip("/") + "/", dst],
+		stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+	elapsed = time.perf_counter() - start
+	m = re.search(r"Number of regular files transferred: ([\d,]+)", proc.stdout)
+	files = int(m.group(1).replace(",", "")) if m else 0
+	return files, (0 if proc.returncode == 0 else 1), elapsed
+
+
+# Raw OpenMetrics text from unix:///path or [host]:port.
+def scrape(addr):
+	if not addr:
+		return ""
+	if addr.startswith("unix://"):
+		s = socket.socket(socket.AF_UNIX)
+		target = addr[7:]
+	else:
+		host, _, port = addr.rpartition(":")
+		s = socket.socket()
+		target = (host.strip("[]") or "127.0.0.1", int(port))
+	try:
+		s.settimeout(5)
+		s.connect(target)
+		s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+		data = b""
+		while True:
+			chunk = s.recv(65536)
+			if not chunk:
+				break
+			data += chunk
+		return data.decode(errors="replace").partition("\r\n\r\n")[2]
+	except OSError:
+		return ""
+	finally:
+		s.close()
+
+
+BUCKET = re.compile(r'^hashifuse_fuse_op_duration_seconds_bucket\{op="([^"]+)",le="([^"]+)"\} (\d+)$')
+REQUESTS = re.compile(r'^hashifuse_http_request_duration_seconds_count\{[^}]*\} (\d+)$')
+
+
+def parse(text):
+	buckets, requests = {}, 0
+	for line in text.splitlines():
+		m = BUCKET.match(line)
+		if m:
+			buckets.setdefault(m.group(1), {})[m.group(2)] = int(m.group(3))
+			continue
+		m = REQUESTS.match(line)
+		if m:
+			requests += int(m.group(1))
+	return buckets, requests
+
+
+# Per-op count and percentiles (bucket upper bounds) between two scrapes.
+def fuseDelta(before, after):
+	b0, r0 = parse(before)
+	b1, r1 = parse(after)
+	ops = {}
+	for op, les in b1.items():
+		delta = sorted(((float(le), n - b0.get(op, {}).get(le, 0)) for le, n in les.items()))
+		total = delta[-1][1] if delta else 0
+		if total <= 0:
+			continue
+
+		def at(p):
+			for le, n in delta:
+				if n >= total * p:
+					return round(le * 1e6, 1) if le != float("inf") else None
+			return None
+		ops[op] = {"count": total, "p50_us": at(0.50), "p99_us": at(0.99), "p999_us": at(0.999)}
+	return ops, r1 - r0
+
+
+def main():
+	parser = argparse.ArgumentParser(description="scripted workloads on a mounted filesystem")
+	parser.add_argument("dir", help="directory inside a mounted filesystem")
+	parser.add_argument("--workloads", default="walk,ls-l,cat,rsync-out", help="comma separated, in order")
+	parser.add_argument("--threads", type=int, default=8)
+	parser.add_argument("--seconds", type=float, default=10, help="per timed workload")
+	parser.add_argument("--into", help="directory inside the mount for rsync-in")
+	parser.add_argument("--in-files", type=int, default=100, help="files rsync-in writes")
+	parser.add_argument("--in-size", type=int, default=1024, help="bytes per rsync-in file")
+	parser.add_argument("--metrics", default=os.environ.get("HASHIFUSE_METRICS", ""), help="the mount's HASHIFUSE_METRICS")
+	parser.add_argument("--label", default="", help="copied into the output, e.g. the build")
+	args = parser.parse_args()
+
+	if not os.path.isdir(args.dir):
+		parser.error("no directory " + args.dir)
+
+	dirs, files = tree(args.dir)
+	for workload in args.workloads.split(","):
+		before = scrape(args.metrics)
+		out = {"label": args.label, "workload": workload, "dir": args.dir, "threads": args.threads}
+		lat = None
+
+		if workload in ("walk", "ls-l", "cat"):
+			op, items = {"walk": (walkOnce, [args.dir]), "ls-l": (lsl, dirs), "cat": (cat, files)}[workload]
+			if not items:
+				out["error"] = "nothing to " + workload
+				print(json.dumps(out), flush=True)
+				continue
+			start = time.perf_counter()
+			for item in items:
+				try:
+					op(item)
+				except OSError:
+					pass
+			out["cold_seconds"] = round(time.perf_counter() - start, 3)
+			before = scrape(args.metrics)
+			ops, errors, lat = timed(op, items, args.threads, args.seconds)
+			seconds = args.seconds
+			out["items"] = len(items)
+		elif workload in ("rsync-out", "rsync-in"):
+			if not shutil.which("rsync"):
+				out["error"] = "rsync not installed"
+				print(json.dumps(out), flush=True)
+				continue
+			if workload == "rsync-in" and not args.into:
+				out["error"] = "rsync-in needs --into"
+				print(json.dumps(out), flush=True)
+				continue
+			local = tempfile.mkdtemp(prefix="fsbench-")
+			try:
+				if workload == "rsync-out":
+					ops, errors, seconds = rsync(args.dir, local)
+				else:
+					# JSON values, which every backend that takes writes accepts.
+					body = json.dumps({"value": "x" * max(0, args.in_size - 13)})
+					for n in range(args.in_files):
+						with open(os.path.join(local, "in%05d" % n), "w") as f:
+							f.write(body)
+					ops, errors, seconds = rsync(local, args.into)
+			finally:
+				shutil.rmtree(local, ignore_errors=True)
+			out["threads"] = 1
+		else:
+			parser.error("unknown workload " + workload)
+
+		out.update({
+			"seconds": round(seconds, 3),
+			"ops": ops,
+			"errors": errors,
+			"ops_per_sec": round(ops / seconds, 1) if seconds else 0,
+		})
+		if lat is not None:
+			out.update({
+				"p50_us": round(percentile(lat, 0.50) * 1e6, 1),
+				"p99_us": round(percentile(lat, 0.99) * 1e6, 1),
+				"p999_us": round(percentile(lat, 0.999) * 1e6, 1),
+			})
+
+		after = scrape(args.metrics)
+		if before and after:
+			out["fuse"], out["backend_requests"] = fuseDelta(before, after)
+		print(json.dumps(out), flush=True)
+
+
+if __name__ == "__main__":
+	main()
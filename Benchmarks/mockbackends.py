@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+# Local stand-ins for every backend the HashiFUSE filesystems talk to, on
+# one port, so runs measure the filesystems rather than a real cluster.
+# Only the endpoints the binaries actually call are served:
+#
+#   Vault    /v1/sys/mounts, LIST and GET/POST of kv v1 secrets
+#   Consul   /v1/kv with ?keys&separator=/, ?raw, PUT, DELETE, blocking ?recurse
+#   Nomad    /v1/jobs, /v1/job/<id>, /v1/event/stream
+#   K8s      /api/v1/namespaces[/<ns>/<kind>[/<name>]], /apis/..., ?watch=1
+#   TFE      /api/v2/organizations, workspaces, runs and their filters
+#   OpenAPI  /openapi.json and GET of each path in it
+#
+# The data is synthetic: --dirs directories of --files values, --size bytes
+# each, shaped to what each filesystem can show.  Vault gets a kv mount per
+# dir (its getattr only nests one level), Consul kv/bench/<dir>/<file>,
+# Nomad one flat job list, K8s a namespace per dir full of pods, TFE a
+# workspace per dir full of runs and OpenAPI a /things/<name> path per value.
+# Writes are kept, so what rsync puts in reads back.  --delay-ms adds a
+# fixed service time per request, like a backend across a network.
+#
+# Example:
+#   ./mockbackends.py --port 18200 --dirs 10 --files 100 --size 2048
+
+import argparse
+import base64
+import json
+import re
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Data:
+	def __init__(self, dirs, files, size):
+		self.lock = threading.Condition()
+		self.index = 1
+		self.blob = "x" * size
+		self.dirs = ["d%02d" % d for d in range(dirs)]
+		self.files = ["f%03d" % f for f in range(files)]
+
+		# Vault: kv v1 mount per dir, plus one to rsync into.
+		self.vault = {"bench%02d/" % d: {f: {"value": self.blob} for f in self.files} for d in range(dirs)}
+		self.vault["benchin/"] = {"seed": {"value": ""}}
+
+		# Consul: raw values, "dir/" keys for empty folders.
+		self.consul = {"bench/%s/%s" % (d, f): self.blob.encode() for d in self.dirs for f in self.files}
+		self.consul["benchin/"] = b""
+		self.consulIndex = {k: 1 for k in self.consul}
+
+		self.jobs = {"job-%s-%s" % (d, f): 1 for d in self.dirs for f in self.files}
+		self.runs = {"ws%02d" % d: ["run-%02d-%03d" % (d, f) for f in range(files)] for d in range(dirs)}
+		self.k8s = {}
+
+	def bump(self):
+		self.index += 1
+		self.lock.notify_all()
+		return self.index
+
+
+class Handler(BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+	data = None
+	delay = 0.0
+
+	def log_message(self, *args):
+		pass
+
+	def reply(self, code, body=b"", headers=None):
+		if isinstance(body, str):
+			body = body.encode()
+		elif not isinstance(body, bytes):
+			body = json.dumps(body).encode()
+		self.send_response(code)
+		self.send_header("Content-Length", str(len(body)))
+		self.send_header("Content-Type", "application/json")
+		for name, value in (headers or {}).items():
+			self.send_header(name, value)
+		self.end_headers()
+		self.wfile.write(body)
+
+	def body(self):
+		return self.rfile.read(int(self.headers.get("Content-Length", 0) or 0))
+
+	# A long poll or stream that only ends when the client gives up.
+	def stream(self, lines, seconds):
+		self.send_response(200)
+		self.send_header("Transfer-Encoding", "chunked")
+		self.send_header("Content-Type", "application/json")
+		self.end_headers()
+		deadline = time.time() + seconds
+		try:
+			for line in lines:
+				self.chunk(line)
+			while time.time() < deadline:
+				time.sleep(min(5, max(0, deadline - time.time())))
+				self.chunk("{}\n")
+			self.wfile.write(b"0\r\n\r\n")
+		except OSError:
+			pass
+		self.close_connection = True
+
+	def chunk(self, text):
+		data = text.encode()
+		self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+		self.wfile.flush()
+
+	def route(self, method):
+		if self.delay:
+			time.sleep(self.delay)
+		url = urllib.parse.urlsplit(self.path)
+		path = urllib.parse.unquote(url.path)
+		query = urllib.parse.parse_qs(url.query, keep_blank_values=True)
+
+		if path == "/openapi.json":
+			return self.openapiSpec()
+		if path.startswith("/things/"):
+			return self.reply(200, {"name": path[8:], "value": self.data.blob})
+		if path.startswith("/v1/kv"):
+			return self.consulKV(method, path[6:].lstrip("/"), query)
+		if path == "/v1/jobs" or path.startswith("/v1/job/") or path == "/v1/event/stream":
+			return self.nomad(method, path, query)
+		if path.startswith("/v1/"):
+			return self.vault(method, path[4:])
+		if path.startswith("/api/v2/"):
+			return self.tfe(path[8:], query)
+		if path.startswith("/api/") or path.startswith("/apis/"):
+			return self.k8s(method, path, query)
+		self.reply(404, {"errors": ["no such endpoint"]})
+
+	def do_GET(self):
+		self.route("GET")
+
+	def do_LIST(self):
+		self.route("LIST")
+
+	def do_POST(self):
+		self.route("POST")
+
+	def do_PUT(self):
+		self.route("PUT")
+
+	def do_PATCH(self):
+		self.route("PATCH")
+
+	def do_DELETE(self):
+		self.route("DELETE")
+
+	def vault(self, method, path):
+		d = self.data
+		if path == "sys/mounts":
+			return self.reply(200, {m: {"type": "kv", "options": None, "description": ""} for m in d.vault})
+
+		mount, _, key = path.partition("/")
+		secrets = d.vault.get(mount + "/")
+		if secrets is None:
+			return self.reply(404, {"errors": []})
+
+		with d.lock:
+			if method == "LIST":
+				keys = sorted(secrets)
+				return self.reply(200, {"data": {"keys": keys}}) if keys else self.reply(404, {"errors": []})
+			if method == "GET":
+				if key not in secrets:
+					return self.reply(404, {"errors": []})
+				return self.reply(200, {"data": secrets[key], "lease_duration": 0})
+			if method in ("POST", "PUT"):
+				raw = self.body()
+				try:
+					value = json.loads(raw)
+				except ValueError:
+					value = None
+				secrets[key] = value if isinstance(value, dict) else {"value": raw.decode(errors="replace")}
+				return self.reply(204)
+			if method == "DELETE":
+				secrets.pop(key, None)
+				return self.reply(204)
+		self.reply(405, {"errors": []})
+
+	def consulKV(self, method, key, query):
+		d = self.data
+		with d.lock:
+			if method == "PUT":
+				d.consul[key] = self.body()
+				d.consulIndex[key] = d.bump()
+				return self.reply(200, "true")
+			if method == "DELETE":
+				for k in [k for k in d.consul if k == key or ("recurse" in query and k.startswith(key))]:
+					del d.consul[k]
+					del d.consulIndex[k]
+				d.bump()
+				return self.reply(200, "true")
+
+			if "recurse" in query:
+				want = int(query.get("index", ["0"])[0] or 0)
+				# Answer well inside the 5m wait the client asks for.
+				if want >= d.index:
+					d.lock.wait(30)
+				items = [{"Key": k, "ModifyIndex": d.consulIndex[k], "Value": base64.b64encode(v).decode()}
+					for k, v in d.consul.items() if k.startswith(key)]
+				return self.reply(200 if items else 404, items if items else b"", {"X-Consul-Index": str(d.index)})
+
+			if "keys" in query:
+				found = set()
+				for k in d.consul:
+					if k.startswith(key):
+						rest = k[len(key):]
+						slash = rest.find("/")
+						found.add(k if slash < 0 else key + rest[:slash + 1])
+				if not found:
+					return self.reply(404, b"", {"X-Consul-Index": str(d.index)})
+				return self.reply(200, sorted(found), {"X-Consul-Index": str(d.index)})
+
+			if key not in d.consul:
+				return self.reply(404, b"", {"X-Consul-Index": str(d.index)})
+			value = d.consul[key]
+		if "raw" in query:
+			return self.reply(200, value, {"X-Consul-Index": str(d.consulIndex.get(key, 1))})
+		self.reply(200, [{"Key": key, "Value": base64.b64encode(value).decode()}])
+
+	def nomad(self, method, path, query):
+		d = self.data
+		if path == "/v1/event/stream":
+			return self.stream([], 300)
+
+		with d.lock:
+			if path == "/v1/jobs" and method == "GET":
+				return self.reply(200, [{"ID": j, "Name": j, "JobModifyIndex": i} for j, i in sorted(d.jobs.items())])
+			if path == "/v1/jobs":
+				try:
+					job = json.loads(self.body()).get("Job", {})
+				except (ValueError, AttributeError):
+					return self.reply(400, "bad jobspec")
+				d.jobs[job.get("ID", "job-%d" % d.index)] = d.bump()
+				return self.reply(200, {"EvalID": "", "JobModifyIndex": d.index})
+
+			job = path[len("/v1/job/"):]
+			if job not in d.jobs:
+				return self.reply(404, "job not found")
+			if method == "DELETE":
+				del d.jobs[job]
+				d.bump()
+				return self.reply(200, {"EvalID": ""})
+			index = d.jobs[job]
+		self.reply(200, json.dumps({"ID": job, "Name": job, "Type": "service", "JobModifyIndex": index,
+			"Meta": {"blob": d.blob}}, indent=4))
+
+	def k8sItem(self, ns, kind, name):
+		return {"metadata": {"name": name, "namespace": ns, "resourceVersion": "1",
+			"creationTimestamp": "2026-01-01T00:00:00Z"}, "spec": {"blob": self.data.blob}}
+
+	def k8s(self, method, path, query):
+		d = self.data
+		if "watch" in query:
+			return self.stream([json.dumps({"type": "BOOKMARK", "object": {"metadata": {"resourceVersion": "1"}}}) + "\n"],
+				min(300, int(query.get("timeoutSeconds", ["300"])[0])))
+
+		m = re.match(r"^/(api/v1|apis/[^/]+/[^/]+)/namespaces(?:/([^/]+)(?:/([^/]+)(?:/([^/]+))?)?)?$", path)
+		if not m:
+			return self.reply(404, {"kind": "Status", "code": 404})
+		version, ns, kind, name = m.groups()
+		apiVersion = "v1" if version == "api/v1" else version[5:]
+
+		if not ns:
+			return self.reply(200, {"kind": "NamespaceList", "apiVersion": "v1",
+				"items": [{"metadata": {"name": n}} for n in d.dirs]})
+		if ns not in d.dirs or not kind:
+			return self.reply(404, {"kind": "Status", "code": 404})
+
+		with d.lock:
+			extra = d.k8s.setdefault((ns, kind), {})
+			if method in ("PUT", "POST"):
+				extra[name or "item-%d" % d.bump()] = self.body()
+				return self.reply(201, {"kind": "Status", "code": 201})
+			if method == "DELETE":
+				extra.pop(name, None)
+				return self.reply(200, {"kind": "Status", "code": 200})
+			names = (d.files if kind == "pods" else []) + sorted(extra)
+
+		listKind = kind[:1].upper() + kind[1:-1] + "List"
+		if not name:
+			return self.reply(200, {"kind": listKind, "apiVersion": apiVersion,
+				"items": [self.k8sItem(ns, kind, n) for n in names]})
+		if name not in names:
+			return self.reply(404, {"kind": "Status", "code": 404})
+		item = self.k8sItem(ns, kind, name)
+		item["kind"] = listKind[:-4]
+		item["apiVersion"] = apiVersion
+		self.reply(200, item)
+
+	def tfe(self, path, query):
+		d = self.data
+		parts = path.split("/")
+		if path == "organizations":
+			return self.reply(200, {"data": [{"id": "bench", "type": "organizations", "attributes": {"name": "bench"}}]})
+		if len(parts) == 3 and parts[0] == "organizations" and parts[1] == "bench":
+			items = d.runs if parts[2] == "workspaces" else {}
+			return self.reply(200, {"data": [{"id": "ws-" + w, "attributes": {"name": w}} for w in sorted(items)]})
+		if len(parts) == 1:
+			ws = query.get("filter[workspace][name]", [""])[0]
+			ids = d.runs.get(ws, []) if parts[0] == "runs" else []
+			return self.reply(200, {"data": [{"id": i, "type": parts[0]} for i in ids]})
+		if len(parts) == 2 and parts[0] == "runs":
+			return self.reply(200, {"data": {"id": parts[1], "type": "runs", "attributes": {"message": d.blob}}})
+		self.reply(404, {"errors": [{"status": "404"}]})
+
+	def openapiSpec(self):
+		d = self.data
+		paths = {"/things/%s-%s" % (dd, f): {"description": "Thing %s-%s" % (dd, f),
+			"get": {"summary": "Read a thing"}} for dd in d.dirs for f in d.files}
+		self.reply(200, {"openapi": "3.0.0", "info": {"title": "bench", "version": "1"}, "paths": paths})
+
+
+def main():
+	parser = argparse.ArgumentParser(description="mock Vault, Consul, Nomad, K8s, TFE and OpenAPI backends")
+	parser.add_argument("--port", type=int, default=18200)
+	parser.add_argument("--bind", default="127.0.0.1")
+	parser.add_argument("--dirs", type=int, default=10)
+	parser.add_argument("--files", type=int, default=100, help="values per dir")
+	parser.add_argument("--size", type=int, default=1024, help="bytes per value")
+	parser.add_argument("--delay-ms", type=float, default=0, help="added to every request")
+	args = parser.parse_args()
+
+	Handler.data = Data(args.dirs, args.files, args.size)
+	Handler.delay = args.delay_ms / 1000
+	ThreadingHTTPServer.daemon_threads = True
+	ThreadingHTTPServer.request_queue_size = 128
+	server = ThreadingHTTPServer((args.bind, args.port), Handler)
+	try:
+		server.serve_forever()
+	except KeyboardInterrupt:
+		pass
+
+
+if __name__ == "__main__":
+	main()
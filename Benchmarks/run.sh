@@ -0,0 +1,118 @@
+#!/bin/bash
+# Mount every HashiFUSE filesystem against mockbackends.py and run the
+# fsbench.py workloads on each, so builds can be compared on one machine
+# without a cluster.  Prints one JSON line per filesystem and workload, and
+# with -o also writes them as one JSON report.
+#
+# Usage: ./run.sh [-o report.json] [fs[=binary] ...]
+#   fs is vault, consul, nomad, k8s, tfe or openapi (default all of them),
+#   and the binary defaults to the one make builds in its directory.
+#
+# Env: THREADS (8), SECONDS_ (10), DIRS (10), FILES (100), SIZE (1024),
+# DELAY_MS (0) added to every mock request, PORT (18200), LABEL.
+# Needs fusermount/fusermount3 and rsync for the rsync workloads.
+
+HERE=$(dirname "$(readlink -f "$0")")
+REPO=$(dirname "$HERE")
+THREADS=${THREADS:-8}
+SECONDS_=${SECONDS_:-10}
+PORT=${PORT:-18200}
+B=http://127.0.0.1:$PORT
+REPORT=
+
+if [ "$1" = "-o" ]; then
+	REPORT=$2
+	shift 2
+fi
+[ $# -eq 0 ] && set -- vault consul nomad k8s tfe openapi
+
+TMP=$(mktemp -d)
+trap 'kill $MOCK 2>/dev/null; rm -rf "$TMP"' EXIT
+
+"$HERE/mockbackends.py" --port "$PORT" --dirs "${DIRS:-10}" --files "${FILES:-100}" \
+	--size "${SIZE:-1024}" --delay-ms "${DELAY_MS:-0}" 2>"$TMP/mock.log" &
+MOCK=$!
+for i in $(seq 50); do
+	curl -s -o /dev/null "$B/v1/sys/mounts" && break
+	sleep 0.1
+done
+
+# fs -> binary, env, mount options, fusermount, dir under the mount, rsync-in dir
+setup()
+{
+	case $1 in
+	vault)
+		BIN=VaultFS/vaultfs; UNMOUNT=fusermount; DIR=; INTO=benchin
+		ENV="VAULT_ADDR=$B VAULT_TOKEN=bench";;
+	consul)
+		BIN=ConsulFS/consulfs; UNMOUNT=fusermount3; DIR=kv/bench; INTO=kv/benchin
+		ENV="CONSUL_HTTP_ADDR=$B CONSUL_HTTP_TOKEN=bench";;
+	nomad)
+		BIN=NomadFS/nomadfs; UNMOUNT=fusermount; DIR=job; INTO=
+		ENV="NOMAD_ADDR=$B";;
+	k8s)
+		BIN=K8sFS/k8sfs; UNMOUNT=fusermount3; DIR=; INTO=
+		ENV="KUBE_APISERVER=$B";;
+	tfe)
+		# TFEFS and OpenAPIFS report size 0 until read.
+		BIN=TFEFS/tfefs; UNMOUNT=fusermount; DIR=organizations/bench/workspaces; INTO=
+		ENV="TFE_ADDR=$B TFE_TOKEN=bench"; OPTS="-o direct_io";;
+	openapi)
+		BIN=OpenAPIFS/openapifs; UNMOUNT=fusermount; DIR=things; INTO=
+		ENV="API_ADDR=$B API_SPEC=$B/openapi.json"; OPTS="-o direct_io";;
+	*)
+		return 1;;
+	esac
+	BIN=$REPO/$BIN
+}
+
+for arg in "$@"; do
+	fs=${arg%%=*}
+	OPTS=
+	if ! setup "$fs"; then
+		echo "unknown filesystem $fs" >&2
+		continue
+	fi
+	[ "$arg" != "$fs" ] && BIN=$(readlink -f "${arg#*=}")
+	if [ ! -x "$BIN" ]; then
+		echo "skipping $fs, no $BIN (make it first)" >&2
+		continue
+	fi
+
+	MNT=$TMP/$fs
+	SOCK=unix://$TMP/$fs.sock
+	WORKLOADS=walk,ls-l,cat,rsync-out
+	[ -n "$INTO" ] && WORKLOADS=$WORKLOADS,rsync-in
+	mkdir -p "$MNT"
+
+	env $ENV HASHIFUSE_METRICS="$SOCK" "$BIN" $OPTS "$MNT" || continue
+	for i in $(seq 50); do
+		mountpoint -q "$MNT" && break
+		sleep 0.1
+	done
+	if ! mountpoint -q "$MNT"; then
+		echo "skipping $fs, $MNT didn't mount" >&2
+		continue
+	fi
+
+	"$HERE/fsbench.py" --threads "$THREADS" --seconds "$SECONDS_" --metrics "$SOCK" \
+		--workloads "$WORKLOADS" ${INTO:+--into "$MNT/$INTO"} --label "${LABEL:-$fs}" \
+		"$MNT/$DIR" | sed "s/^{/{\"fs\": \"$fs\", /" | tee -a "$TMP/results.jsonl"
+
+	$UNMOUNT -u "$MNT"
+	sleep 1
+done
+
+if [ -n "$REPORT" ]; then
+	python3 - "$TMP/results.jsonl" "$REPORT" <<-EOF
+		import json, os, platform, sys, time
+		results = [json.loads(l) for l in open(sys.argv[1])] if os.path.exists(sys.argv[1]) else []
+		json.dump({
+			"date": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+			"host": platform.node(),
+			"kernel": platform.release(),
+			"mock": {"dirs": ${DIRS:-10}, "files": ${FILES:-100}, "size": ${SIZE:-1024}, "delay_ms": ${DELAY_MS:-0}},
+			"results": results,
+		}, open(sys.argv[2], "w"), indent=1)
+	EOF
+fi
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# Metadata op throughput on a mounted HashiFUSE filesystem.
+# Threads stat every entry under a directory over and over for a fixed
+# time, like "ls -l" or find storms do.  Prints one JSON object so runs
+# can be compared or collected by other scripts.
+#
+# Example:
+#   ./statbench.py --threads 16 --seconds 10 ~/consul/kv/app
+
+import argparse
+import json
+import os
+import threading
+import time
+
+
+def walk(root, limit):
+	paths = []
+	for dirpath, dirnames, filenames in os.walk(root):
+		for name in dirnames + filenames:
+			paths.append(os.path.join(dirpath, name))
+			if len(paths) >= limit:
+				return paths
+	return paths
+
+
+def worker(paths, deadline, offset, out):
+	ops = errors = 0
+	lat = []
+	i = offset
+
+	while True:
+		start = time.perf_counter()
+		if start >= deadline:
+			break
+		try:
+			os.stat(paths[i % len(paths)])
+		except OSError:
+			errors += 1
+		lat.append(time.perf_counter() - start)
+		ops += 1
+		i += 1
+
+	out.append((ops, errors, lat))
+
+
+def percentile(sorted_lat, p):
+	if not sorted_lat:
+		return 0.0
+	return sorted_lat[min(len(sorted_lat) - 1, int(len(sorted_lat) * p))]
+
+
+def main():
+	parser = argparse.ArgumentParser(description="stat throughput under a directory")
+	parser.add_argument("dir", help="directory inside a mounted filesystem")
+	parser.add_argument("--threads", type=int, default=8)
+	parser.add_argument("--seconds", type=float, default=10)
+	parser.add_argument("--files", type=int, default=1000, help="max entries to cycle through")
+	parser.add_argument("--label", default="", help="copied into the output, e.g. the transport")
+	args = parser.parse_args()
+
+	paths = walk(args.dir, args.files)
+	if not paths:
+		parser.error("nothing to stat under " + args.dir)
+
+	# One pass first so lookups and caches are warm in every run.
+	for p in paths:
+		try:
+			os.stat(p)
+		except OSError:
+			pass
+
+	results = []
+	deadline = time.perf_counter() + args.seconds
+	threads = [threading.Thread(target=worker, args=(paths, deadline, n * len(paths) // args.threads, results))
+		for n in range(args.threads)]
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+
+	ops = sum(r[0] for r in results)
+	lat = sorted(l for r in results for l in r[2])
+	print(json.dumps({
+		"label": args.label,
+		"dir": args.dir,
+		"entries": len(paths),
+		"threads": args.threads,
+		"seconds": args.seconds,
+		"ops": ops,
+		"errors": sum(r[1] for r in results),
+		"ops_per_sec": round(ops / args.seconds, 1),
+		"p50_us": round(percentile(lat, 0.50) * 1e6, 1),
+		"p99_us": round(percentile(lat, 0.99) * 1e6, 1),
+		"p999_us": round(percentile(lat, 0.999) * 1e6, 1),
+	}))
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Compare metadata op throughput over the classic /dev/fuse loop and
+# io_uring queues (HASHIFUSE_IO_URING=true) for ConsulFS or K8sFS.
+# The binary and its backend env vars (CONSUL_HTTP_ADDR etc) are as usual.
+#
+# Usage: ./transport.sh ../ConsulFS/consulfs kv/app [threads] [seconds]
+# Needs Linux 6.14+ with fuse.enable_uring=1 and libfuse 3.18+ for the
+# io_uring run to differ.  Check the FS log for "fuse transport io_uring".
+
+BIN=$(readlink -f "$1")
+SUBDIR=$2
+THREADS=${3:-16}
+SECONDS_=${4:-10}
+HERE=$(dirname "$(readlink -f "$0")")
+MNT=$(mktemp -d)
+
+if [ ! -x "$BIN" ] || [ -z "$SUBDIR" ]; then
+	echo "usage: $0 <fs binary> <dir under the mount> [threads] [seconds]" >&2
+	exit 1
+fi
+
+run()
+{
+	local label=$1
+	shift
+
+	env "$@" "$BIN" "$MNT" || exit 1
+	sleep 1
+	"$HERE/statbench.py" --threads "$THREADS" --seconds "$SECONDS_" --label "$label" "$MNT/$SUBDIR"
+	fusermount3 -u "$MNT"
+	sleep 1
+}
+
+run dev-fuse HASHIFUSE_IO_URING=false
+run io_uring HASHIFUSE_IO_URING=true
+rmdir "$MNT"
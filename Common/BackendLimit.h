@@ -0,0 +1,143 @@
+﻿/****************************************************************************
+**
+** BackendLimit - cap on requests in flight to each backend.
+**
+** Header only, include from any of the HashiFUSE main.cpp files after fuse.h
+** or fuse_lowlevel.h.
+**
+** FUSE worker threads and backend connections are different budgets.  64
+** workers help when the kernel has many stats queued, but 64 simultaneous
+** GETs against one Vault or Consul server only make its tail latency worse.
+** With a cap, a request past it waits for a slot before it goes out.
+** Singleflight followers and cache hits never take one, so the cap is on
+** real backend load.
+**
+** Set with -o max_inflight=N (see parse()) or HASHIFUSE_MAX_INFLIGHT.
+** 0, the default, is unlimited.  Per backend counters (now in flight, peak,
+** how many requests had to wait and for how long) are in stats().
+**
+** Environment Variables:
+	HASHIFUSE_MAX_INFLIGHT	requests in flight per backend.  Default 0, unlimited.
+****************************************************************************/
+
+#ifndef BACKEND_LIMIT
+#define BACKEND_LIMIT
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdlib.h>
+#include "CurlPool.h"
+#include "Trace.h"
+
+class BackendLimit
+{
+public:
+	BackendLimit() : max(0)
+	{
+		if (getenv("HASHIFUSE_MAX_INFLIGHT"))
+			max = atoi(getenv("HASHIFUSE_MAX_INFLIGHT"));
+	}
+
+	// Holds one slot for the backend of url until it goes out of scope.
+	class Slot
+	{
+	public:
+		Slot(BackendLimit &limit, const std::string &url) : limit(limit), backend(CurlPool::origin(url))
+		{
+			limit.acquire(backend);
+		}
+
+		~Slot()
+		{
+			limit.release(backend);
+		}
+
+	private:
+		Slot(const Slot&);
+		Slot &operator=(const Slot&);
+
+		BackendLimit &limit;
+		const std::string backend;
+	};
+
+	// Take -o max_inflight=N out of the mount options.  Call before
+	// fuse_main or fuse_parse_cmdline, which would reject it.
+	int parse(struct fuse_args *args)
+	{
+		static const struct fuse_opt specs[] =
+		{
+			{ "max_inflight=%d", 0, 0 },
+			FUSE_OPT_END
+		};
+
+		return fuse_opt_parse(args, &max, specs, NULL);
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::string out = "backend limit max_inflight=" + std::to_string(max);
+		std::lock_guard<std::mutex> lk(lock);
+
+		for (std::map<std::string, Backend>::iterator it = backends.begin(); it != backends.end(); ++it)
+		{
+			const Backend &b = it->second;
+			out += " [" + it->first
+				+ " inflight=" + std::to_string(b.inflight)
+				+ " peak=" + std::to_string(b.peak)
+				+ " waited=" + std::to_string(b.waited)
+				+ " wait_ms=" + std::to_string(b.waitMs) + "]";
+		}
+		return out;
+	}
+
+	int max;
+
+private:
+	struct Backend
+	{
+		Backend() : inflight(0), peak(0), waited(0), waitMs(0)
+		{
+		}
+
+		int inflight, peak;
+		unsigned long waited, waitMs;
+		std::condition_variable freed;
+	};
+
+	void acquire(const std::string &backend)
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		Backend &b = backends[backend];
+
+		if (max > 0 && b.inflight >= max)
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			Trace::Span span("lock", "backend slot wait");
+
+			++b.waited;
+			b.freed.wait(lk, [&] { return b.inflight < max; });
+			b.waitMs += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		if (++b.inflight > b.peak)
+			b.peak = b.inflight;
+	}
+
+	void release(const std::string &backend)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Backend &b = backends[backend];
+
+		--b.inflight;
+		b.freed.notify_one();
+	}
+
+	std::mutex lock;
+	std::map<std::string, Backend> backends;
+};
+
+#endif
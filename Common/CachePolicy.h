@@ -0,0 +1,151 @@
+﻿/****************************************************************************
+**
+** CachePolicy - how long each class of path may be cached.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** One lifetime for everything is wrong both ways: a Vault mount list or a
+** TFE org list changes a few times a year, a Consul key can change every
+** second.  Each filesystem has a small table of path patterns and how long
+** matching entries stay cached, and users can put their own rules ahead of
+** it with an environment variable (VAULTFS_CACHE_POLICY and so on, see
+** the example below the includes).
+**
+** Rules are pattern=lifetime separated by ';', first match wins.  In a
+** pattern '*' matches within one path segment and '**' matches across
+** them.  A lifetime is seconds with an optional s, m, h or d suffix, or
+** "index" for "until the backend says it changed" where a filesystem can
+** tell (NomadFS job modify indexes).  Elsewhere "index" means until we
+** change or drop it ourselves.
+****************************************************************************/
+
+#ifndef CACHE_POLICY
+#define CACHE_POLICY
+
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+// VAULTFS_CACHE_POLICY="/=10m;/secret/**=30s;/sys/**=1m"
+class CachePolicy
+{
+public:
+	// Returned by ttl() for "index" rules.
+	enum { INDEX = -1 };
+
+	CachePolicy(const char *env, const char *defaults)
+	{
+		if (getenv(env))
+			parse(getenv(env));
+		parse(defaults);
+	}
+
+	// Seconds entries under path may be cached, INDEX, or fallback if no rule matches.
+	double ttl(const std::string &path, double fallback) const
+	{
+		for (std::vector<Rule>::const_iterator it = rules.begin(); it != rules.end(); ++it)
+			if (match(it->pattern.c_str(), path.c_str()))
+				return it->seconds;
+		return fallback;
+	}
+
+	// One line summary for logs.
+	std::string stats() const
+	{
+		std::string out = "cache policy";
+
+		for (std::vector<Rule>::const_iterator it = rules.begin(); it != rules.end(); ++it)
+			out += " " + it->pattern + "="
+				+ (it->seconds == INDEX ? std::string("index") : std::to_string((long) it->seconds) + "s");
+		return out;
+	}
+
+private:
+	struct Rule
+	{
+		std::string pattern;
+		double seconds;
+	};
+
+	void parse(const std::string &spec)
+	{
+		size_t start = 0, end;
+
+		for (; start < spec.size(); start = end + 1)
+		{
+			if ((end = spec.find(';', start)) == std::string::npos)
+				end = spec.size();
+
+			const std::string rule = spec.substr(start, end - start);
+			const size_t eq = rule.rfind('=');
+			if (eq == std::string::npos || eq == 0)
+				continue;
+
+			Rule r;
+			r.pattern = rule.substr(0, eq);
+			if (!lifetime(rule.substr(eq + 1), r.seconds))
+				continue;
+			rules.push_back(r);
+		}
+	}
+
+	static bool lifetime(const std::string &value, double &seconds)
+	{
+		char *unit;
+
+		if (value == "index")
+		{
+			seconds = INDEX;
+			return true;
+		}
+
+		seconds = strtod(value.c_str(), &unit);
+		if (unit == value.c_str() || seconds < 0)
+			return false;
+
+		switch (*unit)
+		{
+			case 'd':	seconds *= 24;	// Fall through
+			case 'h':	seconds *= 60;	// Fall through
+			case 'm':	seconds *= 60;	// Fall through
+			case 's':
+			case '\0':	return true;
+		}
+		return false;
+	}
+
+	// '*' stays inside a segment, '**' doesn't.
+	static bool match(const char *pattern, const char *path)
+	{
+		if (*pattern == '\0')
+			return *path == '\0';
+
+		if (pattern[0] == '*' && pattern[1] == '*')
+		{
+			for (const char *p = path; ; ++p)
+			{
+				if (match(pattern + 2, p))
+					return true;
+				if (*p == '\0')
+					return false;
+			}
+		}
+
+		if (*pattern == '*')
+		{
+			for (const char *p = path; ; ++p)
+			{
+				if (match(pattern + 1, p))
+					return true;
+				if (*p == '\0' || *p == '/')
+					return false;
+			}
+		}
+
+		return *pattern == *path && match(pattern + 1, path + 1);
+	}
+
+	std::vector<Rule> rules;
+};
+
+#endif
@@ -0,0 +1,284 @@
+﻿/****************************************************************************
+**
+** ChangeFeed - background watches that invalidate caches as the backend
+** changes.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** A cache lifetime is a guess at how stale a read may be.  With a change
+** feed the backend says what changed instead: a Consul blocking query on
+** /v1/kv, a K8s watch or the Nomad event stream.  Each watch function runs
+** on its own thread, makes one long request with perform(), drops the
+** paths it names from our caches and tells the kernel where it can
+** (fuse_lowlevel_notify_inval_*), then returns to be called again.  So
+** watched paths can be cached with "index" lifetimes (see CachePolicy.h)
+** and still never serve a change once the feed has seen it.
+**
+** A watch that fails backs off from 1s up to a minute.  live() says
+** whether every watch is currently connected, so a filesystem can go back
+** to polling while one isn't.
+**
+** start() must be called after FUSE has daemonized (ie in init), as threads
+** don't survive the fork.  stop() aborts requests in flight within a second.
+****************************************************************************/
+
+#ifndef CHANGE_FEED
+#define CHANGE_FEED
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include <string.h>
+#include <strings.h>
+#include <curl/curl.h>
+
+class ChangeFeed
+{
+public:
+	// Body of a response, one line at a time as it arrives.
+	typedef std::function<void(const std::string &line)> Lines;
+
+	ChangeFeed() : active(false), events(0), invalidations(0), failures(0)
+	{
+	}
+
+	~ChangeFeed()
+	{
+		stop();
+	}
+
+	// Add a watch before start().  It returns false on failure to back off
+	// before the next call.
+	void watch(const std::string &name, const std::function<bool()> &fn)
+	{
+		watches.emplace_back(name, fn);
+	}
+
+	bool empty() const
+	{
+		return watches.empty();
+	}
+
+	// Spin up a thread per watch.
+	void start()
+	{
+		if (active || watches.empty())
+			return;
+
+		active = true;
+		for (std::list<Watch>::iterator w = watches.begin(); w != watches.end(); ++w)
+			w->thread = std::thread(&ChangeFeed::loop, this, &*w);
+	}
+
+	void stop()
+	{
+		if (!active)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			active = false;
+		}
+		wake.notify_all();
+
+		for (std::list<Watch>::iterator w = watches.begin(); w != watches.end(); ++w)
+			w->thread.join();
+	}
+
+	// stop() was called, so a failed request isn't worth logging.
+	bool stopped() const
+	{
+		return !active;
+	}
+
+	// Every watch is connected and caught up to its last response.
+	bool live() const
+	{
+		if (!active || watches.empty())
+			return false;
+
+		for (std::list<Watch>::const_iterator w = watches.begin(); w != watches.end(); ++w)
+			if (!w->live)
+				return false;
+		return true;
+	}
+
+	// Blocking transfer of a prepared handle on the watch's own thread.
+	// Complete lines of the body go to lines as they arrive, any remainder
+	// at the end.  Response headers are appended to headers if given.
+	// Returns the HTTP code, or -1 if the request failed or was stopped.
+	long perform(CURL *curl, const Lines &lines, std::string *headers = NULL)
+	{
+		Transfer t(this, lines);
+		long code = 0;
+
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		if (headers)
+		{
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, collect);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, headers);
+		}
+
+		t.curl = curl;
+		const CURLcode res = curl_easy_perform(curl);
+		if (!t.partial.empty())
+			lines(t.partial);
+
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		if (res != CURLE_OK || code < 200 || code >= 300)
+		{
+			current()->live = false;
+			return (res == CURLE_OK) ? code : -1;
+		}
+		return code;
+	}
+
+	// Value of header name in a block collected by perform(), or "".
+	static std::string header(const std::string &headers, const char *name)
+	{
+		const size_t len = strlen(name);
+
+		for (size_t start = 0, end; start < headers.size(); start = end + 1)
+		{
+			if ((end = headers.find('\n', start)) == std::string::npos)
+				end = headers.size();
+
+			if (end - start > len && headers[start + len] == ':' && !strncasecmp(&headers[start], name, len))
+			{
+				size_t from = headers.find_first_not_of(" \t", start + len + 1);
+				size_t to = headers.find_last_not_of(" \t\r", end - 1);
+				return (from == std::string::npos || to < from) ? "" : headers.substr(from, to - from + 1);
+			}
+		}
+		return "";
+	}
+
+	// Count what a watch did with a response.
+	void changed(unsigned long paths)
+	{
+		++events;
+		invalidations += paths;
+	}
+
+	// One line summary for logs.
+	std::string stats() const
+	{
+		std::string out = "change feed events=" + std::to_string(events.load())
+			+ " invalidated=" + std::to_string(invalidations.load())
+			+ " failures=" + std::to_string(failures.load());
+
+		for (std::list<Watch>::const_iterator w = watches.begin(); w != watches.end(); ++w)
+			out += " [" + w->name + (w->live ? " live]" : " down]");
+		return out;
+	}
+
+private:
+	struct Watch
+	{
+		Watch(const std::string &name, const std::function<bool()> &fn) : name(name), fn(fn), live(false)
+		{
+		}
+
+		std::string name;
+		std::function<bool()> fn;
+		std::thread thread;
+		std::atomic<bool> live;
+	};
+
+	struct Transfer
+	{
+		Transfer(ChangeFeed *feed, const Lines &lines) : feed(feed), lines(lines), curl(NULL)
+		{
+		}
+
+		ChangeFeed *feed;
+		const Lines &lines;
+		CURL *curl;
+		std::string partial;
+	};
+
+	// The watch running on this thread.
+	static Watch *&current()
+	{
+		static thread_local Watch *w = NULL;
+		return w;
+	}
+
+	void loop(Watch *w)
+	{
+		std::chrono::seconds delay(1);
+
+		current() = w;
+		while (active)
+		{
+			if (w->fn())
+			{
+				delay = std::chrono::seconds(1);
+				continue;
+			}
+
+			w->live = false;
+			if (!active)
+				break;
+			++failures;
+
+			std::unique_lock<std::mutex> lk(lock);
+			wake.wait_for(lk, delay, [this] { return !active; });
+			delay = std::min(delay * 2, std::chrono::seconds(60));
+		}
+		w->live = false;
+	}
+
+	static size_t body(const char *in, size_t size, size_t num, void *data)
+	{
+		Transfer *t = (Transfer*) data;
+		long code = 0;
+		size_t start = 0, nl;
+
+		// Only a good response means the feed is caught up.
+		curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+		if (code >= 200 && code < 300)
+			current()->live = true;
+
+		t->partial.append(in, size * num);
+		while ((nl = t->partial.find('\n', start)) != std::string::npos)
+		{
+			if (nl > start)
+				t->lines(t->partial.substr(start, nl - start));
+			start = nl + 1;
+		}
+		t->partial.erase(0, start);
+		return size * num;
+	}
+
+	static size_t collect(const char *in, size_t size, size_t num, void *data)
+	{
+		((std::string*) data)->append(in, size * num);
+		return size * num;
+	}
+
+	// Called at least once a second even on an idle stream.
+	static int progress(void *data, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+	{
+		return ((ChangeFeed*) data)->active ? 0 : 1;
+	}
+
+	std::list<Watch> watches;
+	std::atomic<bool> active;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::atomic<unsigned long> events, invalidations, failures;
+};
+
+#endif
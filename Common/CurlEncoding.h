@@ -0,0 +1,94 @@
+﻿/****************************************************************************
+**
+** CurlEncoding - negotiated response compression with per backend stats.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Asks for every Content-Encoding this libcurl was built with (gzip and
+** deflate, plus br and zstd where available).  libcurl decodes chunk by
+** chunk before the write callback, so responses still stream straight
+** into the body string and never exist compressed in memory as a whole.
+** Terraform state, K8s lists and OpenAPI specs compress very well.
+**
+** Set HASHIFUSE_COMPRESS=false to turn it off (e.g. to debug on the wire).
+** count() tallies wire bytes against decoded bytes per backend.
+****************************************************************************/
+
+#ifndef CURL_ENCODING
+#define CURL_ENCODING
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <stdlib.h>
+#include <curl/curl.h>
+#include "CurlPool.h"
+
+class CurlEncoding
+{
+public:
+	CurlEncoding() : enabled(true)
+	{
+		const char *env = getenv("HASHIFUSE_COMPRESS");
+
+		if (env && (std::string(env) == "false" || std::string(env) == "0"))
+			enabled = false;
+	}
+
+	// Needs doing on every handle from the pool: curl_easy_reset puts
+	// ACCEPT_ENCODING back to its default, like every other option.
+	void prepare(CURL *curl)
+	{
+		// "" means every encoding libcurl supports.
+		if (enabled)
+			curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	}
+
+	// Tally a finished transfer.  decoded is what landed in the body.
+	void count(CURL *curl, const std::string &url, size_t decoded)
+	{
+		curl_off_t wire = 0;
+
+		if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire) != CURLE_OK)
+			return;
+
+		std::lock_guard<std::mutex> lk(lock);
+		Bytes &bytes = backends[CurlPool::origin(url)];
+		bytes.wire += wire;
+		bytes.decoded += decoded;
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::string out = "curl encoding enabled=" + std::to_string(enabled);
+		std::lock_guard<std::mutex> lk(lock);
+
+		for (std::map<std::string, Bytes>::iterator it = backends.begin(); it != backends.end(); ++it)
+		{
+			const Bytes &b = it->second;
+			out += " " + it->first
+				+ " wire=" + std::to_string(b.wire)
+				+ " decoded=" + std::to_string(b.decoded)
+				+ " saved=" + std::to_string(b.decoded > b.wire ? b.decoded - b.wire : 0);
+		}
+		return out;
+	}
+
+	bool enabled;
+
+private:
+	struct Bytes
+	{
+		Bytes() : wire(0), decoded(0)
+		{
+		}
+
+		unsigned long long wire, decoded;
+	};
+
+	std::mutex lock;
+	std::map<std::string, Bytes> backends;
+};
+
+#endif
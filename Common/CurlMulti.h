@@ -0,0 +1,216 @@
+﻿/****************************************************************************
+**
+** CurlMulti - curl_multi event loop shared by all FUSE worker threads.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Worker threads set up an easy handle as usual, then submit() it and wait
+** on the returned future instead of calling curl_easy_perform under a global
+** mutex.  A single event loop thread drives every transfer through one
+** curl_multi handle, so concurrent FUSE ops actually go out in parallel.
+**
+** start() must be called after FUSE has daemonized (ie in init), as threads
+** don't survive the fork.  Until then perform() falls back to a blocking
+** curl_easy_perform on the calling thread.
+**
+** Optional HTTP/2 mode multiplexes every concurrent request to a backend
+** over a single connection instead of one HTTP/1.1 connection each.
+**
+** Environment Variables:
+	HASHIFUSE_HTTP2		opt in to HTTP/2.  "true" negotiates h2 via TLS ALPN,
+						"prior-knowledge" also speaks h2c to plain http:// addrs.
+****************************************************************************/
+
+#ifndef CURL_MULTI
+#define CURL_MULTI
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include "Trace.h"
+
+class CurlMulti
+{
+public:
+	CurlMulti() : multi(NULL), running(false), httpVersion(0)
+	{
+		const char *h2 = getenv("HASHIFUSE_HTTP2");
+
+		if (h2 && !strcmp(h2, "prior-knowledge"))
+			httpVersion = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+		else if (h2 && (!strcmp(h2, "true") || !strcmp(h2, "1")))
+			httpVersion = CURL_HTTP_VERSION_2TLS;
+	}
+
+	~CurlMulti()
+	{
+		stop();
+	}
+
+	// Spin up the event loop thread.
+	bool start()
+	{
+		if (running)
+			return true;
+
+		if (!(multi = curl_multi_init()))
+			return false;
+
+		// One connection per backend, every request multiplexed over it.
+		if (httpVersion)
+		{
+			curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+			curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+		}
+
+		running = true;
+		worker = std::thread(&CurlMulti::loop, this);
+		return true;
+	}
+
+	// Stop the event loop.  Anything still queued or in flight is aborted.
+	void stop()
+	{
+		if (!running)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			running = false;
+		}
+		curl_multi_wakeup(multi);
+		worker.join();
+
+		for (std::map<CURL*, std::promise<CURLcode> >::iterator it = transfers.begin(); it != transfers.end(); ++it)
+		{
+			curl_multi_remove_handle(multi, it->first);
+			it->second.set_value(CURLE_ABORTED_BY_CALLBACK);
+		}
+		transfers.clear();
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			for (size_t i = 0; i < pending.size(); ++i)
+				pending[i].second.set_value(CURLE_ABORTED_BY_CALLBACK);
+			pending.clear();
+		}
+
+		curl_multi_cleanup(multi);
+		multi = NULL;
+	}
+
+	// Per request HTTP/2 options.  Call on each handle before submit().
+	// PIPEWAIT makes a new request wait for the existing connection
+	// to confirm multiplexing rather than racing to open another.
+	void prepare(CURL *curl)
+	{
+		if (!httpVersion)
+			return;
+
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, httpVersion);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+
+	bool http2()
+	{
+		return httpVersion != 0;
+	}
+
+	// Queue a fully configured easy handle.  The handle belongs to the
+	// event loop until the future is ready.
+	std::future<CURLcode> submit(CURL *curl)
+	{
+		std::promise<CURLcode> done;
+		std::future<CURLcode> result = done.get_future();
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			if (running)
+			{
+				pending.push_back(std::make_pair(curl, std::move(done)));
+				curl_multi_wakeup(multi);
+				return result;
+			}
+		}
+
+		// No event loop (yet), just do it on this thread.
+		done.set_value(curl_easy_perform(curl));
+		return result;
+	}
+
+	// Blocking convenience wrapper for FUSE ops.
+	CURLcode perform(CURL *curl)
+	{
+		Trace::Span span("http", "curl perform");
+		return submit(curl).get();
+	}
+
+	// Handy for tuning the multi handle (pipelining, connection caps).
+	CURLM* handle()
+	{
+		return multi;
+	}
+
+private:
+	void loop()
+	{
+		int still, msgs;
+		CURLMsg *msg;
+
+		while (running)
+		{
+			// Pick up new submissions.
+			{
+				std::lock_guard<std::mutex> lk(lock);
+				for (size_t i = 0; i < pending.size(); ++i)
+				{
+					CURL *curl = pending[i].first;
+					if (curl_multi_add_handle(multi, curl) == CURLM_OK)
+						transfers[curl] = std::move(pending[i].second);
+					else
+						pending[i].second.set_value(CURLE_FAILED_INIT);
+				}
+				pending.clear();
+			}
+
+			curl_multi_perform(multi, &still);
+
+			// Hand back anything finished.
+			while ((msg = curl_multi_info_read(multi, &msgs)))
+			{
+				if (msg->msg != CURLMSG_DONE)
+					continue;
+
+				CURL *curl = msg->easy_handle;
+				CURLcode res = msg->data.result;
+				curl_multi_remove_handle(multi, curl);
+
+				std::map<CURL*, std::promise<CURLcode> >::iterator it = transfers.find(curl);
+				if (it != transfers.end())
+				{
+					it->second.set_value(res);
+					transfers.erase(it);
+				}
+			}
+
+			// Sleep until there's socket activity or a wakeup from submit().
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	CURLM *multi;
+	std::atomic<bool> running;
+	long httpVersion;
+	std::thread worker;
+	std::mutex lock;
+	std::vector<std::pair<CURL*, std::promise<CURLcode> > > pending;
+	std::map<CURL*, std::promise<CURLcode> > transfers;	// Event loop thread only.
+};
+
+#endif
@@ -0,0 +1,127 @@
+﻿/****************************************************************************
+**
+** CurlPool - shared pool of reusable libcurl easy handles.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Every easy handle carries its own connection cache, so a handle returned
+** to the pool keeps its keep-alive socket (and TLS session) open for the
+** next request to the same backend.  Handles are pooled per origin
+** (scheme://host:port) so a handle is only ever reused against the backend
+** it's already connected to.
+**
+** Environment Variables:
+	HASHIFUSE_POOL_IDLE		max idle handles kept per backend.  Default 16.
+****************************************************************************/
+
+#ifndef CURL_POOL
+#define CURL_POOL
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <stdlib.h>
+#include <curl/curl.h>
+
+class CurlPool
+{
+public:
+	CurlPool() : hits(0), misses(0), maxIdle(16)
+	{
+		if (getenv("HASHIFUSE_POOL_IDLE"))
+			maxIdle = atoi(getenv("HASHIFUSE_POOL_IDLE"));
+	}
+
+	~CurlPool()
+	{
+		clear();
+	}
+
+	// Borrow a handle for this backend, or a fresh one if none are idle.
+	// Returns NULL only if libcurl can't allocate a handle.
+	CURL* acquire(const std::string &backend)
+	{
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			std::vector<CURL*> &handles = idle[backend];
+			if (!handles.empty())
+			{
+				CURL *curl = handles.back();
+				handles.pop_back();
+				++hits;
+				return curl;
+			}
+		}
+
+		++misses;
+		return curl_easy_init();
+	}
+
+	// Give a handle back.  Options are reset but live connections,
+	// DNS and TLS session caches survive curl_easy_reset.
+	void release(const std::string &backend, CURL *curl)
+	{
+		if (!curl)
+			return;
+
+		curl_easy_reset(curl);
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			std::vector<CURL*> &handles = idle[backend];
+			if (handles.size() < maxIdle)
+			{
+				handles.push_back(curl);
+				return;
+			}
+		}
+
+		// Pool is full for this backend.
+		curl_easy_cleanup(curl);
+	}
+
+	// Close every idle handle (and its connections).
+	void clear()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		for (std::map<std::string, std::vector<CURL*> >::iterator it = idle.begin(); it != idle.end(); ++it)
+			for (size_t i = 0; i < it->second.size(); ++i)
+				curl_easy_cleanup(it->second[i]);
+		idle.clear();
+	}
+
+	// Origin of a full URL, ie "https://vault:8200/v1/sys/mounts" -> "https://vault:8200"
+	static std::string origin(const std::string &url)
+	{
+		size_t start = url.find("://");
+		start = (start == std::string::npos) ? 0 : start + 3;
+		return url.substr(0, url.find('/', start));
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		size_t nidle = 0;
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			for (std::map<std::string, std::vector<CURL*> >::iterator it = idle.begin(); it != idle.end(); ++it)
+				nidle += it->second.size();
+		}
+
+		return "curl pool hits=" + std::to_string(hits.load())
+			+ " misses=" + std::to_string(misses.load())
+			+ " idle=" + std::to_string(nidle)
+			+ " max_idle=" + std::to_string(maxIdle);
+	}
+
+	std::atomic<unsigned long> hits, misses;
+
+private:
+	std::mutex lock;
+	std::map<std::string, std::vector<CURL*> > idle;
+	size_t maxIdle;
+};
+
+#endif
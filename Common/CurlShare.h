@@ -0,0 +1,113 @@
+﻿/****************************************************************************
+**
+** CurlShare - one CURLSH shared by every request a filesystem makes.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Shares the DNS cache, TLS session IDs and the connection cache across all
+** easy handles, so a request on any thread can reuse a resolved address or
+** an open (already handshaken) connection made by another.  libcurl calls
+** back into lock()/unlock() with a per data type mutex.
+**
+** handshakes counts HTTPS requests that had to open a new connection.
+** Note a new connection may still resume a shared TLS session, which is
+** cheaper than a full handshake but still counted here.
+** avoided counts HTTPS requests served over an existing connection.
+****************************************************************************/
+
+#ifndef CURL_SHARE
+#define CURL_SHARE
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <strings.h>
+#include <curl/curl.h>
+
+class CurlShare
+{
+public:
+	CurlShare() : handshakes(0), avoided(0), share(NULL)
+	{
+	}
+
+	~CurlShare()
+	{
+		cleanup();
+	}
+
+	// Call once from init, after curl_global_init.
+	bool init()
+	{
+		if (share)
+			return true;
+
+		if (!(share = curl_share_init()))
+			return false;
+
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+		curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		return true;
+	}
+
+	// Only succeeds once no handle uses the share anymore.
+	void cleanup()
+	{
+		if (share && curl_share_cleanup(share) == CURLSHE_OK)
+			share = NULL;
+	}
+
+	// Once per handle is enough: curl_easy_reset keeps CURLOPT_SHARE, and
+	// setting it again to the same share does nothing.
+	void attach(CURL *curl)
+	{
+		if (share)
+			curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	}
+
+	// Tally whether a finished HTTPS request needed a new connection.
+	void count(CURL *curl, const std::string &url)
+	{
+		long connects = 0;
+
+		if (strncasecmp(url.c_str(), "https://", 8))
+			return;
+
+		if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK)
+			return;
+
+		if (connects)
+			++handshakes;
+		else
+			++avoided;
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		return "curl share tls handshakes=" + std::to_string(handshakes.load())
+			+ " avoided=" + std::to_string(avoided.load());
+	}
+
+	std::atomic<unsigned long> handshakes, avoided;
+
+private:
+	static void lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+	{
+		((CurlShare*)userptr)->locks[data].lock();
+	}
+
+	static void unlock(CURL *handle, curl_lock_data data, void *userptr)
+	{
+		((CurlShare*)userptr)->locks[data].unlock();
+	}
+
+	CURLSH *share;
+	std::mutex locks[CURL_LOCK_DATA_LAST];
+};
+
+#endif
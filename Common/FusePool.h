@@ -0,0 +1,238 @@
+﻿/****************************************************************************
+**
+** FusePool - sized worker pool for the libfuse2 high-level filesystems.
+**
+** Header only, include from the libfuse2 main.cpp files after fuse.h.
+**
+** fuse_main's multithreaded loop in libfuse2 starts a thread whenever no
+** worker is idle, with no upper bound, and keeps 10 idle.  run() replaces
+** fuse_main with the same loop but takes libfuse3's option names, so every
+** HashiFUSE mount is configured alike:
+**
+**	-o max_threads=N		most workers at once.  Default 0, unbounded as before.
+**	-o max_idle_threads=N	idle workers kept before extras exit.  Default 10.
+**
+** Pair it with BackendLimit to run many workers without as many requests
+** to one backend.  -s still runs the classic single threaded loop.
+**
+** Environment Variables:
+	HASHIFUSE_MAX_THREADS		default for max_threads.
+	HASHIFUSE_MAX_IDLE_THREADS	default for max_idle_threads.
+****************************************************************************/
+
+#ifndef FUSE_POOL
+#define FUSE_POOL
+
+#include <string>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fuse_lowlevel.h>
+
+class FusePool
+{
+public:
+	FusePool() : workers(0), idle(0), peak(0), requests(0),
+		se(NULL), ch(NULL), bufsize(0), exiting(false), failed(false)
+	{
+		opts.maxThreads = getenv("HASHIFUSE_MAX_THREADS") ? atoi(getenv("HASHIFUSE_MAX_THREADS")) : 0;
+		opts.maxIdle = getenv("HASHIFUSE_MAX_IDLE_THREADS") ? atoi(getenv("HASHIFUSE_MAX_IDLE_THREADS")) : 10;
+	}
+
+	// In place of fuse_main(args->argc, args->argv, op, NULL).
+	int run(struct fuse_args *args, const struct fuse_operations *op, size_t op_size)
+	{
+		static const struct fuse_opt specs[] =
+		{
+			{ "max_threads=%d", offsetof(Options, maxThreads), 0 },
+			{ "max_idle_threads=%d", offsetof(Options, maxIdle), 0 },
+			FUSE_OPT_END
+		};
+		struct fuse *f;
+		char *mountpoint;
+		int multithreaded, res;
+
+		if (fuse_opt_parse(args, &opts, specs, NULL) == -1)
+			return 1;
+
+		if (!(f = fuse_setup(args->argc, args->argv, op, op_size, &mountpoint, &multithreaded, NULL)))
+			return 1;
+
+		res = multithreaded ? loop(f) : fuse_loop(f);
+		fuse_teardown(f, mountpoint);
+		return (res == -1) ? 1 : 0;
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return "fuse pool workers=" + std::to_string(workers)
+			+ " idle=" + std::to_string(idle)
+			+ " peak=" + std::to_string(peak)
+			+ " requests=" + std::to_string(requests)
+			+ " max_threads=" + std::to_string(opts.maxThreads)
+			+ " max_idle_threads=" + std::to_string(opts.maxIdle);
+	}
+
+private:
+	struct Options
+	{
+		int maxThreads, maxIdle;
+	};
+
+	// Same shape as fuse_session_loop_mt: the main thread waits for the
+	// session to exit, then cancels workers blocked reading /dev/fuse.
+	int loop(struct fuse *f)
+	{
+		se = fuse_get_session(f);
+		ch = fuse_session_next_chan(se, NULL);
+		bufsize = fuse_chan_bufsize(ch);
+
+		if (fuse_start_cleanup_thread(f))
+			return -1;
+
+		sem_init(&finish, 0, 0);
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			failed = !spawn();
+		}
+
+		if (!failed)
+			while (!fuse_session_exited(se))
+				sem_wait(&finish);
+
+		std::list<pthread_t> running;
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			exiting = true;
+			running = threads;
+			for (std::list<pthread_t>::iterator t = running.begin(); t != running.end(); ++t)
+				pthread_cancel(*t);
+		}
+
+		for (std::list<pthread_t>::iterator t = running.begin(); t != running.end(); ++t)
+			pthread_join(*t, NULL);
+
+		fuse_stop_cleanup_thread(f);
+		sem_destroy(&finish);
+		return failed ? -1 : 0;
+	}
+
+	// With lock held.  Workers leave signals to the main thread.
+	bool spawn()
+	{
+		sigset_t all, old;
+		pthread_t id;
+		int res;
+
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		res = pthread_create(&id, NULL, worker, this);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		if (res)
+			return false;
+
+		threads.push_back(id);
+		++idle;
+		if (++workers > peak)
+			peak = workers;
+		return true;
+	}
+
+	static void *worker(void *arg)
+	{
+		FusePool *pool = (FusePool*) arg;
+		std::vector<char> mem(pool->bufsize);
+
+		// Only cancellable while waiting for a request, never mid-op.
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		while (!fuse_session_exited(pool->se))
+		{
+			struct fuse_buf fbuf;
+			struct fuse_chan *tmpch = pool->ch;
+			int res;
+
+			memset(&fbuf, 0, sizeof(fbuf));
+			fbuf.mem = mem.data();
+			fbuf.size = mem.size();
+
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			res = fuse_session_receive_buf(pool->se, &fbuf, &tmpch);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+			if (res == -EINTR)
+				continue;
+			if (res <= 0)
+			{
+				if (res < 0)
+				{
+					std::lock_guard<std::mutex> lk(pool->lock);
+					fuse_session_exit(pool->se);
+					pool->failed = true;
+				}
+				break;
+			}
+
+			{
+				std::lock_guard<std::mutex> lk(pool->lock);
+				if (pool->exiting)
+					return NULL;
+
+				++pool->requests;
+				if (--pool->idle == 0 && (pool->opts.maxThreads <= 0 || pool->workers < pool->opts.maxThreads))
+					pool->spawn();
+			}
+
+			fuse_session_process_buf(pool->se, &fbuf, tmpch);
+
+			{
+				std::lock_guard<std::mutex> lk(pool->lock);
+				if (pool->exiting)
+					return NULL;
+
+				if (++pool->idle > pool->opts.maxIdle && pool->workers > 1)
+				{
+					--pool->idle;
+					--pool->workers;
+					pool->threads.remove(pthread_self());
+					pthread_detach(pthread_self());
+					return NULL;
+				}
+			}
+		}
+
+		// Stays in threads for loop() to join, but counts like an idle exit.
+		{
+			std::lock_guard<std::mutex> lk(pool->lock);
+			--pool->idle;
+			--pool->workers;
+		}
+		sem_post(&pool->finish);
+		return NULL;
+	}
+
+	Options opts;
+	int workers, idle, peak;
+	unsigned long requests;
+
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	size_t bufsize;
+	bool exiting, failed;
+
+	sem_t finish;
+	std::mutex lock;
+	std::list<pthread_t> threads;
+};
+
+#endif
@@ -0,0 +1,121 @@
+﻿/****************************************************************************
+**
+** FuseUring - opt in to FUSE over io_uring where kernel and libfuse allow.
+**
+** Header only, include from the libfuse3 main.cpp files after fuse_lowlevel.h
+** or fuse.h.
+**
+** Linux 6.14+ (with fuse.enable_uring=1) and libfuse 3.18+ can pass FUSE
+** requests through per-CPU io_uring queues instead of read()/write() on
+** /dev/fuse.  Once caching is in, a stat storm is mostly context switches
+** between the kernel and our worker threads, which is what this removes.
+**
+** Asking for it with HASHIFUSE_IO_URING=true or libfuse's own -o io_uring
+** only passes -o io_uring on if both sides support it.  Otherwise it logs
+** why and mounts with the classic /dev/fuse loop instead of failing.
+** -o io_uring_q_depth=N is dropped along with it.
+**
+** Environment Variables:
+	HASHIFUSE_IO_URING	"true" to use io_uring queues when available.  Default false.
+****************************************************************************/
+
+#ifndef FUSE_URING
+#define FUSE_URING
+
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <stdlib.h>
+
+namespace FuseUring
+{
+	enum { KEY_URING, KEY_DEPTH };
+
+	struct Request
+	{
+		Request() : wanted(false)
+		{
+		}
+
+		bool wanted;
+		std::string depth;
+	};
+
+	// Does the running kernel take io_uring FUSE queues?
+	inline bool kernel()
+	{
+		std::ifstream param("/sys/module/fuse/parameters/enable_uring");
+		std::string value;
+
+		return param && (param >> value) && (value == "Y" || value == "1");
+	}
+
+	// Was this built against a libfuse that knows -o io_uring?
+	inline bool library()
+	{
+	#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+		return true;
+	#else
+		return false;
+	#endif
+	}
+
+	// fuse_opt_proc_t: take our options out, leave the rest.
+	inline int take(void *data, const char *arg, int key, struct fuse_args *outargs)
+	{
+		Request *req = (Request*) data;
+
+		switch (key)
+		{
+			case KEY_URING:
+				req->wanted = true;
+				return 0;
+			case KEY_DEPTH:
+				req->depth = arg;
+				return 0;
+		}
+		return 1;
+	}
+
+	// Call on the command line before fuse_parse_cmdline or fuse_main.
+	// Returns 1 if the mount will use io_uring, 0 if not, -1 on a parse error.
+	inline int prepare(struct fuse_args *args)
+	{
+		static const struct fuse_opt specs[] =
+		{
+			FUSE_OPT_KEY("io_uring", KEY_URING),
+			FUSE_OPT_KEY("io_uring_q_depth=", KEY_DEPTH),
+			FUSE_OPT_END
+		};
+		const char *env = getenv("HASHIFUSE_IO_URING");
+		Request req;
+
+		if (fuse_opt_parse(args, &req, specs, take))
+			return -1;
+
+		if (env && (std::string(env) == "true" || std::string(env) == "1"))
+			req.wanted = true;
+
+		if (!req.wanted)
+			return 0;
+
+		if (!library())
+		{
+			std::cerr << "io_uring needs libfuse 3.18 or later, using /dev/fuse" << std::endl;
+			return 0;
+		}
+
+		if (!kernel())
+		{
+			std::cerr << "Kernel has no FUSE io_uring support (fuse.enable_uring), using /dev/fuse" << std::endl;
+			return 0;
+		}
+
+		fuse_opt_add_arg(args, "-oio_uring");
+		if (!req.depth.empty())
+			fuse_opt_add_arg(args, ("-o" + req.depth).c_str());
+		return 1;
+	}
+}
+
+#endif
@@ -0,0 +1,72 @@
+﻿/****************************************************************************
+**
+** HttpBuffer - single copy response handling.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Response bodies land once in a std::string: libcurl's write callback
+** appends each chunk straight into it, and the header callback reserves the
+** whole Content-Length up front so large bodies (Terraform state, K8s lists)
+** don't keep reallocating.  The same string is then parsed in place by
+** parseJson() and copied out to the kernel by copyOut().
+****************************************************************************/
+
+#ifndef HTTP_BUFFER
+#define HTTP_BUFFER
+
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <curl/curl.h>
+#include <json/json.h>
+#include "Trace.h"
+
+namespace HttpBuffer
+{
+	// CURLOPT_HEADERFUNCTION with CURLOPT_HEADERDATA pointing at the body string.
+	// Redirects and 1xx responses just reserve again, which is harmless.
+	// With compression Content-Length is the encoded size, so only a floor.
+	inline size_t reserve(char *in, size_t size, size_t num, void *out)
+	{
+		static const char field[] = "content-length:";
+		const size_t len = size * num;
+
+		if (len > sizeof(field) && !strncasecmp(in, field, sizeof(field) - 1))
+		{
+			unsigned long long length = strtoull(in + sizeof(field) - 1, NULL, 10);
+			if (length > 0 && length < (1ULL << 31))
+				((std::string*)out)->reserve(length);
+		}
+		return len;
+	}
+
+	// Parse JSON straight out of the body without a stringstream copy.
+	// Readers keep parse state so each thread gets its own.
+	inline bool parseJson(const std::string &body, Json::Value &json, std::string *errs = NULL)
+	{
+		static thread_local const std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+		const char *begin = body.data();
+		Trace::Span span("parse", "json parse");
+
+		return reader->parse(begin, begin + body.size(), &json, errs);
+	}
+
+	// Copy the window a FUSE read asked for.  Unlike strncpy this is
+	// safe with binary content (PKI, CRLs) that contains NULs.
+	inline int copyOut(const std::string &body, char *buf, size_t size, off_t offset)
+	{
+		if (offset < 0 || (size_t)offset >= body.size())
+			return 0;
+
+		size_t len = std::min(size, body.size() - (size_t)offset);
+		Trace::Span span("copy", "copy out");
+		memcpy(buf, body.data() + offset, len);
+		return len;
+	}
+}
+
+#endif
@@ -0,0 +1,149 @@
+﻿/****************************************************************************
+**
+** InodeTable - inode numbers and kernel lookup counts for low-level FUSE.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** The low-level API talks in inode numbers instead of paths.  Every entry
+** we hand the kernel (lookup, mkdir, create) counts one reference, and the
+** kernel gives them back with forget once it drops the inode from its own
+** caches.  Only then can the number go.  Numbers are never reused, so the
+** generation is always 0.
+**
+** A removed path is detached from its inode straight away.  If something
+** is created at the same path while the kernel still holds the old inode
+** (say an open file), it gets a new number instead of inheriting the old
+** one with possibly a different type.
+****************************************************************************/
+
+#ifndef INODE_TABLE
+#define INODE_TABLE
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <stdint.h>
+
+class InodeTable
+{
+public:
+	enum { ROOT = 1 };
+
+	InodeTable() : next(ROOT + 1), forgotten(0)
+	{
+		Node &root = nodes[ROOT];
+		root.path = "/";
+		root.dir = true;
+		root.lookups = 1;
+		ids[root.path] = ROOT;
+	}
+
+	// Inode for path, counting one kernel lookup.  Balanced by forget().
+	uint64_t ref(const std::string &path, bool dir)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::unordered_map<std::string, uint64_t>::iterator it = ids.find(path);
+
+		// Same path but now a different type, so a different inode.
+		if (it != ids.end() && it->first != "/" && nodes[it->second].dir != dir)
+		{
+			ids.erase(it);
+			it = ids.end();
+		}
+
+		if (it == ids.end())
+		{
+			it = ids.insert(std::make_pair(path, next++)).first;
+			Node &n = nodes[it->second];
+			n.path = path;
+			n.dir = dir;
+		}
+
+		++nodes[it->second].lookups;
+		return it->second;
+	}
+
+	// Inode already known for path, without counting a lookup.  0 if none.
+	uint64_t peek(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::unordered_map<std::string, uint64_t>::iterator it = ids.find(path);
+		return (it == ids.end()) ? 0 : it->second;
+	}
+
+	// Path and type of an inode the kernel still holds.
+	bool get(uint64_t ino, std::string &path, bool &dir)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::unordered_map<uint64_t, Node>::iterator it = nodes.find(ino);
+
+		if (it == nodes.end())
+			return false;
+
+		path = it->second.path;
+		dir = it->second.dir;
+		return true;
+	}
+
+	// Path was unlinked or removed.  The inode lives on until forgotten.
+	void detach(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		if (path != "/")
+			ids.erase(path);
+	}
+
+	// The kernel dropped nlookup references to ino.
+	void forget(uint64_t ino, uint64_t nlookup)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::unordered_map<uint64_t, Node>::iterator it = nodes.find(ino);
+
+		if (it == nodes.end() || ino == ROOT)
+			return;
+
+		if (it->second.lookups > nlookup)
+		{
+			it->second.lookups -= nlookup;
+			return;
+		}
+
+		// Only if the path hasn't moved on to a newer inode.
+		std::unordered_map<std::string, uint64_t>::iterator id = ids.find(it->second.path);
+		if (id != ids.end() && id->second == ino)
+			ids.erase(id);
+
+		nodes.erase(it);
+		++forgotten;
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return "inodes live=" + std::to_string(nodes.size())
+			+ " assigned=" + std::to_string(next - ROOT - 1)
+			+ " forgotten=" + std::to_string(forgotten);
+	}
+
+private:
+	struct Node
+	{
+		Node() : dir(false), lookups(0)
+		{
+		}
+
+		std::string path;
+		bool dir;
+		uint64_t lookups;
+	};
+
+	uint64_t next;
+	unsigned long forgotten;
+
+	std::mutex lock;
+	std::unordered_map<uint64_t, Node> nodes;
+	std::unordered_map<std::string, uint64_t> ids;
+};
+
+#endif
@@ -0,0 +1,109 @@
+﻿/****************************************************************************
+**
+** JsonList - pull one field per element out of a list response.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** readdir only ever needs a single string from each element of a listing
+** (K8s items[].metadata.name, Nomad [].ID, TFE data[].attributes.name,
+** Vault data.keys[]) but a jsoncpp DOM of a 5k item pod list costs more
+** than the request.  Build with -DHAVE_SIMDJSON (make SIMDJSON=1) and
+** names() walks the raw body with simdjson On Demand, materializing only
+** the requested strings.  Without it we fall back to HttpBuffer::parseJson.
+**
+** Paths are JSON pointers without escapes: "/items", "/metadata/name".
+** An empty path means the document root or the element itself.
+****************************************************************************/
+
+#ifndef JSON_LIST
+#define JSON_LIST
+
+#include <string>
+#include <vector>
+#include "HttpBuffer.h"
+
+#ifdef HAVE_SIMDJSON
+#include <simdjson.h>
+#endif
+
+namespace JsonList
+{
+	// Walk a JSON pointer through a jsoncpp value.  Missing members give null.
+	inline const Json::Value &at(const Json::Value &root, const char *path)
+	{
+		const Json::Value *v = &root;
+		std::string key;
+
+		for (const char *p = path; *p == '/'; )
+		{
+			const char *end = strchr(++p, '/');
+			key.assign(p, end ? end - p : strlen(p));
+			p += key.size();
+
+			if (v->isArray())
+				v = &(*v)[(Json::ArrayIndex)strtoul(key.c_str(), NULL, 10)];
+			else if (v->isObject())
+				v = &(*v)[key];
+			else
+				return Json::Value::nullSingleton();
+		}
+		return *v;
+	}
+
+#ifdef HAVE_SIMDJSON
+	// On Demand needs SIMDJSON_PADDING readable bytes past the end.  The body
+	// is ours, so grow its capacity rather than copying into a padded_string.
+	inline bool names(std::string &body, const char *array, const char *field, std::vector<std::string> &out)
+	{
+		static thread_local simdjson::ondemand::parser parser;
+		simdjson::ondemand::document doc;
+		simdjson::ondemand::array list;
+		Trace::Span span("parse", "json list");
+
+		body.reserve(body.size() + simdjson::SIMDJSON_PADDING);
+		if (parser.iterate(simdjson::padded_string_view(body.data(), body.size(), body.capacity())).get(doc))
+			return false;
+
+		if (*array ? doc.at_pointer(array).get_array().get(list) : doc.get_array().get(list))
+			return false;
+
+		for (auto element : list)
+		{
+			simdjson::ondemand::value item;
+			std::string_view name;
+
+			if (element.get(item))
+				return false;
+			if (*field ? item.at_pointer(field).get_string().get(name) : item.get_string().get(name))
+				continue;
+
+			out.emplace_back(name.data(), name.size());
+		}
+		return true;
+	}
+#else
+	inline bool names(std::string &body, const char *array, const char *field, std::vector<std::string> &out)
+	{
+		Json::Value root;
+		Trace::Span span("parse", "json list");
+
+		if (!HttpBuffer::parseJson(body, root))
+			return false;
+
+		const Json::Value &list = at(root, array);
+		if (!list.isArray())
+			return false;
+
+		out.reserve(out.size() + list.size());
+		for (Json::Value::const_iterator itr = list.begin(); itr != list.end(); ++itr)
+		{
+			const Json::Value &name = at(*itr, field);
+			if (name.isString())
+				out.push_back(name.asString());
+		}
+		return true;
+	}
+#endif
+}
+
+#endif
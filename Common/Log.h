@@ -0,0 +1,403 @@
+﻿/****************************************************************************
+**
+** Log - leveled log lines, queued lock free and written by one thread.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** `*logs << ... << endl` used to write and flush cout (or the log file) from
+** whichever FUSE thread got there, so every error or DEBUG line held up the
+** others behind the ostream.  Now each thread formats into its own line
+** buffer, and a finished line is pushed onto an intrusive MPSC stack that a
+** writer thread swaps out whole for as long as there are any, and then
+** sleeps until the next one (100ms at most).  Producers never lock, and
+** the writer flushes once per batch rather than once per line.
+**
+**	*logs << "info line" << endl;
+**	logs(Log::ERR) << RED << "rate limited" << RESET << endl;
+**	logs(Log::DBG) << CYAN << url << RESET << endl;
+**
+** A level that's off hands back a stream that ignores everything, so only
+** the arguments are evaluated.  Error lines pass a token bucket of
+** HASHIFUSE_LOG_ERRORS a second (with a second's worth of burst), so a
+** backend that's down logs how much it dropped rather than a line per op.
+** Lines go out as "time level text".
+**
+** Until start() (call it after FUSE daemonizes) and after stop(), lines are
+** written straight through under a mutex instead.
+**
+** Environment Variables:
+	HASHIFUSE_LOG_LEVEL		error, warn, info or debug.  Default info, or debug if built with DEBUG.
+	HASHIFUSE_LOG_ERRORS	error lines per second.  Default 10, 0 for no limit.
+****************************************************************************/
+
+#ifndef LOG
+#define LOG
+
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <condition_variable>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+class Log
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	enum Level { ERR, WARN, INFO, DBG };
+	enum { MAX_QUEUED = 65536 };
+
+	Log() : out(&std::cout), second(-1), file(NULL), level(parse(getenv("HASHIFUSE_LOG_LEVEL"))), head(NULL), queued(0),
+		quit(false), running(false), lines(0), dropped(0), suppressed(0), unreported(0), tat(0), epoch(Clock::now())
+	{
+		const char *rate = getenv("HASHIFUSE_LOG_ERRORS");
+
+		interval = (rate && atof(rate) <= 0) ? 0 : 1000000 / (rate ? atof(rate) : 10);
+	}
+
+	// Thread locals, this thread's line included, are gone by now.
+	~Log()
+	{
+		finish();
+		delete file;
+	}
+
+	// An info line, as before.
+	std::ostream &operator*()
+	{
+		return local().begin(INFO);
+	}
+
+	// A line at lvl, or a stream that drops it.
+	std::ostream &operator()(Level lvl)
+	{
+		static thread_local std::ostream nowhere(NULL);
+
+		if (!enabled(lvl) || (lvl == ERR && !admit()))
+			return nowhere;
+		return local().begin(lvl);
+	}
+
+	bool enabled(Level lvl) const
+	{
+		return lvl <= level.load(std::memory_order_relaxed);
+	}
+
+	// Write to path instead of cout.  False if it can't be opened.
+	bool open(const char *path)
+	{
+		std::ofstream *f = new std::ofstream(path, std::ofstream::out);
+
+		if (!*f)
+		{
+			delete f;
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lk(lock);
+		delete file;
+		out = file = f;
+		return true;
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		if (writer.joinable())
+			return;
+		quit = false;
+		writer = std::thread(&Log::drain, this);
+		running.store(true, std::memory_order_release);
+	}
+
+	// Writes whatever is still queued, including this thread's partial line.
+	void stop()
+	{
+		local().sync();
+		finish();
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		static const char *names[] = { "error", "warn", "info", "debug" };
+
+		return (std::string) "log level=" + names[level.load()]
+			+ " lines=" + std::to_string(lines.load())
+			+ " queued=" + std::to_string(queued.load())
+			+ " dropped=" + std::to_string(dropped.load())
+			+ " suppressed=" + std::to_string(suppressed.load());
+	}
+
+	static Level parse(const char *name)
+	{
+		#if DEBUG
+		Level fallback = DBG;
+		#else
+		Level fallback = INFO;
+		#endif
+
+		if (!name)
+			return fallback;
+		if (!strcasecmp(name, "error") || !strcasecmp(name, "err"))
+			return ERR;
+		if (!strcasecmp(name, "warn") || !strcasecmp(name, "warning"))
+			return WARN;
+		if (!strcasecmp(name, "info"))
+			return INFO;
+		if (!strcasecmp(name, "debug"))
+			return DBG;
+		return fallback;
+	}
+
+private:
+	struct Node
+	{
+		Node *next;
+		Level level;
+		timespec when;
+		std::string text;
+	};
+
+	// One per thread.  Collects characters and pushes each finished line.
+	class Line : public std::streambuf
+	{
+	public:
+		Line(Log &log) : log(log), level(INFO), stream(this)
+		{
+		}
+
+		~Line()
+		{
+			sync();
+		}
+
+		std::ostream &begin(Level lvl)
+		{
+			level = lvl;
+			return stream;
+		}
+
+		int sync()
+		{
+			if (!text.empty())
+				log.push(level, text);
+			return 0;
+		}
+
+	protected:
+		int overflow(int c)
+		{
+			if (c == traits_type::eof())
+				return traits_type::not_eof(c);
+			if (c == '\n')
+				log.push(level, text);
+			else
+				text += (char) c;
+			return c;
+		}
+
+		std::streamsize xsputn(const char *s, std::streamsize n)
+		{
+			const char *end = s + n, *nl;
+
+			while ((nl = (const char*) memchr(s, '\n', end - s)))
+			{
+				text.append(s, nl - s);
+				log.push(level, text);
+				s = nl + 1;
+			}
+			text.append(s, end - s);
+			return n;
+		}
+
+	private:
+		Log &log;
+		Level level;
+		std::string text;
+		std::ostream stream;
+	};
+
+	Line &local()
+	{
+		static thread_local Line line(*this);
+		return line;
+	}
+
+	// Takes text, leaving it empty.
+	void push(Level lvl, std::string &text)
+	{
+		if (queued.fetch_add(1, std::memory_order_relaxed) >= MAX_QUEUED)
+		{
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			++dropped;
+			text.clear();
+			return;
+		}
+
+		Node *n = new Node;
+		n->level = lvl;
+		clock_gettime(CLOCK_REALTIME, &n->when);
+		n->text.swap(text);
+
+		if (!running.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			n->next = NULL;
+			write(n);
+			return;
+		}
+
+		// The writer may free n as soon as it's in, so keep what was below it.
+		Node *below = head.load(std::memory_order_relaxed);
+		do
+			n->next = below;
+		while (!head.compare_exchange_weak(below, n, std::memory_order_release, std::memory_order_relaxed));
+
+		// Only the first line into an empty queue wakes the writer.
+		if (!below)
+			wake.notify_one();
+	}
+
+	// Error lines spend from a bucket of interval-microsecond tokens.
+	bool admit()
+	{
+		if (!interval)
+			return true;
+
+		const int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - epoch).count();
+		int64_t t = tat.load(std::memory_order_relaxed), next;
+
+		do
+		{
+			next = std::max(t, now) + interval;
+			if (next - now > 1000000)
+			{
+				++suppressed;
+				++unreported;
+				return false;
+			}
+		}
+		while (!tat.compare_exchange_weak(t, next, std::memory_order_relaxed));
+		return true;
+	}
+
+	void finish()
+	{
+		running.store(false, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			quit = true;
+		}
+		wake.notify_one();
+		if (writer.joinable())
+			writer.join();
+
+		// A producer that saw running just before it went false can still
+		// push after the last exchange, so go until every counted line is out.
+		do
+		{
+			{
+				std::lock_guard<std::mutex> lk(lock);
+				write(head.exchange(NULL, std::memory_order_acquire));
+			}
+			if (queued.load(std::memory_order_relaxed))
+				std::this_thread::yield();
+		}
+		while (queued.load(std::memory_order_relaxed));
+	}
+
+	void drain()
+	{
+		std::unique_lock<std::mutex> lk(lock);
+
+		// A wake that lands just before the wait is lost, hence the timeout.
+		while (!quit)
+		{
+			if (Node *n = head.exchange(NULL, std::memory_order_acquire))
+				write(n);
+			else
+				wake.wait_for(lk, std::chrono::milliseconds(100));
+		}
+	}
+
+	// The stack is newest first.  Call with lock held.
+	void write(Node *n)
+	{
+		const unsigned long skipped = unreported.exchange(0);
+		Node *oldest = NULL, *next;
+		unsigned long count = 0;
+		timespec now;
+
+		for (; n; n = next)
+		{
+			next = n->next;
+			n->next = oldest;
+			oldest = n;
+		}
+
+		if (skipped)
+		{
+			clock_gettime(CLOCK_REALTIME, &now);
+			format(now, ERR, std::to_string(skipped) + " error lines suppressed, see HASHIFUSE_LOG_ERRORS");
+		}
+
+		for (n = oldest; n; n = next)
+		{
+			next = n->next;
+			format(n->when, n->level, n->text);
+			delete n;
+			++count;
+		}
+
+		if (count || skipped)
+			out->flush();
+		queued.fetch_sub(count, std::memory_order_relaxed);
+		lines += count;
+	}
+
+	void format(const timespec &when, Level lvl, const std::string &text)
+	{
+		static const char *names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+		char ms[8];
+		struct tm tm;
+
+		// Only the writer calls this, so the last second's text can be kept.
+		if (when.tv_sec != second)
+		{
+			second = when.tv_sec;
+			gmtime_r(&second, &tm);
+			stamp[strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm)] = 0;
+		}
+		snprintf(ms, sizeof(ms), ".%03dZ ", (int) (when.tv_nsec / 1000000));
+		*out << stamp << ms << names[lvl] << ' ' << text << '\n';
+	}
+
+	std::ostream *out;
+	time_t second;
+	char stamp[32];
+	std::ofstream *file;
+	std::atomic<Level> level;
+	std::atomic<Node*> head;
+	std::atomic<unsigned long> queued;
+	bool quit;
+	std::atomic<bool> running;
+	std::atomic<unsigned long> lines, dropped, suppressed, unreported;
+	std::atomic<int64_t> tat;
+	int64_t interval;
+	const Clock::time_point epoch;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread writer;
+};
+
+#endif
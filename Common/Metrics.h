@@ -0,0 +1,383 @@
+﻿/****************************************************************************
+**
+** Metrics - latency histograms per FUSE op and backend endpoint, and the
+** hidden /.hashifuse/stats file that reports them.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Every sample lands in a log2 bucket of microseconds (<1us, 1-2us, 2-4us
+** ... up to about an hour) in a shard owned by the recording thread.  Only
+** that thread writes its shard, with plain relaxed stores, so recording
+** takes no lock and bounces no cache line between FUSE workers.  report()
+** merges every shard when someone reads the stats file.  Shards of exited
+** threads are handed to the next new thread, so a worker pool that grows
+** and shrinks doesn't keep allocating them.
+**
+** Series are named "fuse <op>" for FUSE ops (see Timer) and "http <method>
+** <endpoint class> <status>" for backend calls (see request()), where the
+** endpoint class is Resilience's: backend plus the filesystem's route
+** template, so a series covers every key of one kind.
+**
+**	cat /mnt/vault/.hashifuse/stats
+**
+** prints one line per series (count, mean, p50/p90/p99/p999 as bucket upper
+** bounds) followed by whatever stats() lines the filesystem adds: cache
+** hits and misses, requests in flight per backend, pool sizes and so on.
+** The file isn't listed in the mount root, only reachable by name.
+** OpenMetrics.h serves the same series to Prometheus.
+****************************************************************************/
+
+#ifndef METRICS
+#define METRICS
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Resilience.h"
+#include "Trace.h"
+
+class Metrics
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	enum { BUCKETS = 32, MAX_SERIES = 512 };
+
+	Metrics()
+	{
+	}
+
+	~Metrics()
+	{
+		for (size_t i = 0; i < shards.size(); ++i)
+			delete shards[i];
+	}
+
+	// Times one FUSE op from construction to scope exit, and traces it
+	// as a span.  op is a string literal, e.g.
+	// Metrics::Timer timer(metrics, "getattr").
+	class Timer
+	{
+	public:
+		Timer(Metrics &metrics, const char *op) : metrics(metrics), id(metrics.op(op)), start(Clock::now()), span("fuse", op)
+		{
+		}
+
+		~Timer()
+		{
+			metrics.record(id, start);
+		}
+
+	private:
+		Timer(const Timer&);
+		Timer &operator=(const Timer&);
+
+		Metrics &metrics;
+		const int id;
+		const Clock::time_point start;
+		Trace::Span span;
+	};
+
+	// Id of a series, registering it the first time anywhere.  -1 once
+	// MAX_SERIES are taken, and its samples are only counted as dropped.
+	// Each thread remembers ids it has looked up.
+	int series(const std::string &name)
+	{
+		Shard &s = local();
+		std::unordered_map<std::string, int>::iterator it = s.names.find(name);
+
+		if (it != s.names.end())
+			return it->second;
+
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, int>::iterator known = ids.find(name);
+		int id = -1;
+
+		if (known != ids.end())
+			id = known->second;
+		else if (names.size() < MAX_SERIES)
+		{
+			id = names.size();
+			names.push_back(name);
+			ids[name] = id;
+		}
+		s.names[name] = id;
+		return id;
+	}
+
+	// A sample for series id, taken from start until now.
+	void record(int id, Clock::time_point start)
+	{
+		const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+		Shard &s = local();
+		Histogram *h;
+
+		if (id < 0)
+		{
+			bump(s.dropped, 1);
+			return;
+		}
+
+		if (!(h = s.series[id].load(std::memory_order_relaxed)))
+		{
+			h = new Histogram();
+			s.series[id].store(h, std::memory_order_release);
+		}
+
+		// Only this thread writes here, so no read-modify-write needed.
+		bump(h->buckets[bucket(us)], 1);
+		bump(h->count, 1);
+		bump(h->sum, us);
+	}
+
+	// A backend call that started at start, by endpoint class and status.
+	void request(const std::string &method, const std::string &url, long code, Clock::time_point start)
+	{
+		record(series("http " + Resilience::endpoint(method, url) + ' ' + std::to_string(code)), start);
+	}
+
+	// One series summed over every thread.  buckets[b] counts samples
+	// under 2^b us, and at least 2^(b-1).  sum is in us.
+	struct Snapshot
+	{
+		std::string name;
+		uint64_t buckets[BUCKETS];
+		uint64_t count, sum;
+	};
+
+	// Every series merged across threads, in the order first recorded.
+	std::vector<Snapshot> snapshot()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::vector<Snapshot> merged(names.size());
+
+		for (size_t id = 0; id < names.size(); ++id)
+		{
+			Snapshot &m = merged[id];
+			m.name = names[id];
+			m.count = m.sum = 0;
+			memset(m.buckets, 0, sizeof(m.buckets));
+
+			for (size_t i = 0; i < shards.size(); ++i)
+			{
+				const Histogram *h = shards[i]->series[id].load(std::memory_order_acquire);
+				if (!h)
+					continue;
+
+				for (int b = 0; b < BUCKETS; ++b)
+					m.buckets[b] += h->buckets[b].load(std::memory_order_relaxed);
+				m.count += h->count.load(std::memory_order_relaxed);
+				m.sum += h->sum.load(std::memory_order_relaxed);
+			}
+		}
+		return merged;
+	}
+
+	// Samples of series that didn't fit in MAX_SERIES, over every thread.
+	uint64_t dropped()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		uint64_t total = 0;
+
+		for (size_t i = 0; i < shards.size(); ++i)
+			total += shards[i]->dropped.load(std::memory_order_relaxed);
+		return total;
+	}
+
+	// Every series, one line each, then the dropped samples if any.
+	std::string report()
+	{
+		std::vector<Snapshot> merged = snapshot();
+		std::string out;
+
+		for (size_t i = 0; i < merged.size(); ++i)
+		{
+			const Snapshot &m = merged[i];
+			if (!m.count)
+				continue;
+
+			out += m.name + " count=" + std::to_string(m.count)
+				+ " mean=" + duration(m.sum / m.count)
+				+ " p50=" + duration(percentile(m, 0.50))
+				+ " p90=" + duration(percentile(m, 0.90))
+				+ " p99=" + duration(percentile(m, 0.99))
+				+ " p999=" + duration(percentile(m, 0.999)) + '\n';
+		}
+		if (const uint64_t lost = dropped())
+			out += "dropped count=" + std::to_string(lost) + " (more than " + std::to_string(MAX_SERIES) + " series)\n";
+		return out;
+	}
+
+	// The virtual dir and file, and their attributes.  False for any other
+	// path.
+	static bool stat(const std::string &path, struct stat &st)
+	{
+		const bool isDir = (path == dir()), isFile = (path == file());
+
+		if (!isDir && !isFile)
+			return false;
+
+		memset(&st, 0, sizeof(st));
+		st.st_uid = getuid();
+		st.st_gid = getgid();
+		st.st_mode = isDir ? (S_IFDIR | 0500) : (S_IFREG | 0400);
+		st.st_nlink = isDir ? 2 : 1;
+		st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+		return true;
+	}
+
+	static const char *dir()
+	{
+		return "/.hashifuse";
+	}
+
+	// Size 0, so open it with direct_io and read until EOF.
+	static const char *file()
+	{
+		return "/.hashifuse/stats";
+	}
+
+private:
+	struct Histogram
+	{
+		Histogram() : count(0), sum(0)
+		{
+			for (int i = 0; i < BUCKETS; ++i)
+				buckets[i] = 0;
+		}
+
+		std::atomic<uint64_t> buckets[BUCKETS];
+		std::atomic<uint64_t> count, sum;
+	};
+
+	struct Shard
+	{
+		Shard() : dropped(0)
+		{
+			for (int i = 0; i < MAX_SERIES; ++i)
+				series[i] = NULL;
+		}
+
+		~Shard()
+		{
+			for (int i = 0; i < MAX_SERIES; ++i)
+				delete series[i].load();
+		}
+
+		std::atomic<Histogram*> series[MAX_SERIES];
+		std::atomic<uint64_t> dropped;
+
+		// Owning thread only.
+		std::unordered_map<std::string, int> names;
+		std::unordered_map<const char*, int> ops;
+	};
+
+	// This thread's shard, handed back for reuse when the thread exits.
+	struct Owner
+	{
+		Owner() : metrics(NULL), shard(NULL)
+		{
+		}
+
+		~Owner()
+		{
+			if (metrics)
+				metrics->release(shard);
+		}
+
+		Metrics *metrics;
+		Shard *shard;
+	};
+
+	Shard &local()
+	{
+		static thread_local Owner owner;
+
+		if (!owner.shard)
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			if (!spare.empty())
+			{
+				owner.shard = spare.back();
+				spare.pop_back();
+			}
+			else
+			{
+				owner.shard = new Shard();
+				shards.push_back(owner.shard);
+			}
+			owner.metrics = this;
+		}
+		return *owner.shard;
+	}
+
+	void release(Shard *shard)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		spare.push_back(shard);
+	}
+
+	// Series id for a FUSE op, looked up by the literal's address.
+	int op(const char *name)
+	{
+		Shard &s = local();
+		std::unordered_map<const char*, int>::iterator it = s.ops.find(name);
+
+		if (it != s.ops.end())
+			return it->second;
+		return s.ops[name] = series(std::string("fuse ") + name);
+	}
+
+	static void bump(std::atomic<uint64_t> &counter, uint64_t by)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+	}
+
+	// 0 for <1us, then n for [2^(n-1), 2^n) us.
+	static int bucket(uint64_t us)
+	{
+		int b = 0;
+
+		while (us && b < BUCKETS - 1)
+		{
+			us >>= 1;
+			++b;
+		}
+		return b;
+	}
+
+	// Upper bound in us of the bucket holding the p'th sample.
+	static uint64_t percentile(const Snapshot &m, double p)
+	{
+		const uint64_t rank = (uint64_t) (m.count * p);
+		uint64_t seen = 0;
+
+		for (int b = 0; b < BUCKETS; ++b)
+			if ((seen += m.buckets[b]) > rank)
+				return (uint64_t) 1 << b;
+		return (uint64_t) 1 << (BUCKETS - 1);
+	}
+
+	static std::string duration(uint64_t us)
+	{
+		if (us < 10000)
+			return std::to_string(us) + "us";
+		if (us < 10000000)
+			return std::to_string(us / 1000) + "ms";
+		return std::to_string(us / 1000000) + "s";
+	}
+
+	std::mutex lock;
+	std::vector<std::string> names;
+	std::map<std::string, int> ids;
+	std::vector<Shard*> shards, spare;
+};
+
+#endif
@@ -0,0 +1,299 @@
+﻿/****************************************************************************
+**
+** OpenMetrics - Prometheus scrape endpoint for the Metrics histograms.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** The stats file is for a person with a shell on the box.  This serves the
+** same histograms as OpenMetrics text so the daemons can be scraped and
+** alerted on like everything else:
+**
+**	hashifuse_fuse_op_duration_seconds{op="read"}
+**	hashifuse_http_request_duration_seconds{backend="https://vault:8200",
+**		method="GET",route="/v1/sys/policy",code="200"}
+**
+** The route is the filesystem's route template (see Resilience), never the
+** raw path: label values stay bounded and no secret or key name ends up in
+** a monitoring system.
+**
+** Buckets are the log2 microsecond buckets Metrics keeps, so a scrape is
+** a merge of the per-thread shards and nothing more.  Off unless
+** HASHIFUSE_METRICS is set.  It listens on loopback or a unix socket only,
+** never on a public address by default: there is no auth.  Any GET is
+** answered, /metrics by convention.
+**
+** Environment Variables:
+	HASHIFUSE_METRICS	unix:///path/to.sock, or [host]:port.  Host defaults to 127.0.0.1.
+****************************************************************************/
+
+#ifndef OPEN_METRICS
+#define OPEN_METRICS
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Metrics.h"
+
+class OpenMetrics
+{
+public:
+	OpenMetrics(Metrics &metrics) : metrics(metrics), fd(-1), active(false), scrapes(0)
+	{
+		if (getenv("HASHIFUSE_METRICS"))
+			address = getenv("HASHIFUSE_METRICS");
+	}
+
+	~OpenMetrics()
+	{
+		stop();
+	}
+
+	// Listen and serve on a thread.  Call after FUSE daemonizes.  True if
+	// there's nothing to do or the listener is up.
+	bool start()
+	{
+		if (address.empty() || active)
+			return true;
+		if ((fd = listen()) < 0)
+			return false;
+
+		active = true;
+		server = std::thread(&OpenMetrics::serve, this);
+		return true;
+	}
+
+	void stop()
+	{
+		if (!active)
+			return;
+
+		active = false;
+		server.join();
+		close(fd);
+		fd = -1;
+		if (!path.empty())
+			unlink(path.c_str());
+	}
+
+	// The exposition, as a scrape gets it.
+	std::string render()
+	{
+		static const char fuse[] = "hashifuse_fuse_op_duration_seconds", http[] = "hashifuse_http_request_duration_seconds";
+		std::vector<Metrics::Snapshot> all = metrics.snapshot();
+		std::string ops, requests;
+
+		for (size_t i = 0; i < all.size(); ++i)
+		{
+			const Metrics::Snapshot &m = all[i];
+			std::vector<std::string> f = fields(m.name);
+
+			if (f.size() == 2 && f[0] == "fuse")
+				histogram(ops, fuse, "op=\"" + escape(f[1]) + '"', m);
+			else if (f.size() == 4 && f[0] == "http")
+			{
+				const std::string backend = CurlPool::origin(f[2]), route = f[2].substr(backend.size());
+
+				histogram(requests, http, "backend=\"" + escape(backend)
+					+ "\",method=\"" + escape(f[1])
+					+ "\",route=\"" + escape(route.empty() ? "/" : route)
+					+ "\",code=\"" + escape(f[3]) + '"', m);
+			}
+		}
+
+		return family(fuse, "FUSE op latency.") + ops
+			+ family(http, "Backend request latency, retries and waits for a slot included.") + requests
+			+ "# EOF\n";
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		return "openmetrics listen=" + (address.empty() ? std::string("off") : address)
+			+ " scrapes=" + std::to_string(scrapes.load());
+	}
+
+private:
+	OpenMetrics(const OpenMetrics&);
+	OpenMetrics &operator=(const OpenMetrics&);
+
+	static std::vector<std::string> fields(const std::string &name)
+	{
+		std::vector<std::string> out;
+		size_t start = 0, end;
+
+		while ((end = name.find(' ', start)) != std::string::npos)
+		{
+			out.push_back(name.substr(start, end - start));
+			start = end + 1;
+		}
+		out.push_back(name.substr(start));
+		return out;
+	}
+
+	static std::string escape(const std::string &value)
+	{
+		std::string out;
+
+		for (size_t i = 0; i < value.size(); ++i)
+			if (value[i] == '\\' || value[i] == '"')
+				(out += '\\') += value[i];
+			else if (value[i] == '\n')
+				out += "\\n";
+			else
+				out += value[i];
+		return out;
+	}
+
+	static std::string family(const char *name, const char *help)
+	{
+		return std::string("# TYPE ") + name + " histogram\n# UNIT " + name + " seconds\n# HELP " + name + ' ' + help + '\n';
+	}
+
+	static std::string seconds(double s)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.9g", s);
+		return buf;
+	}
+
+	// Cumulative buckets.  The last Metrics bucket is the overflow, +Inf.
+	static void histogram(std::string &out, const char *name, const std::string &labels, const Metrics::Snapshot &m)
+	{
+		uint64_t seen = 0;
+
+		for (int b = 0; b < Metrics::BUCKETS - 1; ++b)
+		{
+			seen += m.buckets[b];
+			out += std::string(name) + "_bucket{" + labels + ",le=\"" + seconds(((uint64_t) 1 << b) / 1e6) + "\"} " + std::to_string(seen) + '\n';
+		}
+		out += std::string(name) + "_bucket{" + labels + ",le=\"+Inf\"} " + std::to_string(m.count) + '\n';
+		out += std::string(name) + "_count{" + labels + "} " + std::to_string(m.count) + '\n';
+		out += std::string(name) + "_sum{" + labels + "} " + seconds(m.sum / 1e6) + '\n';
+	}
+
+	// unix:///path or [host]:port.  -1 and a message on stderr on failure.
+	int listen()
+	{
+		static const std::string scheme = "unix://";
+		int s = -1;
+
+		if (!address.compare(0, scheme.size(), scheme))
+		{
+			struct sockaddr_un sun;
+
+			path = address.substr(scheme.size());
+			memset(&sun, 0, sizeof(sun));
+			sun.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(sun.sun_path))
+				return fail("socket path too long");
+
+			strcpy(sun.sun_path, path.c_str());
+			unlink(path.c_str());
+			if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+			||	bind(s, (struct sockaddr*) &sun, sizeof(sun))
+			||	chmod(path.c_str(), 0600)
+			||	::listen(s, 16))
+				return fail("can't listen", s);
+			return s;
+		}
+
+		const size_t colon = address.rfind(':');
+		std::string host = (colon == std::string::npos) ? "" : address.substr(0, colon);
+		const std::string port = address.substr(colon == std::string::npos ? 0 : colon + 1);
+		struct addrinfo hints, *res;
+		const int on = 1;
+
+		if (host.size() > 1 && host[0] == '[')
+			host = host.substr(1, host.size() - 2);
+		if (host.empty())
+			host = "127.0.0.1";
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+			return fail("can't resolve");
+
+		if ((s = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+		||	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+		||	bind(s, res->ai_addr, res->ai_addrlen)
+		||	::listen(s, 16))
+		{
+			freeaddrinfo(res);
+			return fail("can't listen", s);
+		}
+		freeaddrinfo(res);
+		return s;
+	}
+
+	int fail(const char *why, int s = -1)
+	{
+		fprintf(stderr, "HASHIFUSE_METRICS=%s: %s: %s\n", address.c_str(), why, strerror(errno));
+		if (s >= 0)
+			close(s);
+		return -1;
+	}
+
+	// One connection at a time.  Scrapes are seconds apart and small.
+	void serve()
+	{
+		while (active)
+		{
+			struct pollfd p = { fd, POLLIN, 0 };
+			int c;
+
+			if (poll(&p, 1, 250) <= 0 || (c = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+				continue;
+
+			answer(c);
+			close(c);
+		}
+	}
+
+	void answer(int c)
+	{
+		const struct timeval timeout = { 2, 0 };
+		std::string request, body, head;
+		char buf[1024];
+		ssize_t n;
+
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192
+			&& (n = recv(c, buf, sizeof(buf), 0)) > 0)
+			request.append(buf, n);
+
+		if (request.compare(0, 4, "GET "))
+			head = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n";
+		else
+		{
+			body = render();
+			head = "HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n";
+			++scrapes;
+		}
+
+		head += "Connection: close\r\n\r\n";
+		send(c, head.data(), head.size(), MSG_NOSIGNAL);
+		send(c, body.data(), body.size(), MSG_NOSIGNAL);
+	}
+
+	Metrics &metrics;
+	std::string address, path;
+	int fd;
+	std::atomic<bool> active;
+	std::atomic<unsigned long> scrapes;
+	std::thread server;
+};
+
+#endif
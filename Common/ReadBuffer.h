@@ -0,0 +1,278 @@
+﻿/****************************************************************************
+**
+** ReadBuffer - per open snapshot of a file, replied to the kernel by splice.
+**
+** Header only, include from any of the HashiFUSE main.cpp files, after
+** fuse.h or fuse_lowlevel.h.
+**
+** open() takes the value (usually already in the value cache) and hangs a
+** ReadBuffer off fi->fh, so every read on the handle sees the same content
+** even if the cache refreshes in between.  Small values are just shared
+** with the cache.  Values of HASHIFUSE_SPLICE_MIN bytes or more are copied
+** once into a memfd, and read_buf hands the kernel a window of that fd
+** instead of memory: with FUSE_CAP_SPLICE_WRITE libfuse splices the pages
+** into /dev/fuse and no read ever memcpys the content again.  Terraform
+** state and large K8s lists are read 128k at a time, so that's one copy per
+** open instead of one per read.
+**
+** The low-level API can't swap fi->fh after open, so a commit through a
+** handle reset()s its content.  That publishes a new immutable snapshot
+** rather than changing the old one: a read running at the same time keeps
+** the snapshot it took, memory and memfd included.  High-level read_buf
+** is replied after it returns, so replaced snapshots stay alive until the
+** handle is released, which is a commit or two per handle in practice.
+**
+** High-level read_buf gets a malloc'd bufvec which libfuse frees, along
+** with any memory in it, so the small value path still costs one copy
+** there.  The low-level API replies straight from the shared value.
+**
+** Environment Variables:
+	HASHIFUSE_SPLICE_MIN	bytes from which a value goes in a memfd.  Default 65536, 0 disables.
+****************************************************************************/
+
+#ifndef READ_BUFFER
+#define READ_BUFFER
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "Trace.h"
+
+class ReadBuffer
+{
+public:
+	typedef std::shared_ptr<const std::string> Value;
+
+	explicit ReadBuffer(const Value &value)
+	{
+		reset(value);
+	}
+
+	// Replace the content, e.g. after a write through the same handle.
+	void reset(const Value &value)
+	{
+		std::shared_ptr<const Snapshot> next = std::make_shared<Snapshot>(std::make_shared<Content>(value, threshold()));
+
+		publish(next);
+	}
+
+	static ReadBuffer *of(const struct fuse_file_info *fi)
+	{
+		return (ReadBuffer*) fi->fh;
+	}
+
+	// After a truncate on the open handle.  Growing isn't supported, the
+	// handle is for reading.
+	void shrink(size_t size)
+	{
+		std::shared_ptr<const Snapshot> now = snapshot();
+
+		if (size < now->length)
+			publish(std::make_shared<Snapshot>(now->content, size));
+	}
+
+	size_t size() const
+	{
+		return snapshot()->length;
+	}
+
+	// For the low-level API: point bv at [offset, offset + size).  Memory
+	// stays ours, so reply with fuse_reply_data before we go away.
+	void window(struct fuse_bufvec &bv, size_t size, off_t offset) const
+	{
+		std::shared_ptr<const Snapshot> now = snapshot();
+		const size_t len = now->clamp(size, offset);
+
+		bv = FUSE_BUFVEC_INIT(len);
+		if (now->content->fd >= 0)
+			now->point(bv.buf[0], offset);
+		else if (len)
+			bv.buf[0].mem = (void*) (now->content->data->data() + offset);
+		now->count(len);
+	}
+
+	// For high-level read_buf.  libfuse frees *bufp and any memory in it.
+	int read(struct fuse_bufvec **bufp, size_t size, off_t offset) const
+	{
+		return snapshot()->read(bufp, size, offset);
+	}
+
+	// read_buf for a value without an open handle, e.g. after create.
+	static int read(const Value &value, struct fuse_bufvec **bufp, size_t size, off_t offset)
+	{
+		return Snapshot(std::make_shared<Content>(value, 0)).read(bufp, size, offset);
+	}
+
+	// One line summary for logs.
+	static std::string stats()
+	{
+		Counters &c = counters();
+		return "read buffers memfds=" + std::to_string(c.memfds.load())
+			+ " spliced=" + std::to_string(c.spliced.load())
+			+ " copied=" + std::to_string(c.copied.load()) + " bytes";
+	}
+
+private:
+	struct Counters
+	{
+		Counters() : memfds(0), spliced(0), copied(0)
+		{
+		}
+
+		std::atomic<unsigned long> memfds;
+		std::atomic<unsigned long long> spliced, copied;
+	};
+
+	// A value, in a memfd if it's at least min bytes (and min isn't 0).
+	struct Content
+	{
+		Content(const Value &value, size_t min) : data(value), fd(-1), length(value ? value->size() : 0)
+		{
+			if (min && value && value->size() >= min && (fd = memfd(*value)) >= 0)
+			{
+				++counters().memfds;
+				data.reset();
+			}
+		}
+
+		~Content()
+		{
+			if (fd >= 0)
+				close(fd);
+		}
+
+		Value data;
+		int fd;
+		size_t length;
+	};
+
+	// What one read sees.  Never changed once published.
+	struct Snapshot
+	{
+		explicit Snapshot(const std::shared_ptr<const Content> &content) : content(content), length(content->length)
+		{
+		}
+
+		Snapshot(const std::shared_ptr<const Content> &content, size_t length) : content(content), length(length)
+		{
+		}
+
+		int read(struct fuse_bufvec **bufp, size_t size, off_t offset) const
+		{
+			const size_t len = clamp(size, offset);
+			struct fuse_bufvec *bv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+
+			if (!bv)
+				return -ENOMEM;
+
+			*bv = FUSE_BUFVEC_INIT(len);
+			if (content->fd >= 0)
+				point(bv->buf[0], offset);
+			else if (len)
+			{
+				if (!(bv->buf[0].mem = malloc(len)))
+				{
+					free(bv);
+					return -ENOMEM;
+				}
+				Trace::Span span("copy", "copy out");
+				memcpy(bv->buf[0].mem, content->data->data() + offset, len);
+			}
+
+			count(len);
+			*bufp = bv;
+			return 0;
+		}
+
+		size_t clamp(size_t size, off_t offset) const
+		{
+			if (offset < 0 || (size_t) offset >= length)
+				return 0;
+			return std::min(size, length - (size_t) offset);
+		}
+
+		void point(struct fuse_buf &buf, off_t offset) const
+		{
+			buf.flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			buf.fd = content->fd;
+			buf.pos = offset;
+		}
+
+		void count(size_t len) const
+		{
+			if (content->fd >= 0)
+				counters().spliced += len;
+			else
+				counters().copied += len;
+		}
+
+		std::shared_ptr<const Content> content;
+		size_t length;
+	};
+
+	static Counters &counters()
+	{
+		static Counters c;
+		return c;
+	}
+
+	static size_t threshold()
+	{
+		static const size_t min = getenv("HASHIFUSE_SPLICE_MIN") ? strtoul(getenv("HASHIFUSE_SPLICE_MIN"), NULL, 10) : 65536;
+		return min;
+	}
+
+	// Anonymous shmem file holding a copy of content, or -1.
+	static int memfd(const std::string &content)
+	{
+		Trace::Span span("copy", "memfd copy");
+		int fd = memfd_create("hashifuse", MFD_CLOEXEC);
+		size_t done = 0;
+
+		if (fd < 0)
+			return -1;
+
+		while (done < content.size())
+		{
+			ssize_t n = write(fd, content.data() + done, content.size() - done);
+			if (n <= 0)
+			{
+				close(fd);
+				return -1;
+			}
+			done += n;
+		}
+		return fd;
+	}
+
+	std::shared_ptr<const Snapshot> snapshot() const
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return current;
+	}
+
+	// The one it replaces may still be under a reply, so it's kept.
+	void publish(const std::shared_ptr<const Snapshot> &next)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		if (current)
+			retired.push_back(current);
+		current = next;
+	}
+
+	mutable std::mutex lock;
+	std::shared_ptr<const Snapshot> current;
+	std::vector<std::shared_ptr<const Snapshot> > retired;
+};
+
+#endif
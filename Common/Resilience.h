@@ -0,0 +1,273 @@
+﻿/****************************************************************************
+**
+** Resilience - adaptive timeouts, jittered retry and a circuit breaker.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Hardcoded 1s/5s timeouts are wrong both ways: far too long for a local
+** Consul agent that answers in a millisecond, too short for a leader under
+** load.  Instead each endpoint class (method + backend + route template)
+** keeps its last 128 latencies and gets a timeout of 4x its p99, clamped
+** to [250ms, HASHIFUSE_TIMEOUT_MAX].  The legacy constant is used until 16
+** samples are in.
+**
+** The route template comes from the filesystem, which knows its API's
+** shape: route() stars the names in a path, so every job or every pod in
+** every namespace is one class that gathers samples from all of them,
+** instead of a class per key that never warms up.  Without one the path is used with
+** its query dropped.  Past MAX_CLASSES classes, new ones share one class
+** per method and backend so the table stays bounded.
+**
+** Idempotent requests (GET, LIST, HEAD) that fail at the transport level,
+** 429 or 5xx are retried with full jitter exponential backoff (50ms base).
+**
+** Each backend has a circuit breaker.  After HASHIFUSE_BREAKER consecutive
+** failures it opens and every call fails fast with 503 instead of tying up
+** FUSE threads on timeouts.  After the cooldown one probe is let through;
+** success closes it again.
+**
+** Environment Variables:
+	HASHIFUSE_RETRIES			retries for idempotent requests.  Default 2.
+	HASHIFUSE_TIMEOUT_MAX		ceiling for adaptive timeouts in ms.  Default 30000.
+	HASHIFUSE_BREAKER			consecutive failures to open the breaker.  Default 5, 0 disables.
+	HASHIFUSE_BREAKER_COOLDOWN	ms before a probe is let through.  Default 5000.
+****************************************************************************/
+
+#ifndef RESILIENCE
+#define RESILIENCE
+
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <stdlib.h>
+#include "CurlPool.h"
+
+class Resilience
+{
+public:
+	// Returned by run() while a backend's breaker is open.
+	static const long SHED = 503;
+	enum { MAX_CLASSES = 256 };
+
+	// Path (query already dropped) to its route template.
+	typedef std::string (*Route)(const std::string &path);
+
+	Resilience() : retried(0), shed(0), trips(0),
+		retries(2), maxTimeout(30000), threshold(5), cooldown(5000)
+	{
+		if (getenv("HASHIFUSE_RETRIES"))
+			retries = atoi(getenv("HASHIFUSE_RETRIES"));
+		if (getenv("HASHIFUSE_TIMEOUT_MAX"))
+			maxTimeout = std::max<long>(minTimeout, atol(getenv("HASHIFUSE_TIMEOUT_MAX")));
+		if (getenv("HASHIFUSE_BREAKER"))
+			threshold = atoi(getenv("HASHIFUSE_BREAKER"));
+		if (getenv("HASHIFUSE_BREAKER_COOLDOWN"))
+			cooldown = atol(getenv("HASHIFUSE_BREAKER_COOLDOWN"));
+	}
+
+	// The filesystem's route template.  Set it once in main(), e.g.
+	// Resilience::route() = nomadRoute;
+	static Route &route()
+	{
+		static Route fn = NULL;
+		return fn;
+	}
+
+	// method + backend + route template.  "GET http://localhost:4646/v1/job/*"
+	// for every job.
+	static std::string endpoint(const std::string &method, const std::string &url)
+	{
+		const std::string backend = CurlPool::origin(url);
+		const std::string path = url.substr(backend.size(), url.find('?', backend.size()) - backend.size());
+
+		return method + ' ' + backend + (route() ? route()(path) : path);
+	}
+
+	// Is the backend's breaker open?  Callers with a cache can serve stale.
+	bool open(const std::string &url)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Breaker &b = breakers[CurlPool::origin(url)];
+		return b.failures >= threshold && threshold > 0 && Clock::now() < b.until;
+	}
+
+	// fn(timeout_ms) makes one attempt and returns the HTTP status,
+	// or <= 0 if nothing came back.  Set it with CURLOPT_TIMEOUT_MS.
+	template <class F>
+	long run(const std::string &method, const std::string &url, long legacy_ms, F fn)
+	{
+		const std::string backend = CurlPool::origin(url), cls = bounded(endpoint(method, url), method + ' ' + backend + "/*");
+		const bool idempotent = (method == "GET" || method == "LIST" || method == "HEAD");
+		long code = SHED;
+
+		for (int attempt = 0; ; ++attempt)
+		{
+			if (!allow(backend))
+			{
+				++shed;
+				return code;
+			}
+
+			const long timeout = this->timeout(cls, legacy_ms);
+			const Clock::time_point start = Clock::now();
+			code = fn(timeout);
+			const long ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+			const bool failed = (code <= 0 || code == 429 || code >= 500);
+
+			// Timeouts count too, or p99 could never grow past the timeout.
+			if (code > 0 || ms >= timeout)
+				sample(cls, ms);
+			result(backend, !failed);
+
+			if (!failed || !idempotent || attempt >= retries)
+				return code;
+
+			++retried;
+			std::this_thread::sleep_for(std::chrono::milliseconds(backoff(attempt)));
+		}
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::string out = "resilience retried=" + std::to_string(retried.load())
+			+ " shed=" + std::to_string(shed.load())
+			+ " trips=" + std::to_string(trips.load());
+		std::lock_guard<std::mutex> lk(lock);
+
+		for (std::map<std::string, Latency>::iterator it = latencies.begin(); it != latencies.end(); ++it)
+			out += " [" + it->first + " p99=" + std::to_string(p99(it->second)) + "ms]";
+		return out;
+	}
+
+	std::atomic<unsigned long> retried, shed, trips;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	enum { minTimeout = 250, window = 128, warmup = 16 };
+
+	struct Latency
+	{
+		Latency() : next(0)
+		{
+		}
+
+		std::vector<long> ms;
+		size_t next;
+	};
+
+	struct Breaker
+	{
+		Breaker() : failures(0), probing(false)
+		{
+		}
+
+		int failures;
+		bool probing;
+		Clock::time_point until;
+	};
+
+	static long p99(const Latency &l)
+	{
+		if (l.ms.empty())
+			return 0;
+
+		std::vector<long> sorted(l.ms);
+		std::vector<long>::iterator nth = sorted.begin() + (sorted.size() * 99) / 100;
+		std::nth_element(sorted.begin(), nth, sorted.end());
+		return *nth;
+	}
+
+	// cls if it's known or there's room for it, else the catch all.
+	std::string bounded(const std::string &cls, const std::string &overflow)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		if (latencies.size() < (size_t)MAX_CLASSES || latencies.count(cls))
+			return cls;
+		return overflow;
+	}
+
+	long timeout(const std::string &cls, long legacy_ms)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		const Latency &l = latencies[cls];
+
+		if (l.ms.size() < (size_t)warmup)
+			return legacy_ms;
+		return std::min<long>(maxTimeout, std::max<long>(minTimeout, 4 * p99(l)));
+	}
+
+	void sample(const std::string &cls, long ms)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Latency &l = latencies[cls];
+
+		if (l.ms.size() < (size_t)window)
+			l.ms.push_back(ms);
+		else
+			l.ms[l.next] = ms;
+		l.next = (l.next + 1) % window;
+	}
+
+	// Closed: let everything through.  Open: nothing until the cooldown
+	// passes, then exactly one probe (half open) whose result decides.
+	bool allow(const std::string &backend)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Breaker &b = breakers[backend];
+
+		if (threshold <= 0 || b.failures < threshold)
+			return true;
+		if (b.probing || Clock::now() < b.until)
+			return false;
+
+		b.probing = true;
+		return true;
+	}
+
+	void result(const std::string &backend, bool ok)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Breaker &b = breakers[backend];
+
+		if (ok)
+		{
+			b.failures = 0;
+			b.probing = false;
+			return;
+		}
+
+		if (++b.failures == threshold || b.probing)
+		{
+			++trips;
+			b.until = Clock::now() + std::chrono::milliseconds(cooldown);
+		}
+		b.probing = false;
+	}
+
+	// Full jitter: uniform in [0, min(1s, 50ms * 2^attempt)].
+	static long backoff(int attempt)
+	{
+		static thread_local std::mt19937 rng(std::random_device{}());
+		std::uniform_int_distribution<long> jitter(0, std::min(1000L, 50L << std::min(attempt, 5)));
+		return jitter(rng);
+	}
+
+	int retries;
+	long maxTimeout;
+	int threshold;
+	long cooldown;
+
+	std::mutex lock;
+	std::map<std::string, Latency> latencies;
+	std::map<std::string, Breaker> breakers;
+};
+
+#endif
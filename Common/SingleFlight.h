@@ -0,0 +1,144 @@
+﻿/****************************************************************************
+**
+** SingleFlight - coalesce identical in-flight requests.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** An "ls -l" makes the kernel getattr every entry while readers re-read the
+** same paths, so identical GETs pile up concurrently.  The first caller for a
+** key (the leader) does the request.  Anyone asking for the same key while
+** it's in flight just waits and gets a copy of the leader's response.
+** Nothing is cached: once the leader finishes the next caller goes again.
+**
+** Only use this for idempotent reads (GET, LIST) and key on everything that
+** changes the answer: method, URL and the auth headers sent with it.
+****************************************************************************/
+
+#ifndef SINGLE_FLIGHT
+#define SINGLE_FLIGHT
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <curl/curl.h>
+#include "Trace.h"
+
+template <class T>
+class SingleFlight
+{
+public:
+	SingleFlight() : leaders(0), coalesced(0)
+	{
+	}
+
+	// Build a key from method, URL and every request header (token,
+	// namespace, client headers) without keeping the token itself around.
+	static std::string key(const std::string &method, const std::string &url, const struct curl_slist *headers)
+	{
+		std::string identity;
+		for (; headers; headers = headers->next)
+			identity += std::string(headers->data) + '\n';
+
+		return method + ' ' + url + ' ' + std::to_string(std::hash<std::string>()(identity));
+	}
+
+	// fn(result) performs the request and returns its status.
+	// Concurrent callers with the same key share a single call of fn.
+	template <class F>
+	long run(const std::string &key, T &result, F fn)
+	{
+		std::shared_ptr<Call> call;
+		bool leader = false;
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			typename std::map<std::string, std::shared_ptr<Call> >::iterator it = calls.find(key);
+			if (it == calls.end())
+			{
+				call = std::make_shared<Call>();
+				calls[key] = call;
+				leader = true;
+			}
+			else
+			{
+				call = it->second;
+				++call->waiters;
+			}
+		}
+
+		// Follower: wait on the leader and copy its response.
+		if (!leader)
+		{
+			++coalesced;
+			Trace::Span span("lock", "singleflight wait");
+			std::shared_ptr<const Response> res = call->done.get();
+			span.end();
+			result = res->second;
+			return res->first;
+		}
+
+		++leaders;
+		long code;
+		try
+		{
+			code = fn(result);
+		}
+		catch (...)
+		{
+			finish(key);
+			call->promise.set_exception(std::current_exception());
+			throw;
+		}
+
+		// Only pay for a copy if somebody is actually waiting.
+		if (finish(key))
+			call->promise.set_value(std::make_shared<const Response>(code, result));
+		else
+			call->promise.set_value(std::shared_ptr<const Response>());
+
+		return code;
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		return "singleflight requests=" + std::to_string(leaders.load())
+			+ " coalesced=" + std::to_string(coalesced.load());
+	}
+
+	std::atomic<unsigned long> leaders, coalesced;
+
+private:
+	typedef std::pair<long, T> Response;
+
+	struct Call
+	{
+		Call() : done(promise.get_future().share()), waiters(0)
+		{
+		}
+
+		std::promise<std::shared_ptr<const Response> > promise;
+		std::shared_future<std::shared_ptr<const Response> > done;
+		size_t waiters;		// Guarded by SingleFlight::lock.
+	};
+
+	// Retire the key so new callers start a fresh request.
+	// Returns how many callers joined this one.
+	size_t finish(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		size_t waiters = calls[key]->waiters;
+		calls.erase(key);
+		return waiters;
+	}
+
+	std::mutex lock;
+	std::map<std::string, std::shared_ptr<Call> > calls;
+};
+
+#endif
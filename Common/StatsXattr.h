@@ -0,0 +1,53 @@
+﻿/****************************************************************************
+**
+** StatsXattr - live counters as an extended attribute on the mount root.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** The stats() lines every helper logs at unmount are also readable while
+** mounted, without a log file or a debug build:
+**
+**	getfattr -n user.hashifuse.stats --only-values /mnt/vault
+**
+** Only the mount root has it.  Everything else answers ENODATA, which also
+** keeps the kernel's security.capability lookups before each write cheap.
+****************************************************************************/
+
+#ifndef STATS_XATTR
+#define STATS_XATTR
+
+#include <string>
+#include <errno.h>
+#include <string.h>
+
+namespace StatsXattr
+{
+	static const char name[] = "user.hashifuse.stats";
+
+	inline bool matches(const char *path, const char *attr)
+	{
+		return !strcmp(path, "/") && !strcmp(attr, name);
+	}
+
+	// getxattr protocol: size 0 asks how big, too small is ERANGE.
+	inline int value(const std::string &stats, char *buf, size_t size)
+	{
+		if (!size)
+			return stats.size();
+		if (size < stats.size())
+			return -ERANGE;
+
+		memcpy(buf, stats.data(), stats.size());
+		return stats.size();
+	}
+
+	// listxattr for path, names NUL separated.
+	inline int list(const char *path, char *buf, size_t size)
+	{
+		if (strcmp(path, "/"))
+			return 0;
+		return value(std::string(name, sizeof(name)), buf, size);
+	}
+}
+
+#endif
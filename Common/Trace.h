@@ -0,0 +1,410 @@
+﻿/****************************************************************************
+**
+** Trace - per-thread ring buffers of timed spans, dumped as Chrome trace
+** event JSON for Perfetto or chrome://tracing.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Histograms say an op is slow, not where the time went.  With tracing on,
+** every FUSE op (see Metrics::Timer) and the phases inside it are kept as
+** complete events: waiting on a lock (a curl handle, a BackendLimit slot, a
+** singleflight leader), the request and its curl perform, JSON parsing and
+** copies of content.  Nested spans on one thread show up nested.
+**
+** Each thread writes only its own ring, newest over oldest, with a sequence
+** number per slot so a dump running at the same time skips slots being
+** overwritten rather than locking the writer.  Off by default, and then a
+** span is one untaken branch.
+**
+** Dump with either of:
+**
+**	kill -USR2 <pid>
+**	echo > /mnt/consul/.hashifuse/trace
+**
+** and open the file in https://ui.perfetto.dev.  Each dump replaces it,
+** through a fresh mkstemp file renamed over it, so a link planted at the
+** path is replaced rather than followed.
+**
+** Environment Variables:
+	HASHIFUSE_TRACE			spans kept per thread.  Default 0, off.
+	HASHIFUSE_TRACE_FILE	where dumps go.  Default $XDG_RUNTIME_DIR/hashifuse-<pid>.trace.json,
+							or /tmp/ if that's not set.
+****************************************************************************/
+
+#ifndef TRACE
+#define TRACE
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+class Trace
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	enum { DETAIL = 120 };
+
+	// The one per process, configured from the environment.
+	static Trace &get()
+	{
+		static Trace trace;
+		return trace;
+	}
+
+	// One span from construction to end() or scope exit.  cat and name
+	// are string literals, kept by pointer.  detail (a URL, say) is
+	// copied, cut to DETAIL bytes.
+	class Span
+	{
+	public:
+		Span(const char *cat, const char *name) : trace(get()), cat(cat), name(name), detail(NULL)
+		{
+			if (trace.enabled)
+				start = Clock::now();
+		}
+
+		Span(const char *cat, const char *name, const std::string &detail) : trace(get()), cat(cat), name(name), detail(&detail)
+		{
+			if (trace.enabled)
+				start = Clock::now();
+		}
+
+		~Span()
+		{
+			end();
+		}
+
+		void end()
+		{
+			if (trace.enabled && name)
+				trace.record(cat, name, detail, start, Clock::now());
+			name = NULL;
+		}
+
+	private:
+		Span(const Span&);
+		Span &operator=(const Span&);
+
+		Trace &trace;
+		const char *cat, *name;
+		const std::string *detail;
+		Clock::time_point start;
+	};
+
+	// Dump on SIGUSR2.  Call after FUSE daemonizes.
+	void start()
+	{
+		struct sigaction sa;
+
+		if (!enabled || watcher.joinable() || pipe(wake()))
+			return;
+
+		watcher = std::thread(&Trace::watch, this);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = signalled;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+
+	void stop()
+	{
+		if (!watcher.joinable())
+			return;
+
+		signal(SIGUSR2, SIG_DFL);
+		const char quit = 'q';
+		if (write(wake()[1], &quit, 1) == 1)
+			watcher.join();
+		else
+			watcher.detach();
+		close(wake()[0]);
+		close(wake()[1]);
+	}
+
+	// Every ring to the trace file.  False if off or it can't be written.
+	bool dump()
+	{
+		if (!enabled)
+			return false;
+
+		const std::string json = render();
+		std::vector<char> tmp(file.begin(), file.end());
+		const char suffix[] = ".XXXXXX";
+		tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+
+		// 0600 and O_EXCL, so nobody else's file or link gets written.
+		const int fd = mkstemp(tmp.data());
+		FILE *f = (fd < 0) ? NULL : fdopen(fd, "w");
+
+		if (!f)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+				unlink(tmp.data());
+			}
+			return false;
+		}
+		const bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+		if (fclose(f) || !ok || rename(tmp.data(), file.c_str()))
+		{
+			unlink(tmp.data());
+			return false;
+		}
+
+		++dumps;
+		return true;
+	}
+
+	// {"traceEvents":[...]} with an X event per span.
+	std::string render()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		const pid_t pid = getpid();
+		bool first = true;
+
+		for (size_t r = 0; r < rings.size(); ++r)
+		{
+			Ring &ring = *rings[r];
+			const uint64_t next = ring.next.load(std::memory_order_acquire);
+
+			for (uint64_t i = (next > size) ? next - size : 0; i < next; ++i)
+			{
+				Event &e = ring.events[i % size];
+				Event copy;
+
+				// Skip a slot its thread is writing or has lapped.
+				const uint32_t seq = e.seq.load(std::memory_order_acquire);
+				if (seq & 1)
+					continue;
+				copy.cat = e.cat.load(std::memory_order_relaxed);
+				copy.name = e.name.load(std::memory_order_relaxed);
+				copy.start = e.start.load(std::memory_order_relaxed);
+				copy.dur = e.dur.load(std::memory_order_relaxed);
+				copy.tid = e.tid.load(std::memory_order_relaxed);
+				memcpy(copy.detail, e.detail, sizeof(copy.detail));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (e.seq.load(std::memory_order_relaxed) != seq || !copy.name)
+					continue;
+
+				copy.detail[DETAIL - 1] = 0;
+				out += first ? "\n" : ",\n";
+				out += "{\"ph\":\"X\",\"cat\":\"" + escape(copy.cat) + "\",\"name\":\"" + escape(copy.name)
+					+ "\",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(copy.tid)
+					+ ",\"ts\":" + std::to_string(copy.start) + ",\"dur\":" + std::to_string(copy.dur);
+				if (*copy.detail)
+					out += ",\"args\":{\"detail\":\"" + escape(copy.detail) + "\"}";
+				out += '}';
+				first = false;
+			}
+		}
+		return out + "\n]}\n";
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		if (!enabled)
+			return "trace off";
+
+		std::lock_guard<std::mutex> lk(lock);
+		return "trace spans_per_thread=" + std::to_string(size)
+			+ " rings=" + std::to_string(rings.size())
+			+ " dumps=" + std::to_string(dumps.load())
+			+ " file=" + file;
+	}
+
+	// The write-to-dump control file next to Metrics' stats.
+	static const char *control()
+	{
+		return "/.hashifuse/trace";
+	}
+
+	// Write only, size 0.  False for any other path.
+	static bool stat(const std::string &path, struct stat &st)
+	{
+		if (path != control())
+			return false;
+
+		memset(&st, 0, sizeof(st));
+		st.st_uid = getuid();
+		st.st_gid = getgid();
+		st.st_mode = S_IFREG | 0200;
+		st.st_nlink = 1;
+		st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+		return true;
+	}
+
+	const bool enabled;
+
+private:
+	struct Event
+	{
+		Event() : seq(0), cat(NULL), name(NULL), start(0), dur(0), tid(0)
+		{
+			detail[0] = 0;
+		}
+
+		std::atomic<uint32_t> seq;
+		std::atomic<const char*> cat, name;
+		std::atomic<uint64_t> start, dur;
+		std::atomic<pid_t> tid;
+		char detail[DETAIL];
+	};
+
+	struct Ring
+	{
+		Ring(size_t size) : events(new Event[size]), next(0), tid(0)
+		{
+		}
+
+		std::unique_ptr<Event[]> events;
+		std::atomic<uint64_t> next;
+		pid_t tid;
+	};
+
+	// Handed back when its thread exits, for the next thread.
+	struct Owner
+	{
+		Owner() : ring(NULL)
+		{
+		}
+
+		~Owner()
+		{
+			if (ring)
+				get().release(ring);
+		}
+
+		Ring *ring;
+	};
+
+	Trace() : enabled(getenv("HASHIFUSE_TRACE") && atoi(getenv("HASHIFUSE_TRACE")) > 0),
+		size(enabled ? atoi(getenv("HASHIFUSE_TRACE")) : 0), dumps(0), epoch(Clock::now())
+	{
+		const char *dir = getenv("XDG_RUNTIME_DIR");
+
+		file = getenv("HASHIFUSE_TRACE_FILE") ? getenv("HASHIFUSE_TRACE_FILE")
+			: std::string(dir && *dir ? dir : "/tmp") + "/hashifuse-" + std::to_string(getpid()) + ".trace.json";
+	}
+
+	~Trace()
+	{
+		for (size_t i = 0; i < rings.size(); ++i)
+			delete rings[i];
+	}
+
+	Ring &local()
+	{
+		static thread_local Owner owner;
+
+		if (!owner.ring)
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			if (!spare.empty())
+			{
+				owner.ring = spare.back();
+				spare.pop_back();
+			}
+			else
+			{
+				owner.ring = new Ring(size);
+				rings.push_back(owner.ring);
+			}
+			owner.ring->tid = syscall(SYS_gettid);
+		}
+		return *owner.ring;
+	}
+
+	void release(Ring *ring)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		spare.push_back(ring);
+	}
+
+	void record(const char *cat, const char *name, const std::string *detail, Clock::time_point start, Clock::time_point end)
+	{
+		Ring &ring = local();
+		const uint64_t i = ring.next.load(std::memory_order_relaxed);
+		Event &e = ring.events[i % size];
+		const uint32_t seq = e.seq.load(std::memory_order_relaxed);
+
+		e.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		e.cat.store(cat, std::memory_order_relaxed);
+		e.name.store(name, std::memory_order_relaxed);
+		e.start.store(std::chrono::duration_cast<std::chrono::microseconds>(start - epoch).count(), std::memory_order_relaxed);
+		e.dur.store(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), std::memory_order_relaxed);
+		e.tid.store(ring.tid, std::memory_order_relaxed);
+		if (detail)
+			strncpy(e.detail, detail->c_str(), DETAIL - 1);
+		else
+			e.detail[0] = 0;
+		e.seq.store(seq + 2, std::memory_order_release);
+		ring.next.store(i + 1, std::memory_order_release);
+	}
+
+	static std::string escape(const char *s)
+	{
+		std::string out;
+
+		for (; *s; ++s)
+			if (*s == '"' || *s == '\\')
+				(out += '\\') += *s;
+			else if ((unsigned char) *s < 0x20)
+				out += ' ';
+			else
+				out += *s;
+		return out;
+	}
+
+	static int *wake()
+	{
+		static int fds[2] = { -1, -1 };
+		return fds;
+	}
+
+	// Only a write(2) is safe in a handler.  The watcher does the rest.
+	static void signalled(int)
+	{
+		const int saved = errno;
+		const char d = 'd';
+		ssize_t ignored = write(wake()[1], &d, 1);
+
+		(void) ignored;
+		errno = saved;
+	}
+
+	void watch()
+	{
+		char c;
+
+		while (read(wake()[0], &c, 1) == 1 && c == 'd')
+			dump();
+	}
+
+	const size_t size;
+	std::string file;
+	std::atomic<unsigned long> dumps;
+	const Clock::time_point epoch;
+	std::mutex lock;
+	std::vector<Ring*> rings, spare;
+	std::thread watcher;
+};
+
+#endif
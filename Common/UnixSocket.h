@@ -0,0 +1,51 @@
+﻿/****************************************************************************
+**
+** UnixSocket - unix:///path addresses for local agents.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** Vault Agent, a Consul client agent, a local Nomad agent or kubectl proxy
+** --unix-socket can all listen on a unix domain socket.  Going through it
+** skips the TCP loopback stack on every metadata op and gets us the agent's
+** cache.  The address follows the Hashicorp CLIs: VAULT_ADDR=unix:///run/
+** vault-agent.sock, CONSUL_HTTP_ADDR=unix:///run/consul.sock and so on.
+**
+** The request URL becomes http://localhost/... and libcurl is pointed at
+** the socket with CURLOPT_UNIX_SOCKET_PATH.  Pooled and shared connections
+** are still matched on the socket path, so reuse works as with TCP.
+****************************************************************************/
+
+#ifndef UNIX_SOCKET
+#define UNIX_SOCKET
+
+#include <string>
+#include <curl/curl.h>
+
+namespace UnixSocket
+{
+	// If addr is unix://<path>, move <path> into socket and rewrite addr
+	// to the http://localhost base requests should be made against.
+	inline bool split(std::string &addr, std::string &socket)
+	{
+		static const std::string scheme = "unix://";
+
+		if (addr.compare(0, scheme.size(), scheme))
+		{
+			socket.clear();
+			return false;
+		}
+
+		socket = addr.substr(scheme.size());
+		addr = "http://localhost";
+		return true;
+	}
+
+	// Needs doing after every curl_easy_reset, which drops the socket path.
+	inline void apply(CURL *curl, const std::string &socket)
+	{
+		if (!socket.empty())
+			curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, socket.c_str());
+	}
+}
+
+#endif
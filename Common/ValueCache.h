@@ -0,0 +1,205 @@
+﻿/****************************************************************************
+**
+** ValueCache - short lived cache of file contents keyed by path.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** getattr has to report a real st_size or the kernel can't read the file
+** without direct_io.  The only way to know the size of a secret or key is
+** to fetch it, so getattr fills this cache and the read()s that follow
+** are served from it instead of fetching the same value again.
+**
+** Each entry keeps a version that bumps whenever a refetch returns
+** different content, and an mtime from when that happened.  open() uses
+** keep() to tell the kernel whether its page cache for the file is still
+** good, so repeat reads of an unchanged value never leave the kernel.
+**
+** put() caches data we already have without a fetch, like the items of a
+** list response, optionally with the backend's own modification time.
+**
+** Given a CachePolicy, each path is kept for its own lifetime instead of
+** HASHIFUSE_CACHE_TTL, which is then only the fallback.  "index" entries
+** stay until invalidated.
+**
+** Environment Variables:
+	HASHIFUSE_CACHE_TTL		seconds a value is trusted before refetching.  Default 5.
+	HASHIFUSE_CACHE_MAX		entries kept before expired ones are pruned.  Default 4096.
+****************************************************************************/
+
+#ifndef VALUE_CACHE
+#define VALUE_CACHE
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <time.h>
+#include <stdlib.h>
+#include "CachePolicy.h"
+
+class ValueCache
+{
+public:
+	typedef std::shared_ptr<const std::string> Value;
+
+	ValueCache(const CachePolicy *policy = NULL) : hits(0), misses(0), policy(policy), ttl(5), max(4096)
+	{
+		if (getenv("HASHIFUSE_CACHE_TTL"))
+			ttl = atoi(getenv("HASHIFUSE_CACHE_TTL"));
+		if (getenv("HASHIFUSE_CACHE_MAX"))
+			max = atol(getenv("HASHIFUSE_CACHE_MAX"));
+	}
+
+	// Fresh value of path, calling fetch(std::string &data) -> int (0 is
+	// success) if we don't have one.  Nothing is cached on failure.
+	template <class F>
+	int get(const std::string &path, Value &value, time_t &mtime, F fetch)
+	{
+		if (find(path, value, mtime))
+			return 0;
+
+		std::shared_ptr<std::string> data = std::make_shared<std::string>();
+		int res = fetch(*data);
+		if (res)
+			return res;
+
+		store(path, data, 0, value, mtime);
+		return 0;
+	}
+
+	// Fresh value of path if we have one.  Counts a miss otherwise.
+	bool find(const std::string &path, Value &value, time_t &mtime)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, Entry>::iterator it = entries.find(path);
+
+		if (it == entries.end() || Clock::now() >= it->second.expires)
+		{
+			++misses;
+			return false;
+		}
+
+		++hits;
+		value = it->second.value;
+		mtime = it->second.mtime;
+		return true;
+	}
+
+	// Cache data we already have, e.g. one item out of a list response.
+	// modified is the backend's own modification time if it has one, else
+	// 0 for "when the content last changed".  value and mtime are as get().
+	void put(const std::string &path, const std::string &data, time_t modified, Value &value, time_t &mtime)
+	{
+		store(path, std::make_shared<std::string>(data), modified, value, mtime);
+	}
+
+	void put(const std::string &path, const std::string &data, time_t modified = 0)
+	{
+		Value value;
+		time_t mtime;
+		put(path, data, modified, value, mtime);
+	}
+
+	// For open(): true if the kernel's cached pages for path are still
+	// this content, ie it hasn't changed since the last open.
+	bool keep(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, Entry>::iterator it = entries.find(path);
+
+		if (it == entries.end())
+			return false;
+
+		bool same = (it->second.opened == it->second.version);
+		it->second.opened = it->second.version;
+		return same;
+	}
+
+	// After we write or delete path ourselves.
+	void invalidate(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		entries.erase(path);
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return "value cache hits=" + std::to_string(hits.load())
+			+ " misses=" + std::to_string(misses.load())
+			+ " entries=" + std::to_string(entries.size())
+			+ " ttl=" + std::to_string(ttl) + "s";
+	}
+
+	std::atomic<unsigned long> hits, misses;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry
+	{
+		Entry() : version(0), opened(0), mtime(0)
+		{
+		}
+
+		Value value;
+		unsigned long version, opened;
+		time_t mtime;
+		Clock::time_point expires;
+	};
+
+	void store(const std::string &path, const Value &data, time_t modified, Value &value, time_t &mtime)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		if (entries.size() >= max)
+			prune();
+
+		Entry &e = entries[path];
+		if (!e.value || *e.value != *data)
+		{
+			++e.version;
+			e.mtime = modified ? modified : time(NULL);
+			e.value = data;
+		}
+		else if (modified)
+			e.mtime = modified;
+
+		const double seconds = policy ? policy->ttl(path, ttl) : ttl;
+		if (seconds < 0)
+			e.expires = Clock::time_point::max();
+		else
+			e.expires = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+
+		value = e.value;
+		mtime = e.mtime;
+	}
+
+	// Drop expired entries, or everything if they're all fresh.
+	void prune()
+	{
+		const Clock::time_point now = Clock::now();
+
+		for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); )
+		{
+			if (it->second.expires <= now)
+				entries.erase(it++);
+			else
+				++it;
+		}
+
+		if (entries.size() >= max)
+			entries.clear();
+	}
+
+	const CachePolicy *policy;
+	int ttl;
+	size_t max;
+
+	std::mutex lock;
+	std::map<std::string, Entry> entries;
+};
+
+#endif
@@ -0,0 +1,185 @@
+﻿/****************************************************************************
+**
+** WriteBack - writes staged per open handle, committed once on flush.
+**
+** Header only, include from any of the HashiFUSE main.cpp files.
+**
+** The kernel splits a write() into chunks of at most 128k (with big_writes)
+** and each chunk arrives as its own write op with an offset.  A backend
+** value has no offsets, only PUT the whole thing, so writing each chunk as
+** it came both took one round trip per chunk and left the key holding
+** whichever chunk was last.  Instead write() copies every chunk into the
+** handle's staged content at its offset, and flush (each close()) or
+** release takes the whole content once for a single PUT.
+**
+** A handle opened without O_TRUNC starts from the value it opened, so
+** appends and in place edits keep the rest of the file.  Filesystems ask
+** for FUSE_CAP_ATOMIC_O_TRUNC, so O_TRUNC arrives with open instead of as
+** a separate truncate that would PUT an empty value first.
+**
+** Handles are keyed by fi->fh, so every handle opened for writing needs
+** one even when there's nothing to read.
+**
+** Offsets and sizes come straight from the client, so staged content is
+** capped at the backend's largest value: a pwrite or ftruncate past it
+** fails with EFBIG, and one the allocator can't satisfy with ENOMEM,
+** rather than throwing out of a FUSE callback and taking the mount down.
+****************************************************************************/
+
+#ifndef WRITE_BACK
+#define WRITE_BACK
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+class WriteBack
+{
+public:
+	typedef std::shared_ptr<const std::string> Value;
+
+	// max is the most a value may hold.  Vault's default max_request_size.
+	WriteBack(size_t max = 32 << 20) : max(max), writes(0), commits(0), bytes(0)
+	{
+	}
+
+	// Handle fh was opened for writing, with base as its current content
+	// (NULL for a new file).  Opened with O_TRUNC, it starts empty and
+	// commits even without a write, which is how "> file" empties a file.
+	void open(uint64_t fh, const Value &base, bool truncated = false)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Staged &s = handles[fh];
+
+		if (!truncated)
+			s.base = base;
+		s.dirty = truncated;
+	}
+
+	// Stage size bytes at offset.  Returns size, -EBADF for a handle that
+	// wasn't opened for writing, or -EFBIG/-ENOMEM if it can't be held.
+	int write(uint64_t fh, const char *buf, size_t size, off_t offset)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<uint64_t, Staged>::iterator it = handles.find(fh);
+
+		if (it == handles.end())
+			return -EBADF;
+		if (offset < 0 || (uint64_t) offset > max || size > max - (uint64_t) offset)
+			return -EFBIG;
+
+		try
+		{
+			std::string &content = it->second.start();
+			if (content.size() < (size_t) offset + size)
+				content.resize((size_t) offset + size);
+			memcpy(&content[offset], buf, size);
+		}
+		catch (const std::exception &)
+		{
+			return -ENOMEM;
+		}
+		it->second.dirty = true;
+		++writes;
+		return size;
+	}
+
+	// ftruncate/setattr size on the handle.  0, -EBADF if it isn't ours,
+	// or -EFBIG/-ENOMEM as for write().
+	int truncate(uint64_t fh, off_t size)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<uint64_t, Staged>::iterator it = handles.find(fh);
+
+		if (it == handles.end())
+			return -EBADF;
+		if (size < 0 || (uint64_t) size > max)
+			return -EFBIG;
+
+		try
+		{
+			it->second.start().resize(size);
+		}
+		catch (const std::exception &)
+		{
+			return -ENOMEM;
+		}
+		it->second.dirty = true;
+		return 0;
+	}
+
+	// Content to commit if fh has writes since the last take().  Clean
+	// handles (reads, or close() of a dup'd fd with nothing new) return
+	// false and need no request.
+	bool take(uint64_t fh, Value &content)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<uint64_t, Staged>::iterator it = handles.find(fh);
+
+		if (it == handles.end() || !it->second.dirty)
+			return false;
+
+		content = std::make_shared<std::string>(it->second.start());
+		it->second.dirty = false;
+		++commits;
+		bytes += content->size();
+		return true;
+	}
+
+	// From release, after any last take().
+	void close(uint64_t fh)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		handles.erase(fh);
+	}
+
+	// One line summary for logs.
+	std::string stats()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return "write back writes=" + std::to_string(writes)
+			+ " commits=" + std::to_string(commits)
+			+ " bytes=" + std::to_string(bytes)
+			+ " open=" + std::to_string(handles.size());
+	}
+
+private:
+	struct Staged
+	{
+		Staged() : started(false), dirty(false)
+		{
+		}
+
+		// Copy of base, taken on the first write so an O_RDWR handle
+		// that only reads never copies it.
+		std::string &start()
+		{
+			if (!started)
+			{
+				if (base)
+					content = *base;
+				base.reset();
+				started = true;
+			}
+			return content;
+		}
+
+		Value base;
+		std::string content;
+		bool started, dirty;
+	};
+
+	const uint64_t max;
+	std::mutex lock;
+	std::map<uint64_t, Staged> handles;
+	unsigned long writes, commits;
+	unsigned long long bytes;
+};
+
+#endif
@@ -3,35 +3,72 @@
 ** ConsulFS - FUSE client for Hashicorp consul secrets.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./consulfs -o direct_io /path/to/mount
+** Build instructions: g++ -D_FILE_OFFSET_BITS=64 `pkg-config --cflags fuse3` main.cpp -lfuse3 -lcurl -ljsoncpp
+** Usage: ./consulfs /path/to/mount
 **
-** Note direct_io is mandatory right now until we can get key size in getattrs.
+** Uses the libfuse3 low-level API (3.12 or later).  Inodes map to paths in
+** an inode table, and lookups are answered from the parent's cached keys
+** listing.  Lookups fetch values (cached briefly) to report real sizes, so
+** direct_io is no longer needed and the kernel page cache works.
+**
+** Entry and attr timeouts, listings and values are all kept per path class
+** by a CachePolicy: the root and /kv for an hour, keys for a second.  A
+** listing's class is its dir path with a trailing slash.  Keys under
+** CONSULFS_WATCH are kept until a blocking query on them says they
+** changed, which also invalidates them in the kernel.
 ** Environment Variables: 
-	CONSUL_HTTP_ADDR		consul addr.  Example: "localhost:8500"
+	CONSUL_HTTP_ADDR		consul addr.  Example: "localhost:8500" or "unix:///run/consul.sock"
 	CONSUL_HTTP_SSL[=true]	should we add "https://" to CONSUL_HTTP_ADDR? default false
 	CONSUL_HTTP_TOKEN		token to auth via (token is only support currently)
 	CONSULFS_LOG			path to file for logging output (or cout default)
 	CONSULFS_DC				optional dc (nonstandard env variable)
+	CONSULFS_CACHE_POLICY	optional rules ahead of the defaults in main.cpp.  See Common/CachePolicy.h.
+	CONSULFS_WATCH			optional key prefix ("/" for all of kv) to follow with blocking queries.
+	HASHIFUSE_IO_URING		optional "true" for io_uring request queues.  See Common/FuseUring.h.
 ****************************************************************************/
 
-#define FUSE_USE_VERSION 28
+#define FUSE_USE_VERSION 312
 //#define CURL_STATICLIB
 //#define _GNU_SOURCE
 
 #include <string>
 #include <string.h>
 #include <sstream>
-#include <set>
+#include <map>
 #include <iostream>
 #include <algorithm>
 #include <curl/curl.h>
 #include <json/json.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <fstream>
 #include <mutex>
+#include <memory>
+#include <chrono>
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/Resilience.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
+#include "../Common/UnixSocket.h"
+#include "../Common/CachePolicy.h"
+#include "../Common/ValueCache.h"
+#include "../Common/ReadBuffer.h"
+#include "../Common/WriteBack.h"
+#include "../Common/FuseUring.h"
+#include "../Common/CurlMulti.h"
+#include "../Common/SingleFlight.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/JsonList.h"
+#include "../Common/InodeTable.h"
+#include "../Common/ChangeFeed.h"
 
 const char RESET[]	= "\033[0m";
 const char RED[]	= "\033[1;31m";
@@ -49,11 +86,86 @@ const string apiVers = "/v1";
 // Will use this to store optional dc; This is deferred.
 //string dc;
 
-// Set logs to other options via CONSULFS_LOG or default to std::cout
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  To CONSULFS_LOG if set, else cout.
+Log logs;
+
+// Keep-alive handles so each op doesn't pay a fresh connect.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Adaptive timeouts, retries and a circuit breaker per backend.
+Resilience guard;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// libfuse3 runs the workers, -o max_threads=N,max_idle_threads=N.
+string loopConfig = "fuse loop single threaded";
+
+// All transfers run on one curl_multi event loop thread.
+CurlMulti engine;
+
+// Identical GETs in flight at the same time share one request.
+SingleFlight<string> flights;
+
+// Key prefix followed by the change feed, without a leading slash.  Empty
+// if CONSULFS_WATCH is "/", unset means no watch.
+const char *watching = getenv("CONSULFS_WATCH");
+const string watchPrefix = (!watching || *watching != '/') ? (watching ? watching : "") : watching + 1;
+
+// Watched keys and listings stay until the feed drops them.
+string watchRules()
+{
+	if (!watching)
+		return "";
+	return watchPrefix.empty() ? "/kv=index;/kv/**=index;" : "/kv/" + watchPrefix + "**=index;";
+}
+
+// Cache lifetimes by path class.
+CachePolicy policy("CONSULFS_CACHE_POLICY", (watchRules() + "/=1h;/kv=1h;/kv/**=1s").c_str());
+
+// Values fetched by lookup for st_size, reused by open.
+ValueCache values(&policy);
+
+// Inode numbers <-> paths, with the kernel's lookup counts.
+InodeTable inodes;
+
+// Writes staged per handle until flush PUTs them in one go.  Consul
+// refuses values over 512KB.
+WriteBack pending(512 * 1024);
+
+// Requests come over io_uring queues rather than /dev/fuse reads.
+int uring = 0;
+
+// For kernel cache invalidations from the change feed.
+struct fuse_session *session = NULL;
+
+// Blocking query on CONSULFS_WATCH.
+ChangeFeed feed;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
+
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
+
+// Directory children, name -> is a dir.
+typedef map<string, bool> Listing;
+
+struct CachedListing
+{
+	shared_ptr<const Listing> children;
+	chrono::steady_clock::time_point expires;
+};
+
+// Listings by directory path, kept as long as the policy says.
+mutex listLock;
+map<string, CachedListing> listings;
 
 // CURL callback
 namespace
@@ -64,12 +176,9 @@ namespace
             std::size_t num,
             char* out)
     {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << GREEN).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -78,9 +187,9 @@ namespace
 // /proc/{clientPID}/fd/{stream}
 // Defaults to stdout (1), set stream to 2 for stderr.
 // Returns 0 on success or 1 if ostream errors.
-int clientOut(string output, short stream = 1)
+int clientOut(fuse_req_t req, string output, short stream = 1)
 {
-	fuse_context *con = fuse_get_context();
+	const struct fuse_ctx *con = fuse_req_ctx(req);
 	ofstream out((string)"/proc/" + to_string(con->pid) + "/fd/" + to_string(stream));
 
 	if (out)
@@ -92,61 +201,107 @@ int clientOut(string output, short stream = 1)
 		return 1;
 }
 
+// Route template for timeouts and metrics.  Every key is one class and
+// every listing (trailing /) another.
+string consulRoute(const string &path)
+{
+	static const string kv = "/v1/kv/";
+
+	if (path.compare(0, kv.size(), kv))
+		return path;
+	return kv + (path[path.size() - 1] == '/' ? "*/" : "*");
+}
+
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
 // TODO: sanitize environment variables for injection vulnerabilities.
-int	consulCURL(string url, stringstream &httpData, string request = "GET", const string data = "")
+int	consulCURL(string url, string &httpData, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
+	long httpCode = 0;
 	static const string tokenHead = "X-Consul-Token: ";
-	string addr = "http://localhost:8500";
+	string addr = "http://localhost:8500", sock;
 	struct curl_slist *headers = NULL;
-	CURL* curl;
 
 	if (getenv("CONSUL_HTTP_ADDR"))
 		addr = getenv("CONSUL_HTTP_ADDR");
 	
+	UnixSocket::split(addr, sock);
 	url = addr + url;	// + dc;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
+
+	logs(Log::DBG) << CYAN << url << RESET << endl;
 
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	// Beware error handling (lack).
+	headers = curl_slist_append(headers, (tokenHead + getenv("CONSUL_HTTP_TOKEN")).c_str());
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock on line 1...
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case.
+	// No more global curlmutex here.  Each op gets its own pooled handle and the
+	// transfer itself runs on the curl_multi event loop, so worker threads
+	// only block on their own request.
+	auto attempt = [&](string &body, long timeout) -> long
 	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(curl = curl_easy_init()))
+		long code = 0;
+		CURL* curl;
+
+		if (!(curl = pool.acquire(backend)))
 			return -1;
+		share.attach(curl);
+		encoding.prepare(curl);
+		UnixSocket::apply(curl, sock);
+		engine.prepare(curl);
 		
-		// Beware error handling (lack).
-		headers = curl_slist_append(headers, (tokenHead + getenv("CONSUL_HTTP_TOKEN")).c_str());
 		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str());
 		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &body);
 
 		if (data != "")
 		{
-			#if DEBUG
-			*logs << YELLOW << data << RESET << endl;
-			#endif 
+			logs(Log::DBG) << YELLOW << data << RESET << endl;
 			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
 		}
 		
-		curl_easy_perform(curl);
+		const size_t before = body.size();
+		engine.perform(curl);
+		share.count(curl, url);
+		encoding.count(curl, url, body.size() - before);
+
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		pool.release(backend, curl);
+		return code;
+	};
+
+	// Timeout adapts to the endpoint's p99 (1s until it has samples).  GETs
+	// and LISTs retry with jitter, and a down backend fails fast.
+	auto transfer = [&](string &body) -> long
+	{
+		BackendLimit::Slot slot(limit, url);
+		return guard.run(request, url, 1000, [&](long timeout) -> long
+		{
+			body.clear();
+			return attempt(body, timeout);
+		});
+	};
+
+	// A burst of getattrs on the same path only needs one GET.
+	if (request == "GET" && data == "")
+		httpCode = flights.run(SingleFlight<string>::key(request, url, headers), httpData, transfer);
+	else
+		httpCode = transfer(httpData);
+
+	curl_slist_free_all(headers);
+	metrics.request(request, url, httpCode, start);
 
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
-	}
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
+		logs(Log::ERR) << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
 		return httpCode;
 	}
 
@@ -156,268 +311,956 @@ int	consulCURL(string url, stringstream &httpData, string request = "GET", const
 // CURL wrapper with JSON
 int	consulCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	if (consulCURL(url, stream, request, post))
+	string body;
+	if (consulCURL(url, body, request, post))
 		return -EINVAL;
 
-	stream >> jsonData;
+	if (!HttpBuffer::parseJson(body, jsonData))
+		return -EIO;
+	return 0;
+}
+
+// CURL wrapper for listings that are plain arrays of strings.
+// Returns the HTTP code on failure so callers can tell a 404.
+int	consulCURLnames(string url, vector<string> &names)
+{
+	string body;
+	int res;
+
+	if ((res = consulCURL(url, body)))
+		return res;
+
+	if (!JsonList::names(body, "", "", names))
+		return -EIO;
+	return 0;
+}
+
+// Raw value via the value cache, so lookup's fetch serves the open after it.
+int consulValue(const string &path, ValueCache::Value &value, time_t &mtime)
+{
+	return values.get(path, value, mtime, [&](string &raw)
+	{
+		return consulCURL(apiVers + path + "?raw=true", raw) ? -ENOENT : 0;
+	});
+}
+
+// Path of name inside dir.
+string child(const string &dir, const char *name)
+{
+	return (dir == "/") ? dir + name : dir + '/' + name;
+}
+
+// Seconds the kernel may cache path's entry and attributes.  There's no
+// expiry for "index" entries, only our own invalidation.
+double consulTimeout(const string &path)
+{
+	const double ttl = policy.ttl(path, 1.0);
+	return (ttl < 0) ? 86400 : ttl;
+}
+
+// Children of dir, name -> is a dir.  Cached by policy so a lookup of
+// every name in a directory costs one keys GET, not one each.
+int consulList(const string &dir, shared_ptr<const Listing> &listing)
+{
+	{
+		lock_guard<mutex> lk(listLock);
+		map<string, CachedListing>::iterator it = listings.find(dir);
+		if (it != listings.end() && chrono::steady_clock::now() < it->second.expires)
+		{
+			listing = it->second.children;
+			return 0;
+		}
+	}
+
+	shared_ptr<Listing> children = make_shared<Listing>();
+
+	// For now we just support kv endpoint.
+	// TODO - add catalog, services, health, etc.
+	if (dir == "/")
+		(*children)["kv"] = true;
+	else
+	{
+		vector<string> keys;
+
+		// Need separator to not recurse.  An empty KV is a 404, not a missing dir.
+		int res = consulCURLnames(apiVers + dir + "/?keys&separator=/", keys);
+		if (res && !(res == 404 && dir == "/kv"))
+			return -ENOENT;
+
+		// Keys come back in full, chop off our prefix ("" for /kv itself).
+		const size_t start = (dir == "/kv") ? 0 : dir.length() - 4 + 1;
+		for (vector<string>::const_iterator itr = keys.begin(); itr != keys.end(); ++itr)
+		{
+			if (itr->length() <= start)
+				continue;	// Self
+
+			// Consul allows a key and a dir of the same name.  Dirs take precedence.
+			string name = itr->substr(start);
+			if (name[name.length() - 1] == '/')
+				(*children)[name.substr(0, name.length() - 1)] = true;
+			else
+				children->insert(make_pair(name, false));
+		}
+	}
+
+	const double ttl = policy.ttl((dir == "/") ? dir : dir + '/', 1.0);
+	lock_guard<mutex> lk(listLock);
+	CachedListing &cached = listings[dir];
+	cached.children = children;
+	if (ttl < 0)
+		cached.expires = chrono::steady_clock::time_point::max();
+	else
+		cached.expires = chrono::steady_clock::now()
+			+ chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(ttl));
+	listing = children;
 	return 0;
 }
 
+// After we add or remove something in dir ourselves.
+void consulUnlist(const string &dir)
+{
+	lock_guard<mutex> lk(listLock);
+	listings.erase(dir);
+}
+
+// After we write path, in case its dir was listed before the key existed.
+void consulListed(const string &path)
+{
+	const string dir = path.substr(0, path.rfind('/'));
+	lock_guard<mutex> lk(listLock);
+	map<string, CachedListing>::iterator it = listings.find(dir);
+
+	if (it != listings.end() && !it->second.children->count(path.substr(dir.size() + 1)))
+		listings.erase(it);
+}
+
 // We need to assume quite a few attrs.
-// Use key trailing slash to identify dir/file.
-int consul_getattr(const char *path, struct stat *stat)
+// Files need their value for a real size, so we can run without direct_io.
+void consulStat(const string &path, bool dir, struct stat &st)
 {
-	string p(path), key;
-	Json::Value keys;
+	ValueCache::Value value;
+	time_t mtime;
+
+	if (Metrics::stat(path, st) || Trace::stat(path, st))
+		return;
 
-	stat->st_uid = getuid();
-	stat->st_gid = getgid();
-	stat->st_blocks = 
-	stat->st_blksize = 
-	stat->st_size = 0;
+	memset(&st, 0, sizeof(st));
+	st.st_uid = getuid();
+	st.st_gid = getgid();
 
 	// Be careful with timestamp - file will always appear modified on disk.
 	// If using rsync, disable timestamp comparisons.
-	//stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
-	stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
+	if (dir)
+	{
+		st.st_mode = S_IFDIR | ((path == "/" || path == "/kv") ? 0500 : 0700);
+		st.st_nlink = 2;
+		return;
+	}
 
-	// For now we just support kv endpoint.
-	// TODO - add catalog, services, health, etc.
-	if (p == "/" || p == "/kv")
+	st.st_mode = S_IFREG | 0600;
+	st.st_nlink = 1;
+	if (!consulValue(path, value, mtime))
 	{
-		stat->st_mode = S_IFDIR | 0500;
-		return 0;
+		st.st_size = value->size();
+		st.st_mtime = st.st_ctime = mtime;
+	}
+}
+
+// Entry for a path we know exists, counting a lookup in the inode table.
+void consulEntry(const string &path, bool dir, struct fuse_entry_param &e)
+{
+	memset(&e, 0, sizeof(e));
+	consulStat(path, dir, e.attr);
+	e.ino = e.attr.st_ino = inodes.ref(path, dir);
+	e.attr_timeout = e.entry_timeout = consulTimeout(path);
+}
+
+// Answered from the parent's cached listing.  Missing names get a
+// negative entry so the kernel stops asking for a while.
+void consul_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	Metrics::Timer timer(metrics, "lookup");
+	struct fuse_entry_param e;
+	shared_ptr<const Listing> listing;
+	string dir;
+	bool isdir;
+
+	if (!inodes.get(parent, dir, isdir))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// The hidden stats dir and files aren't in any listing.
+	if (Metrics::stat(child(dir, name), e.attr) || Trace::stat(child(dir, name), e.attr))
+	{
+		consulEntry(child(dir, name), S_ISDIR(e.attr.st_mode), e);
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	if (consulList(dir, listing))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	Listing::const_iterator it = listing->find(name);
+	if (it == listing->end())
+	{
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = consulTimeout(child(dir, name));
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	consulEntry(child(dir, name), it->second, e);
+	fuse_reply_entry(req, &e);
+}
+
+void consul_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	inodes.forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+void consul_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; ++i)
+		inodes.forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+void consul_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "getattr");
+	struct stat st;
+	string path;
+	bool dir;
+
+	if (!inodes.get(ino, path, dir))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
 
-	if (consulCURLjson(apiVers + p + "?keys&separator=/", keys))
-		return -ENOENT;
+	consulStat(path, dir, st);
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, consulTimeout(path));
+}
+
+// Need to implement this for truncate/write even though we do nothing.
+// The next write replaces the whole value anyway.
+void consul_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct stat st;
+	string path;
+	bool dir;
+
+	if (!inodes.get(ino, path, dir))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	// Chop off the "/kv/"
-	p = p.substr(4);
-	for (Json::ValueConstIterator it = keys.begin(); it != keys.end(); ++it)
+	consulStat(path, dir, st);
+	st.st_ino = ino;
+	if (to_set & FUSE_SET_ATTR_SIZE)
 	{
-		// Do keys start with "path" or "path/"?
-		// Double search here is ultimate laziness but it works..
-		key = it->asString();
-		size_t plen = key.find(p);
-		if (plen != string::npos)
+		st.st_size = attr->st_size;
+		if (fi && fi->fh)
 		{
-			if (key.length() > plen + p.length() && key[plen + p.length() ] == '/')
-				stat->st_mode = S_IFDIR | 0700;
-			else
-				stat->st_mode = S_IFREG | 0600;
-			return 0;
+			const int res = pending.truncate(fi->fh, attr->st_size);
+
+			if (res == -EBADF)
+				ReadBuffer::of(fi)->shrink(attr->st_size);
+			else if (res)
+			{
+				fuse_reply_err(req, -res);
+				return;
+			}
 		}
 	}
+	fuse_reply_attr(req, &st, consulTimeout(path));
+}
 
-	return 0;
+// Everything stats() knows, for the hidden stats file.
+string consulStats()
+{
+	return metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ values.stats() + '\n'
+		+ ReadBuffer::stats() + '\n'
+		+ pending.stats() + '\n'
+		+ inodes.stats() + '\n'
+		+ flights.stats() + '\n'
+		+ feed.stats() + '\n'
+		+ limit.stats() + '\n'
+		+ guard.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n'
+		+ loopConfig + '\n';
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
-int consul_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Take the value once per open into a ReadBuffer owned by fi->fh.  Usually
+// it's still in the value cache from the lookup just before.  Every
+// read() on the handle is served from the buffer instead of another GET.
+void consul_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	string data;
-	stringstream sstream;
+	Metrics::Timer timer(metrics, "open");
+	ValueCache::Value value;
+	time_t mtime;
+	string path;
+	bool dir;
+
+	if (!inodes.get(ino, path, dir))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	if (consulCURL(apiVers + path + "?raw=true", sstream))
-		return -ENOENT;
+	// Write only and bufferless, consul_write dumps the trace.
+	if (path == Trace::control())
+	{
+		if ((fi->flags & O_ACCMODE) != O_WRONLY)
+			fuse_reply_err(req, EACCES);
+		else
+			fuse_reply_open(req, fi);
+		return;
+	}
 
-	data = sstream.str();
-	if (data.length() - offset <= 0)
-		return 0;
+	// Read only, and sized by what's read rather than by getattr.
+	if (path == Metrics::file())
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		{
+			fuse_reply_err(req, EACCES);
+			return;
+		}
+
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) new ReadBuffer(make_shared<string>(consulStats()));
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	// Nothing worth fetching if we're about to overwrite it.  Writers
+	// without O_TRUNC still need it to append to or edit in place.
+	if (!(fi->flags & O_TRUNC))
+	{
+		if (consulValue(path, value, mtime))
+		{
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+
+		// Unchanged since last open?  Then the kernel's pages are good.
+		fi->keep_cache = values.keep(path);
+	}
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+	fi->fh = (uint64_t) new ReadBuffer(value);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		pending.open(fi->fh, value, fi->flags & O_TRUNC);
+	fuse_reply_open(req, fi);
 }
 
-// Writes are straightforward.  Should verify size < consul maximum though the API should do that.
-int consul_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Any offset, any size, replied straight out of the open buffer.  Big
+// values are spliced from its memfd, small ones written from memory.
+void consul_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	stringstream stream;
-	if (consulCURL(apiVers + path, stream, "PUT", buf))
-		return -EINVAL;
-	return size;
+	Metrics::Timer timer(metrics, "read");
+	struct fuse_bufvec bv;
+
+	// Only the write only trace control file has no buffer.
+	if (!fi->fh)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	ReadBuffer::of(fi)->window(bv, size, off);
+	fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
 }
 
-// Return stat of root fs (partition).
-int consul_statfs(const char *path, struct statvfs *statv)
-{
-	statv->f_bsize	= 
-	statv->f_frsize	= 
-	statv->f_blocks	= 
-	statv->f_bfree	= 
-	statv->f_bavail	= 32768;
-	statv->f_files	= 15;
-	statv->f_bfree	= 15;
-	statv->f_favail	= 10000;
-	statv->f_fsid	= 100;
-	statv->f_flag	= 0;
-	statv->f_namemax = 0xFFFF;
+// PUT whatever was written through the handle since the last commit as
+// one value.  Returns an errno for fuse_reply_err, 0 if nothing to do.
+// Should verify size < consul maximum though the API should do that.
+int consulCommit(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	WriteBack::Value content;
+	string path, body;
+	bool dir;
+
+	if (!inodes.get(ino, path, dir))
+		return ENOENT;
+
+	if (!pending.take(fi->fh, content))
+		return 0;
+
+	if (consulCURL(apiVers + path, body, "PUT", *content))
+		return EIO;
+
+	values.invalidate(path);
+	consulListed(path);
+
+	// Keep reads on this handle consistent with what we just wrote.
+	ReadBuffer::of(fi)->reset(content);
 	return 0;
 }
 
-// List directory contents of a Path.
-int consul_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+// Every close() of the file, so a failed PUT shows up as close() failing.
+void consul_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	Json::Value keys;
-	string p(path), f;
+	Metrics::Timer timer(metrics, "flush");
+	fuse_reply_err(req, consulCommit(ino, fi));
+}
 
-	set<string> names;
-	size_t depth = count(p.begin(), p.end(), '/');
+// Normally flush already committed.  Nobody to tell if this one fails.
+void consul_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int res;
 
-	stringstream sp(p);
-	string ignore, dc, l1, l2;
-	getline(sp, ignore, '/');	// /
-	getline(sp, dc, '/');		// dc1
-	getline(sp, l1, '/');		// nodes,catalog,kv,etc
-	getline(sp, l2, '/');		// leaf
+	if ((res = consulCommit(ino, fi)))
+		logs(Log::ERR) << RED << "Write on release failed: " << strerror(res) << RESET << endl;
 
-	//regex_search(p.begin(), p.end(), matches, (regex)".*/.*");
-	if (p == "/")
+	pending.close(fi->fh);
+	delete ReadBuffer::of(fi);
+	fi->fh = 0;
+	fuse_reply_err(req, 0);
+}
+
+// Stage the chunk at its offset.  The kernel splits big writes into many of
+// these, which used to be a PUT each with only the last chunk surviving.
+void consul_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "write");
+	int res;
+
+	// Only the trace control file has no buffer, see consul_open.
+	if (!fi->fh)
 	{
-		if (consulCURLjson(apiVers + p + "catalog/datacenters", keys))
-			return -ENOENT;
+		if (Trace::get().dump())
+			fuse_reply_write(req, size);
+		else
+			fuse_reply_err(req, EIO);
+		return;
 	}
-	else if (depth == 2)
+
+	if ((res = pending.write(fi->fh, buf, size, off)) < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+// Return stat of root fs (partition).
+void consul_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs statv;
+
+	memset(&statv, 0, sizeof(statv));
+	statv.f_bsize	=
+	statv.f_frsize	=
+	statv.f_blocks	=
+	statv.f_bfree	=
+	statv.f_bavail	= 32768;
+	statv.f_files	= 15;
+	statv.f_bfree	= 15;
+	statv.f_favail	= 10000;
+	statv.f_fsid	= 100;
+	statv.f_flag	= 0;
+	statv.f_namemax = 0xFFFF;
+	fuse_reply_statfs(req, &statv);
+}
+
+// Append one dirent to a readdir reply buffer.  Names the kernel hasn't
+// looked up have no inode yet, so they get the unknown ino like libfuse's
+// own high-level API gives them.
+void addDirent(fuse_req_t req, string &buf, const char *name, fuse_ino_t ino, bool dir)
+{
+	struct stat st;
+	size_t old = buf.size(), len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino ? ino : 0xffffffff;
+	st.st_mode = dir ? S_IFDIR : S_IFREG;
+
+	buf.resize(old + len);
+	fuse_add_direntry(req, &buf[old], len, name, &st, buf.size());
+}
+
+// List directory contents once per opendir into a reply buffer owned by
+// fi->fh.  readdir hands out slices of it, so a big directory read in
+// several calls is one consistent listing.
+void consul_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "opendir");
+	shared_ptr<const Listing> listing;
+	string dir;
+	bool isdir;
+
+	if (!inodes.get(ino, dir, isdir))
 	{
-		filler(buf, "nodes", NULL, 0);
-		filler(buf, "kv", NULL, 0);
-		filler(buf, "catalog", NULL, 0);
-		filler(buf, "acl", NULL, 0);
-		filler(buf, "connect", NULL, 0);
-		return 0;
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	else if (depth == 3)
+
+	if (!isdir)
 	{
-		
-		filler(buf, "nodes", NULL, 0);
-		filler(buf, "kv", NULL, 0);
-		filler(buf, "catalog", NULL, 0);
-		filler(buf, "acl", NULL, 0);
-		filler(buf, "connect", NULL, 0);
-		return 0;
+		fuse_reply_err(req, ENOTDIR);
+		return;
 	}
-	// Need separator to not recurse
-	else if (consulCURLjson(apiVers + p + "/?keys=true&separator=/", keys))
-		return -ENOENT;
-
-	// Chop off "/kv/" or "/kv" (annoyingly we need both).
-	//p = p.substr(3);
-	//if (p.length() > 0 && p[0] == '/')
-	//	p = p.substr(1);
-	
-	// Use a set to eliminate duplicates.
-	// Ugly but unfortunately Consul API keys=true implies recursive.
-	for(Json::Value::const_iterator itr = keys.begin() ; itr != keys.end() ; itr++ )
-	{
-		size_t start = (p == "") ? 0 : p.length() + 1;
-		f = itr->asString().substr(start);
-		if (f == "")
-			continue; // Self
-
-		size_t slash = f.find('/');
-		if (slash <= f.length() - 1)
-			names.insert(f.substr(0, slash));
-		else if (slash == string::npos)
-			names.insert(f);
+
+	if (dir == Metrics::dir())
+		listing = make_shared<Listing>(Listing {{"stats", false}, {"trace", false}});
+	else if (consulList(dir, listing))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
 
-	// Unwind the unique set..
-	for (set<string>::iterator name = names.begin(); name != names.end(); ++name)
-    	filler(buf, name->c_str(), NULL, 0);
-	return 0;
+	string *buf = new string();
+	addDirent(req, *buf, ".", ino, true);
+	addDirent(req, *buf, "..", 0, true);
+	for (Listing::const_iterator it = listing->begin(); it != listing->end(); ++it)
+		addDirent(req, *buf, it->first.c_str(), inodes.peek(child(dir, it->first.c_str())), it->second);
+
+	fi->fh = (uint64_t) buf;
+	fuse_reply_open(req, fi);
 }
 
-// Need to implement this for truncate/write even though we do nothing.
-int consul_truncate(const char *path, off_t newsize)
+void consul_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	const string &buf = *(string*) fi->fh;
+
+	if (off >= (off_t) buf.size())
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, buf.data() + off, min(size, buf.size() - off));
+}
+
+void consul_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	delete (string*) fi->fh;
+	fi->fh = 0;
+	fuse_reply_err(req, 0);
+}
+
+// Write a blank dir key, with its trailing slash, and fill its entry.  A
+// file gets only the entry: its handle writes the key on the first
+// commit, so create and write are one PUT.  Returns an errno for
+// fuse_reply_err.
+int consulMake(fuse_ino_t parent, const char *name, bool dir, struct fuse_entry_param &e)
 {
+	string path, body;
+	bool isdir;
+
+	if (!inodes.get(parent, path, isdir))
+		return ENOENT;
+
+	// Only kv lives at the root.
+	if (path == "/")
+		return EPERM;
+
+	consulUnlist(path);
+	path = child(path, name);
+	if (dir && consulCURL(apiVers + path + '/', body, "PUT"))
+		return EINVAL;
+
+	// Empty until that commit, and known to be, so the entry needs no GET.
+	if (dir)
+		values.invalidate(path);
+	else
+		values.put(path, string());
+	consulEntry(path, dir, e);
 	return 0;
 }
 
-// Write a blank key
-int consul_mkdir(const char *path, mode_t mode)
+void consul_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-	return consul_write(((string)path + '/').c_str(), "", 0, 0, NULL);
+	Metrics::Timer timer(metrics, "mkdir");
+	struct fuse_entry_param e;
+	int res;
+
+	if ((res = consulMake(parent, name, true, e)))
+		fuse_reply_err(req, res);
+	else
+		fuse_reply_entry(req, &e);
 }
 
-// Write a blank key.
-int consul_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+void consul_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
 {
-	return consul_write(path, "", 0, 0, fi);
+	Metrics::Timer timer(metrics, "create");
+	struct fuse_entry_param e;
+	int res;
+
+	if ((res = consulMake(parent, name, false, e)))
+	{
+		fuse_reply_err(req, res);
+		return;
+	}
+
+	// New and empty, release frees it like any opened handle.  Dirty from
+	// the start, so closing it unwritten still commits the empty key.
+	fi->fh = (uint64_t) new ReadBuffer(make_shared<string>());
+	pending.open(fi->fh, NULL, true);
+	fuse_reply_create(req, &e, fi);
 }
 
-// rm file
-int consul_unlink(const char *path)
+// Delete a key, with (dir) or without a trailing slash.
+// Returns an errno for fuse_reply_err, 0 on success.
+int consulRemove(fuse_ino_t parent, const char *name, bool dir)
 {
-	stringstream stream;
-	if (consulCURL(apiVers + path, stream, "DELETE"))
-		return -EINVAL;
+	string path, body;
+	bool isdir;
+
+	if (!inodes.get(parent, path, isdir))
+		return ENOENT;
+
+	consulUnlist(path);
+	path = child(path, name);
+	if (consulCURL(apiVers + path + (dir ? "/" : ""), body, "DELETE"))
+		return EINVAL;
+
+	values.invalidate(path);
+	consulUnlist(path);
+	inodes.detach(path);
 	return 0;
 }
 
+// rm file
+void consul_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	Metrics::Timer timer(metrics, "unlink");
+	fuse_reply_err(req, consulRemove(parent, name, false));
+}
+
 // rm dir
-int consul_rmdir(const char *path)
+void consul_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	Metrics::Timer timer(metrics, "rmdir");
+	fuse_reply_err(req, consulRemove(parent, name, true));
+}
+
+// Keys by ModifyIndex, as a watch response lists them.
+typedef map<string, uint64_t> KeyIndexes;
+
+// Any key under prefix, ie the dir exists.
+bool consulHas(const KeyIndexes &keys, const string &prefix)
+{
+	KeyIndexes::const_iterator it = keys.lower_bound(prefix);
+	return it != keys.end() && !it->first.compare(0, prefix.size(), prefix);
+}
+
+enum Change { MODIFIED, ADDED, REMOVED };
+
+// A key changed in Consul between the before and after responses.  Drop
+// it from our caches and the kernel's, and if it came or went, the
+// listings and dentries of the dirs that came or went with it.  Returns
+// how many kernel invalidations that took.
+unsigned long consulChanged(string key, Change change, const KeyIndexes &before, const KeyIndexes &after)
+{
+	unsigned long notified = 0;
+
+	if (!key.empty() && key[key.size() - 1] == '/')
+		key.erase(key.size() - 1);
+
+	const string path = "/kv/" + key;
+	values.invalidate(path);
+	if (uint64_t ino = inodes.peek(path))
+		notified += !fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+
+	if (change == MODIFIED)
+		return notified;
+	if (change == REMOVED)
+		inodes.detach(path);
+
+	// /kv gained or lost "a", /kv/a gained or lost "b" ...  Dirs on the
+	// way that were there before and after are unchanged.
+	for (size_t end = 3, next; end != string::npos; end = next)
+	{
+		const string dir = path.substr(0, end);
+		next = path.find('/', end + 1);
+		const string name = path.substr(end + 1, (next == string::npos) ? next : next - end - 1);
+
+		if (next != string::npos)
+		{
+			const string sub = path.substr(4, next - 4 + 1);
+			if (consulHas(before, sub) == consulHas(after, sub))
+				continue;
+		}
+
+		consulUnlist(dir);
+		if (uint64_t parent = inodes.peek(dir))
+			notified += !fuse_lowlevel_notify_inval_entry(session, parent, name.c_str(), name.size());
+	}
+	return notified;
+}
+
+// ModifyIndex of every watched key, and the X-Consul-Index to block on.
+// Only the feed thread touches these.
+KeyIndexes watchIndexes;
+uint64_t watchIndex = 0;
+bool watchPrimed = false;
+
+// One blocking query on the watched prefix.  Returns when something under
+// it changed or after Consul's wait, then diffs ModifyIndexes against the
+// last response to find exactly which keys changed.  The first response
+// only sets the baseline.
+bool consulWatch()
+{
+	string addr = getenv("CONSUL_HTTP_ADDR") ? getenv("CONSUL_HTTP_ADDR") : "http://localhost:8500", sock;
+	string body, head;
+	struct curl_slist *headers = NULL;
+	Json::Value keys;
+	CURL *curl;
+
+	UnixSocket::split(addr, sock);
+	const string url = addr + apiVers + "/kv/" + watchPrefix + "?recurse&wait=5m&index=" + to_string(watchIndex);
+
+	if (!(curl = curl_easy_init()))
+		return false;
+	if (getenv("CONSUL_HTTP_TOKEN"))
+		headers = curl_slist_append(headers, ((string)"X-Consul-Token: " + getenv("CONSUL_HTTP_TOKEN")).c_str());
+	UnixSocket::apply(curl, sock);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+	const long code = feed.perform(curl, [&](const string &line) { body.append(line).append(1, '\n'); }, &head);
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(headers);
+
+	// An empty prefix is a 404 that still carries an index.
+	const uint64_t index = strtoull(ChangeFeed::header(head, "X-Consul-Index").c_str(), NULL, 10);
+	if ((code != 200 && code != 404) || !index)
+	{
+		if (!feed.stopped())
+			logs(Log::ERR) << RED << "Consul watch on kv/" << watchPrefix << " failed HTTP" << code << RESET << endl;
+		return false;
+	}
+
+	// Timed out with nothing new.
+	if (index == watchIndex)
+		return true;
+
+	if (code == 200 && !HttpBuffer::parseJson(body, keys))
+		return false;
+
+	KeyIndexes now;
+	for (Json::Value::const_iterator it = keys.begin(); it != keys.end(); ++it)
+		now[(*it)["Key"].asString()] = (*it)["ModifyIndex"].asUInt64();
+
+	unsigned long notified = 0;
+	if (watchPrimed)
+	{
+		for (KeyIndexes::const_iterator it = now.begin(); it != now.end(); ++it)
+		{
+			KeyIndexes::const_iterator old = watchIndexes.find(it->first);
+			if (old == watchIndexes.end())
+				notified += consulChanged(it->first, ADDED, watchIndexes, now);
+			else if (old->second != it->second)
+				notified += consulChanged(it->first, MODIFIED, watchIndexes, now);
+		}
+
+		for (KeyIndexes::const_iterator old = watchIndexes.begin(); old != watchIndexes.end(); ++old)
+			if (now.find(old->first) == now.end())
+				notified += consulChanged(old->first, REMOVED, watchIndexes, now);
+	}
+
+	// Consul says to start over if the index ever goes backwards.
+	watchIndex = (index < watchIndex) ? 0 : index;
+	watchIndexes.swap(now);
+	watchPrimed = true;
+	feed.changed(notified);
+	return true;
+}
+
+// getxattr/listxattr reply: size 0 asks how big, too small is ERANGE.
+void consulXattr(fuse_req_t req, const string &value, size_t size)
+{
+	if (!size)
+		fuse_reply_xattr(req, value.size());
+	else if (size < value.size())
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, value.data(), value.size());
+}
+
+// Live counters on the mount root, see Common/StatsXattr.h.
+void consul_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	if (ino != InodeTable::ROOT || strcmp(name, StatsXattr::name))
+		fuse_reply_err(req, ENODATA);
+	else
+		consulXattr(req, loopConfig + '\n' + limit.stats() + '\n' + feed.stats() + '\n', size);
+}
+
+void consul_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	return consul_unlink(((string)path + '/').c_str());
+	if (ino != InodeTable::ROOT)
+		consulXattr(req, "", size);
+	else
+		consulXattr(req, string(StatsXattr::name, sizeof(StatsXattr::name)), size);
 }
 
 // Init curl subsystem and set up log stream.
-void* consul_init(struct fuse_conn_info *conn)
+void consul_init(void *userdata, struct fuse_conn_info *conn)
 {
  	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	Resilience::route() = consulRoute;
 
 	// Set CONSULFS_LOGS env var to log destination if necessary.
 	// Default to cout, which is ignored without -d or -f arg.
-	if (getenv("CONSULFS_LOG"))
+	if (getenv("CONSULFS_LOG") && !logs.open(getenv("CONSULFS_LOG")))
 	{
-		if (!(logs = new ofstream(getenv("CONSULFS_LOG"), ofstream::out)))
-		{
-			cerr << RED << "Unable to open log output file for writing: " << getenv("CONSULFS_LOG") << endl;
-			cerr << "Will revert back to std::cout" << RESET << endl;
-			logs = &cout;
-		}
+		cerr << RED << "Unable to open log output file for writing: " << getenv("CONSULFS_LOG") << endl;
+		cerr << "Will revert back to std::cout" << RESET << endl;
 	}
+	logs.start();
 
 	// Set dc global if we need to.
 	//if (getenv("CONSULFS_DC"))
 	//	dc = (string)"dc=" + getenv("CONSULFS_DC");
 
 	// TODO check/sanitize env variables for injection.
-	conn->want |= FUSE_CAP_BIG_WRITES;
+	*logs << policy.stats() << endl;
+	*logs << "fuse transport " << (uring ? "io_uring" : "/dev/fuse") << endl;
+
+	// Let libfuse splice big values from their memfds into /dev/fuse.
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+	// O_TRUNC with open, so WriteBack doesn't see a separate truncate.
+	conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
 
-	return NULL;
+	// Threads have to start after FUSE daemonizes.
+	if (!engine.start())
+		logs(Log::ERR) << RED << "Unable to start curl_multi engine, falling back to blocking transfers." << RESET << endl;
+
+	if (watching)
+	{
+		feed.watch("kv/" + watchPrefix, consulWatch);
+		feed.start();
+	}
+
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
 }
 
 // Free up curl resources.
-void consul_destroy(void* private_data)
+void consul_destroy(void *userdata)
 {
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	feed.stop();
+	*logs << feed.stats() << endl;
+	engine.stop();
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << guard.stats() << endl;
+	*logs << values.stats() << endl;
+	*logs << ReadBuffer::stats() << endl;
+	*logs << pending.stats() << endl;
+	*logs << inodes.stats() << endl;
+	*logs << limit.stats() << endl;
+	share.cleanup();
+	*logs << flights.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
 	curl_global_cleanup();
 }
 
-// Set up function pointers and return a fuse_operations struct.
+// Set up function pointers and run a low-level session.
 int main(int argc, char *argv[])
 {
-	struct fuse_operations fuse = 
+	struct fuse_lowlevel_ops ops =
 	{
+		.init = consul_init,
+		.destroy = consul_destroy,
+		.lookup = consul_lookup,
+		.forget = consul_forget,
 		.getattr = consul_getattr,
+		.setattr = consul_setattr,
 		.mkdir = consul_mkdir,
 		.unlink = consul_unlink,
 		.rmdir = consul_rmdir,
-		.truncate = consul_truncate,
+		.open = consul_open,
 		.read = consul_read,
 		.write = consul_write,
-		.statfs = consul_statfs,
+		.flush = consul_flush,
+		.release = consul_release,
+		.opendir = consul_opendir,
 		.readdir = consul_readdir,
-		.init = consul_init,
-		.destroy = consul_destroy,
+		.releasedir = consul_releasedir,
+		.statfs = consul_statfs,
+		.getxattr = consul_getxattr,
+		.listxattr = consul_listxattr,
 		.create = consul_create,
+		.forget_multi = consul_forget_multi,
 	};
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	int res = 1;
 
-	if ((getuid() == 0) || (geteuid() == 0))
-		cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << endl;
-	
-	return fuse_main(argc, argv, &fuse, NULL);
+	if ((uring = FuseUring::prepare(&args)) < 0 || limit.parse(&args) == -1 || fuse_parse_cmdline(&args, &opts))
+		return 1;
+
+	if (opts.show_help)
+	{
+		cout << "usage: " << argv[0] << " [options] <mountpoint>" << endl << endl;
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		res = 0;
+	}
+	else if (opts.show_version)
+	{
+		fuse_lowlevel_version();
+		res = 0;
+	}
+	else if (!opts.mountpoint)
+		cerr << "usage: " << argv[0] << " [options] <mountpoint>" << endl;
+	else if ((session = se = fuse_session_new(&args, &ops, sizeof(ops), NULL)))
+	{
+		if ((getuid() == 0) || (geteuid() == 0))
+			cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << RESET << endl;
+
+		if (!fuse_set_signal_handlers(se))
+		{
+			if (!fuse_session_mount(se, opts.mountpoint))
+			{
+				fuse_daemonize(opts.foreground);
+
+				if (opts.singlethread)
+					res = fuse_session_loop(se);
+				else
+				{
+					struct fuse_loop_config *config = fuse_loop_cfg_create();
+					fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+					fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+					fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+					loopConfig = "fuse loop max_threads=" + to_string(opts.max_threads)
+						+ " max_idle_threads=" + to_string(opts.max_idle_threads);
+					res = fuse_session_loop_mt(se, config);
+					fuse_loop_cfg_destroy(config);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return res ? 1 : 0;
 }
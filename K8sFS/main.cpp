@@ -1,27 +1,36 @@
 ﻿/****************************************************************************
 **
-** k8sFS - FUSE2 client for Kubernetes manifests.
+** k8sFS - FUSE3 client for Kubernetes manifests.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./k8sfs -o direct_io /path/to/mount
+** Build instructions: g++ -D_FILE_OFFSET_BITS=64 `pkg-config --cflags fuse3` main.cpp -lfuse3 -lcurl -ljsoncpp
+** Usage: ./k8sfs /path/to/mount
 **
-** Note direct_io is mandatory right now until we can get key size in getattrs.
+** readdir fills full attributes (READDIRPLUS) straight from the list
+** response: size of each item as read returns it, mtime from its metadata.
+** Items are cached, so "ls -l" on a kind is one list call and direct_io is
+** no longer needed.  How long depends on the kind: pods and events churn,
+** configmaps and services hardly do.  Kinds in K8SFS_WATCH are kept until
+** a watch on them says they changed, which also invalidates them in the
+** kernel.
 ** Note this is currently a highly experimental draft.  Reads should be ok.
 **	Writes are much trickier as Kube API is not very idempotent-friendly.
 **	Reading an endpoint gives extra attributes that often can't be written back,
 **	for example - read gets a timestamp.  write can't apply a timestamp, etc.
 ** 
 ** Environment Variables: 
-	KUBE_APISERVER		k8s addr.  Example: "https://localhost:4646"
+	KUBE_APISERVER		k8s addr.  Example: "https://localhost:4646" or "unix:///run/kubectl-proxy.sock"
 	K8SFS_LOG			optional log file path.
+	K8SFS_CACHE_POLICY	optional rules ahead of the defaults below.  See Common/CachePolicy.h.
+	K8SFS_WATCH			optional kinds to watch across namespaces, comma separated.  Example: "pods,deployments"
+	HASHIFUSE_IO_URING	optional "true" for io_uring request queues.  See Common/FuseUring.h.
 
 	KUBE_TOKEN			optional k8s token for auth. (Token auth)
 	K8SFS_CA_PEM		optional manual CA PEM for libcurl (Cert auth)
 	K8SFS_CLIENT_CERT	optional manual client PEM (client cert + key)
 ****************************************************************************/
 
-#define FUSE_USE_VERSION 28
+#define FUSE_USE_VERSION 312
 //#define CURL_STATICLIB
 //#define _GNU_SOURCE
 
@@ -37,16 +46,101 @@
 #include <mutex>
 #include <regex>
 #include <exception>
+#include <time.h>
 
 #include <fuse.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/Resilience.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
+#include "../Common/UnixSocket.h"
+#include "../Common/CurlMulti.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/JsonList.h"
+#include "../Common/CachePolicy.h"
+#include "../Common/ValueCache.h"
+#include "../Common/ReadBuffer.h"
+#include "../Common/FuseUring.h"
+#include "../Common/ChangeFeed.h"
 
 using namespace std;
 
-// Set logs to other options via K8SFS_LOG or default to std::cout
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  To KUBEFS_LOG if set, else cout.
+Log logs;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Keep-alive handles so each op doesn't pay a fresh connect.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Adaptive timeouts, retries and a circuit breaker per backend.
+Resilience guard;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// All transfers run on one curl_multi event loop thread.
+// With HASHIFUSE_HTTP2 a namespace walk multiplexes over one connection.
+CurlMulti engine;
+
+// Kinds followed by the change feed.
+vector<string> watchKinds()
+{
+	vector<string> kinds;
+	string list = getenv("K8SFS_WATCH") ? getenv("K8SFS_WATCH") : "";
+
+	for (size_t start = 0, end; start < list.size(); start = end + 1)
+	{
+		if ((end = list.find(',', start)) == string::npos)
+			end = list.size();
+		if (end > start)
+			kinds.push_back(list.substr(start, end - start));
+	}
+	return kinds;
+}
+
+// Watched kinds stay until the feed drops them.
+string watchRules()
+{
+	vector<string> kinds = watchKinds();
+	string rules;
+
+	for (vector<string>::iterator kind = kinds.begin(); kind != kinds.end(); ++kind)
+		rules += "/*/" + *kind + "/*=index;";
+	return rules;
+}
+
+// Cache lifetimes by kind, /<namespace>/<kind>/<name>.json.
+CachePolicy policy("K8SFS_CACHE_POLICY", (watchRules() +
+	"/*/pods/*=2s;/*/events/*=2s;/*/configmaps/*=1m;/*/services/*=1m;/*/serviceaccounts/*=1m").c_str());
+
+// Items from listings and reads, serialized as read returns them.
+ValueCache values(&policy);
+
+// Requests come over io_uring queues rather than /dev/fuse reads.
+int uring = 0;
+
+// For kernel cache invalidations from the change feed.
+struct fuse *fs = NULL;
+
+// A watch per kind in K8SFS_WATCH.
+ChangeFeed feed;
+
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
+
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -69,15 +163,13 @@ namespace
             std::size_t num,
             char* out)
     {
+    	// Nobody wants the body, just drain it.
     	if (!out)
-    		return 0;
+    		return size * num;
     	
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << PURPLE << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << PURPLE).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -100,35 +192,61 @@ int clientOut(string output, short stream = 1)
 		return 1;
 }
 
+// Route template for timeouts and metrics: the namespace and object names
+// starred, the API group and kind kept, e.g. /api/v1/namespaces/*/pods/*.
+string k8sRoute(const string &path)
+{
+	static const regex ns("(/namespaces/)[^/]+"), name("(/namespaces/\\*/[^/]+/)[^/]+");
+
+	return regex_replace(regex_replace(path, ns, "$1*"), name, "$1*");
+}
+
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
 // TODO: sanitize environment variables for injection vulnerabilities.
-int	k8sCURL(string url, stringstream *httpData = NULL, string request = "GET", const string data = "")
+int	k8sCURL(string url, string *httpData = NULL, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
-	const char *addr = getenv("KUBE_APISERVER");
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
+	long httpCode = 0;
+	string addr = getenv("KUBE_APISERVER") ? getenv("KUBE_APISERVER") : "http://localhost:8080", sock;
 	const char *token = getenv("KUBE_TOKEN");
 	static const string tokenHead = "Authorization: Bearer ";
 	struct curl_slist *headers = NULL;
-	CURL* c;
 
-	url = addr ? (string)addr + url : "http://localhost:8080" + url;
+	// kubectl proxy --unix-socket
+	UnixSocket::split(addr, sock);
+	url = addr + url;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
+	
+	logs(Log::DBG) << CYAN << url << RESET << endl;
+
+	// Beware error handling (lack).
+	if (token)
+		headers = curl_slist_append(headers, (tokenHead + token).c_str());
 	
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	if (data != "")
+	{
+		headers = curl_slist_append(headers, "Content-Type: application/json");
+//			headers = curl_slist_append(headers, "Accept: application/json;as=Table;g=meta.k8s.io;v=v1beta1");
+//			headers = curl_slist_append(headers, "Accept: application/json");
+		logs(Log::DBG) << GREEN << data << RESET << endl;
+	}
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock here.
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case. Could probably use shared curl.
+	// No more global curlmutex here.  Each op gets its own pooled handle and the
+	// transfer itself runs on the curl_multi event loop, so worker threads
+	// only block on their own request.
+	auto attempt = [&](long timeout) -> long
 	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(c = curl_easy_init()))
+		long code = 0;
+		CURL* c;
+
+		if (!(c = pool.acquire(backend)))
 			return -1;
-		
-		// Beware error handling (lack).
-		if (token)
-			headers = curl_slist_append(headers, (tokenHead + token).c_str());
+		share.attach(c);
+		encoding.prepare(c);
+		UnixSocket::apply(c, sock);
+		engine.prepare(c);
 		
 		// Note the ENV variable curl standardizes on has no effect sadly.
 		// TODO: Robustify ca bundle...
@@ -137,38 +255,48 @@ int	k8sCURL(string url, stringstream *httpData = NULL, string request = "GET", c
 		if (getenv("K8SFS_CLIENT_CERT"))
 			curl_easy_setopt(c, CURLOPT_SSLCERT, getenv("K8SFS_CLIENT_CERT"));
 		
+		// Always set WRITEDATA: a reset pooled handle would otherwise point at stdout.
+		curl_easy_setopt(c, CURLOPT_WRITEDATA, httpData);
 		if (httpData)
-			curl_easy_setopt(c, CURLOPT_WRITEDATA, httpData);
+		{
+			httpData->clear();
+			curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+			curl_easy_setopt(c, CURLOPT_HEADERDATA, httpData);
+		}
 
 		if (data != "")
-		{
-			headers = curl_slist_append(headers, "Content-Type: application/json");
-//			headers = curl_slist_append(headers, "Accept: application/json;as=Table;g=meta.k8s.io;v=v1beta1");
-//			headers = curl_slist_append(headers, "Accept: application/json");
 			curl_easy_setopt(c, CURLOPT_POSTFIELDS, data.c_str());
-			#if DEBUG
-			*logs << GREEN << data << RESET << endl;
-			#endif 
-		}
 
 		curl_easy_setopt(c, CURLOPT_URL, url.c_str());
 		curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, request.c_str());
 		curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(c, CURLOPT_TIMEOUT, 1);
+		curl_easy_setopt(c, CURLOPT_TIMEOUT_MS, timeout);
 		curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(c, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_callback);
 
-		curl_easy_perform(c);
+		engine.perform(c);
+		share.count(c, url);
+		encoding.count(c, url, httpData ? httpData->size() : 0);
+
+		curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+		pool.release(backend, c);
+		return code;
+	};
 
-		curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(c);
-		curl_slist_free_all(headers);
+	// Timeout adapts to the endpoint's p99 (1s until it has samples).  GETs
+	// retry with jitter, and an unreachable apiserver fails fast.
+	{
+		BackendLimit::Slot slot(limit, url);
+		httpCode = guard.run(request, url, 1000, attempt);
 	}
+	curl_slist_free_all(headers);
+	metrics.request(request, url, httpCode, start);
 
 	// libCurl has a surprise 0 response code sometimes...
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << RED << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << RESET << endl;
+		logs(Log::ERR) << RED << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << RESET << endl;
 		return httpCode ? httpCode : -2;
 	}
 
@@ -178,11 +306,24 @@ int	k8sCURL(string url, stringstream *httpData = NULL, string request = "GET", c
 // CURL wrapper with JSON
 int	k8sCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	if (k8sCURL(url, &stream, request, post))
+	string body;
+	if (k8sCURL(url, &body, request, post))
+		return -EINVAL;
+
+	if (!HttpBuffer::parseJson(body, jsonData))
+		return -EIO;
+	return 0;
+}
+
+// CURL wrapper for listings.  Keeps just one field from each items[] element.
+int	k8sCURLnames(string url, vector<string> &names, const char *field = "/metadata/name")
+{
+	string body;
+	if (k8sCURL(url, &body))
 		return -EINVAL;
 
-	stream >> jsonData;
+	if (!JsonList::names(body, "/items", field, names))
+		return -EIO;
 	return 0;
 }
 
@@ -199,73 +340,208 @@ string getRESTbase(string fspath)
 	return "/api/v1/namespaces";
 }
 
-// We need to assume quite a few attrs.
-int k8s_getattr(const char *path, struct stat *stat)
+// Same formatting for a list item and a single GET, so the size readdir
+// reports is the size read returns.
+string k8sSerialize(const Json::Value &item)
 {
-	string p(path), key;
-	size_t depth = count(p.begin(), p.end(), '/');
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "    ";
+	return Json::writeString(builder, item) + '\n';
+}
 
-	// Remove optional ".json" suffix we added in readdir
-	size_t suffix = p.find(".json");
-	if (suffix != string::npos)
-		p.erase(suffix, 5);
+// Newest of metadata.creationTimestamp and managedFields[].time, or 0.
+time_t k8sTime(const Json::Value &item)
+{
+	const Json::Value &meta = item["metadata"];
+	const Json::Value &fields = meta["managedFields"];
+	time_t newest = 0;
+	struct tm tm;
+
+	auto stamp = [&](const Json::Value &v)
+	{
+		memset(&tm, 0, sizeof(tm));
+		if (v.isString() && strptime(v.asCString(), "%Y-%m-%dT%H:%M:%SZ", &tm))
+			newest = max(newest, timegm(&tm));
+	};
+
+	stamp(meta["creationTimestamp"]);
+	for (Json::Value::const_iterator it = fields.begin(); it != fields.end(); ++it)
+		stamp((*it)["time"]);
+	return newest;
+}
+
+// One object as file contents.  Usually cached by the listing before it,
+// otherwise fetched on its own.
+int k8sItem(const string &p, ValueCache::Value &value, time_t &mtime)
+{
+	Json::Value item;
+
+	if (values.find(p, value, mtime))
+		return 0;
+
+	// TODO adapt this for different types
+	if (k8sCURLjson(getRESTbase(p) + p, item))
+		return -ENOENT;
+
+	values.put(p, k8sSerialize(item), k8sTime(item), value, mtime);
+	return 0;
+}
 
+// We need to assume quite a few attrs.
+void k8sStat(struct stat *stat, bool dir, size_t size = 0, time_t mtime = 0)
+{
+	memset(stat, 0, sizeof(*stat));
 	stat->st_uid = getuid();
 	stat->st_gid = getgid();
-	stat->st_blocks = 
-	stat->st_blksize = 
-	stat->st_size = 0;
+	stat->st_size = size;
 
-	// Be careful with timestamp - file will always appear modified on disk.
+	// Dirs have no time of their own and will always appear modified.
 	// If using rsync, disable timestamp comparisons.
-	//stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
-	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
+	stat->st_atime = stat->st_mtime = stat->st_ctime = mtime ? mtime : time(NULL);
 
-	// Are we 1 or 2 levels deep?  Just dirs.
-	if (depth <= 2)
+	if (dir)
 		stat->st_mode = S_IFDIR | 0700;	// Need 7 for rsync :/
 	else
 		stat->st_mode = S_IFREG | 0600;
+}
+
+// Only needed for entries readdirplus didn't already fill.
+int k8s_getattr(const char *path, struct stat *stat, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "getattr");
+	string p(path);
+	size_t depth = count(p.begin(), p.end(), '/');
+	ValueCache::Value value;
+	time_t mtime;
+
+	if (Metrics::stat(path, *stat) || Trace::stat(path, *stat))
+		return 0;
+
+	// Are we 1 or 2 levels deep?  Just dirs.
+	if (depth <= 2)
+	{
+		k8sStat(stat, true);
+		return 0;
+	}
+
+	// Is this a placeholder we've created locally?
+	if (createds.find(path) != createds.end())
+	{
+		k8sStat(stat, false);
+		return 0;
+	}
+
+	// Remove optional ".json" suffix we added in readdir
+	size_t suffix = p.find(".json");
+	if (suffix != string::npos)
+		p.erase(suffix, 5);
 
+	if (k8sItem(p, value, mtime))
+		return -ENOENT;
+
+	k8sStat(stat, false, value->size(), mtime);
 	return 0;
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
-int k8s_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Item as read presents it, or empty for a placeholder we've created locally.
+int k8sContent(const char *path, ValueCache::Value &value)
 {
-	string data, p(path);
-	stringstream sstream;
+	string p(path);
+	time_t mtime;
 
-	// Is this a placeholder we've created locally?
 	if (createds.find(path) != createds.end())
+	{
+		value = make_shared<string>();
 		return 0;
+	}
 	
 	// Remove optional ".json" suffix we added in readdir
 	size_t suffix = p.find(".json");
 	if (suffix != string::npos)
 		p.erase(suffix, 5);
 
-	// TODO adapt this for different types
-	if (k8sCURL(getRESTbase(p) + p + "?pretty=true", &sstream))
+	return k8sItem(p, value, mtime) ? -ENOENT : 0;
+}
+
+// Everything stats() knows, for the hidden stats file.
+string k8sStats()
+{
+	return metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ values.stats() + '\n'
+		+ ReadBuffer::stats() + '\n'
+		+ feed.stats() + '\n'
+		+ limit.stats() + '\n'
+		+ guard.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n';
+}
+
+// Snapshot the item for this handle's reads, usually straight out of the
+// cache readdir filled.
+int k8s_open(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "open");
+	ValueCache::Value value;
+
+	// Writes dump the trace, see Common/Trace.h.
+	if (!strcmp(path, Trace::control()))
+		return ((fi->flags & O_ACCMODE) != O_WRONLY) ? -EACCES : 0;
+
+	// Read only, and sized by what's read rather than by getattr.
+	if (!strcmp(path, Metrics::file()))
 	{
-		return -ENOENT;
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) new ReadBuffer(make_shared<string>(k8sStats()));
+		return 0;
 	}
 
-	data = sstream.str();
-	if (data.length() - offset <= 0)
+	if ((fi->flags & O_ACCMODE) == O_WRONLY)
 		return 0;
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+	if (k8sContent(path, value))
+		return -ENOENT;
+
+	fi->fh = (uint64_t) new ReadBuffer(value);
+	return 0;
+}
+
+// Served from the open snapshot, so any offset and size is fine without
+// direct_io.  Big items are spliced from a memfd.
+int k8s_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "read");
+	ValueCache::Value value;
+
+	if (fi && fi->fh)
+		return ReadBuffer::of(fi)->read(bufp, size, offset);
+
+	if (k8sContent(path, value))
+		return -ENOENT;
+
+	return ReadBuffer::read(value, bufp, size, offset);
+}
+
+int k8s_release(const char *path, struct fuse_file_info *fi)
+{
+	delete ReadBuffer::of(fi);
+	fi->fh = 0;
+	return 0;
 }
 
 // Writes are straightforward.  Should verify size < k8s maximum though the API should do that.
 int k8s_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	stringstream sstream;
-	string p(path), rest(getRESTbase(path));
+	Metrics::Timer timer(metrics, "write");
+	if (!strcmp(path, Trace::control()))
+		return Trace::get().dump() ? size : -EIO;
+
+	string body, p(path), rest(getRESTbase(path));
 	int httpCode;
 
 	// Remove optional ".json" suffix we added in readdir
@@ -273,16 +549,18 @@ int k8s_write(const char *path, const char *buf, size_t size, off_t offset, stru
 	if (suffix != string::npos)
 		p.erase(suffix, 5);
 	
-	if ((httpCode = k8sCURL(rest + p, &sstream, "PUT", buf)))
+	if ((httpCode = k8sCURL(rest + p, &body, "PUT", buf)))
 	{
 		// 400 means we'll need to create this.
 		if (httpCode == 400)
 			p = p.substr(0, p.find_last_of('/'));
 		
-		if (k8sCURL(rest + p, &sstream, "POST", buf))
+		if (k8sCURL(rest + p, &body, "POST", buf))
 			return -EINVAL;
 	}
 
+	values.invalidate(p);
+
 	// Remove placeholder if we successfully wrote it to API
 	if (createds.find(path) != createds.end())
 		createds.erase(path);
@@ -290,46 +568,157 @@ int k8s_write(const char *path, const char *buf, size_t size, off_t offset, stru
 	return size;
 }
 
-// List directory contents.
-int k8s_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+// A kind's items from one list GET.  Each goes into the item cache the
+// way read would return it, with its size and time passed to readdirplus,
+// so the kernel needs no getattr or read GET per entry afterwards.
+int k8sReaddirItems(const string &p, void *buf, fuse_fill_dir_t filler)
+{
+	Json::Value list;
+	struct stat st;
+
+	if (k8sCURLjson(getRESTbase(p) + p, list))
+		return -EINVAL;
+
+	// List items leave out their own kind and apiVersion.  Put them back
+	// so an item reads the same as a single GET of it.
+	string kind = list["kind"].asString();
+	if (kind.size() > 4 && !kind.compare(kind.size() - 4, 4, "List"))
+		kind.resize(kind.size() - 4);
+
+	Json::Value &items = list["items"];
+	for (Json::ArrayIndex i = 0; i < items.size(); ++i)
+	{
+		Json::Value &item = items[i];
+		item["kind"] = kind;
+		item["apiVersion"] = list["apiVersion"];
+
+		const string name = item["metadata"]["name"].asString(), data = k8sSerialize(item);
+		const time_t mtime = k8sTime(item);
+
+		values.put(p + '/' + name, data, mtime);
+		k8sStat(&st, false, data.size(), mtime);
+		filler(buf, (name + ".json").c_str(), &st, 0, FUSE_FILL_DIR_PLUS);
+	}
+
+	return 0;
+}
+
+// List directory contents, with full attributes for readdirplus.
+int k8s_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
-	Json::Value result;
+	Metrics::Timer timer(metrics, "readdir");
+	vector<string> names;
 	string p(path), basepath(getRESTbase(path));
 	size_t depth = count(p.begin(), p.end(), '/');
+	struct stat st;
 
-	if (p == "/")
-		p = "";
-	else if (depth == 1)
+	if (p == Metrics::dir())
 	{
-		filler(buf, "pods", NULL, 0);
-		filler(buf, "services", NULL, 0);
-		filler(buf, "deployments", NULL, 0);
-		filler(buf, "daemonsets", NULL, 0);
-		filler(buf, "replicasets", NULL, 0);
-		filler(buf, "cronjobs", NULL, 0);
-		filler(buf, "jobs", NULL, 0);
+		Metrics::stat(Metrics::file(), st);
+		filler(buf, "stats", &st, 0, FUSE_FILL_DIR_PLUS);
+		Trace::stat(Trace::control(), st);
+		filler(buf, "trace", &st, 0, FUSE_FILL_DIR_PLUS);
 		return 0;
 	}
 
-	if (k8sCURLjson(basepath + p, result))
-		return -EINVAL;
-	
-	// TODO better check for errors before this.
-	result = result["items"];
-	for (Json::Value::const_iterator itr = result.begin() ; itr != result.end() ; itr++ )
+	if (p == "/")
 	{
-		string name = (*itr)["metadata"]["name"].asString();
-		if (depth > 1)
-			name += ".json";
-
-		filler(buf, name.c_str(), NULL, 0);
+		if (k8sCURLnames(basepath, names))
+			return -EINVAL;
 	}
+	else if (depth == 1)
+		names = {"pods", "services", "deployments", "daemonsets", "replicasets", "cronjobs", "jobs"};
+	else
+		return k8sReaddirItems(p, buf, filler);
+
+	// Namespaces and kinds are plain dirs.
+	k8sStat(&st, true);
+	for (vector<string>::iterator name = names.begin(); name != names.end(); ++name)
+		filler(buf, name->c_str(), &st, 0, FUSE_FILL_DIR_PLUS);
 
 	return 0;
 }
 
+// One watch request on a kind across all namespaces, resuming from
+// version, the last resourceVersion seen.  Every event drops that object
+// from our caches and the kernel's, and an add or delete its kind's dir
+// too.  The apiserver ends the watch after timeoutSeconds and we pick up
+// from version.  If version is too old (410 Gone) we start over: the new
+// watch opens with an ADDED for every object, which invalidates them all.
+bool k8sWatch(const string &kind, string &version)
+{
+	string addr = getenv("KUBE_APISERVER") ? getenv("KUBE_APISERVER") : "http://localhost:8080", sock;
+	string base = getRESTbase("/-/" + kind);
+	struct curl_slist *headers = NULL;
+	bool expired = false;
+	CURL *curl;
+
+	// Watch the kind everywhere, not per namespace.
+	base.erase(base.rfind("/namespaces"));
+	UnixSocket::split(addr, sock);
+	const string url = addr + base + '/' + kind + "?watch=1&allowWatchBookmarks=true&timeoutSeconds=300"
+		+ (version.empty() ? "" : "&resourceVersion=" + version);
+
+	if (!(curl = curl_easy_init()))
+		return false;
+	if (getenv("KUBE_TOKEN"))
+		headers = curl_slist_append(headers, ((string)"Authorization: Bearer " + getenv("KUBE_TOKEN")).c_str());
+	if (getenv("K8SFS_CA_PEM"))
+		curl_easy_setopt(curl, CURLOPT_CAINFO, getenv("K8SFS_CA_PEM"));
+	if (getenv("K8SFS_CLIENT_CERT"))
+		curl_easy_setopt(curl, CURLOPT_SSLCERT, getenv("K8SFS_CLIENT_CERT"));
+	UnixSocket::apply(curl, sock);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+	// One event per line.
+	const long code = feed.perform(curl, [&](const string &line)
+	{
+		Json::Value event;
+		unsigned long notified = 0;
+
+		if (!HttpBuffer::parseJson(line, event))
+			return;
+
+		const string type = event["type"].asString();
+		const Json::Value &meta = event["object"]["metadata"];
+		if (type == "ERROR")
+		{
+			expired = (event["object"]["code"].asInt() == 410);
+			return;
+		}
+
+		version = meta["resourceVersion"].asString();
+		if (type == "BOOKMARK")
+			return;
+
+		const string dir = '/' + meta["namespace"].asString() + '/' + kind, path = dir + '/' + meta["name"].asString();
+		values.invalidate(path);
+		notified += !fuse_invalidate_path(fs, (path + ".json").c_str());
+		if (type != "MODIFIED")
+			notified += !fuse_invalidate_path(fs, dir.c_str());
+		feed.changed(notified);
+	});
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(headers);
+
+	if (expired)
+	{
+		version.clear();
+		return true;
+	}
+
+	if (code != 200)
+	{
+		if (!feed.stopped())
+			logs(Log::ERR) << RED << "K8s watch on " << kind << " failed HTTP" << code << RESET << endl;
+		return false;
+	}
+	return true;
+}
+
 // Need to implement this for truncate/write even though we do nothing.
-int k8s_truncate(const char *path, off_t newsize)
+int k8s_truncate(const char *path, off_t newsize, struct fuse_file_info *fi)
 {
 	return 0;
 }
@@ -342,19 +731,26 @@ int k8s_mkdir(const char *path, mode_t mode)
 
 int k8s_unlink(const char *path)
 {
-	stringstream stream;
-	string rpath = getRESTbase(path) + path;
+	Metrics::Timer timer(metrics, "unlink");
+	string body, p(path);
+
+	// Remove optional ".json" suffix we added in readdir
+	size_t suffix = p.find(".json");
+	if (suffix != string::npos)
+		p.erase(suffix, 5);
 
 	// Need to include any string in data to specify JSON
-	switch (k8sCURL(rpath, &stream, "DELETE", "{}"))
+	switch (k8sCURL(getRESTbase(p) + p, &body, "DELETE", "{}"))
 	{
 		case 404:	return -ENOENT;
 		case 403:	return -EPERM;
 	}
+
+	values.invalidate(p);
 	return 0;
 }
 
-int k8s_chmod(const char *path, mode_t mode)
+int k8s_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	return 0;
 }
@@ -378,23 +774,48 @@ int k8s_statfs(const char *path, struct statvfs *statv)
 }
 
 // Init curl subsystem and set up log stream.
-void* k8s_init(struct fuse_conn_info *conn)
+void* k8s_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	Resilience::route() = k8sRoute;
 
 	// Default to cout, which is ignored without -d or -f arg.
-	if (getenv("KUBEFS_LOG"))
+	if (getenv("KUBEFS_LOG") && !logs.open(getenv("KUBEFS_LOG")))
 	{
-		if (!(logs = new ofstream(getenv("KUBEFS_LOG"), ofstream::out)))
-		{
-			cerr << RED << "Unable to open log output file for writing: " << getenv("K8SFS_LOG") << endl;
-			cerr << "Will revert back to std::cout" << RESET << endl;
-			logs = &cout;
-		}
+		cerr << RED << "Unable to open log output file for writing: " << getenv("KUBEFS_LOG") << endl;
+		cerr << "Will revert back to std::cout" << RESET << endl;
+	}
+	logs.start();
+
+	// Big writes are always on in FUSE3.  Use readdirplus for every
+	// readdir, not just the first, so ls -l never falls back to getattrs.
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+
+	// Let libfuse splice big items from their memfds into /dev/fuse.
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+	*logs << policy.stats() << endl;
+	*logs << "fuse transport " << (uring ? "io_uring" : "/dev/fuse") << endl;
+
+	// Threads have to start after FUSE daemonizes.
+	if (!engine.start())
+		logs(Log::ERR) << RED << "Unable to start curl_multi engine, falling back to blocking transfers." << RESET << endl;
+
+	fs = fuse_get_context()->fuse;
+	vector<string> kinds = watchKinds();
+	for (vector<string>::iterator kind = kinds.begin(); kind != kinds.end(); ++kind)
+	{
+		shared_ptr<string> version = make_shared<string>();
+		const string k = *kind;
+		feed.watch(k, [k, version] { return k8sWatch(k, *version); });
 	}
+	feed.start();
 
-	// Always big writes... 4k may not be enough.
-	conn->want |= FUSE_CAP_BIG_WRITES;
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
 
 	return NULL;
 }
@@ -402,9 +823,42 @@ void* k8s_init(struct fuse_conn_info *conn)
 // Free up curl resources.
 void k8s_destroy(void* private_data)
 {
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	feed.stop();
+	*logs << feed.stats() << endl;
+	engine.stop();
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << guard.stats() << endl;
+	*logs << values.stats() << endl;
+	*logs << ReadBuffer::stats() << endl;
+	*logs << limit.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
+	share.cleanup();
 	curl_global_cleanup();
 }
 
+// Live counters on the mount root, see Common/StatsXattr.h.  libfuse3's
+// fuse_main takes -o max_threads=N,max_idle_threads=N itself.
+int k8s_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!StatsXattr::matches(path, name))
+		return -ENODATA;
+	return StatsXattr::value(limit.stats() + '\n' + feed.stats() + '\n', value, size);
+}
+
+int k8s_listxattr(const char *path, char *list, size_t size)
+{
+	return StatsXattr::list(path, list, size);
+}
+
 // Create must add a placeholder so we can get gettatr and read (0).
 int k8s_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
@@ -451,14 +905,23 @@ int main(int argc, char *argv[])
 		.unlink = k8s_unlink,
 		.chmod = k8s_chmod,
 		.truncate = k8s_truncate,
-		.read = k8s_read,
+		.open = k8s_open,
 		.write = k8s_write,
 		.statfs = k8s_statfs,
+		.release = k8s_release,
+		.getxattr = k8s_getxattr,
+		.listxattr = k8s_listxattr,
 		.readdir = k8s_readdir,
 		.init = k8s_init,
 		.destroy = k8s_destroy,
-		.create = k8s_create
+		.create = k8s_create,
+		.read_buf = k8s_read_buf,
 	};
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	if ((uring = FuseUring::prepare(&args)) < 0 || limit.parse(&args) == -1)
+		return 1;
 
 	if ((getuid() == 0) || (geteuid() == 0))
 		cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << endl;
@@ -470,5 +933,7 @@ int main(int argc, char *argv[])
 		pthread_detach(renewer);
 	}
 
-	return fuse_main(argc, argv, &fuse, NULL);
+	res = fuse_main(args.argc, args.argv, &fuse, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
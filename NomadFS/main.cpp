@@ -4,13 +4,21 @@
 **
 ** Authored by John Boero
 ** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./nomadfs -o direct_io /path/to/mount
+** Usage: ./nomadfs /path/to/mount
 **
-** Note direct_io is mandatory right now until we can get key size in getattrs.
+** getattr fetches jobs (cached briefly) to report real sizes, so direct_io
+** is no longer needed and the kernel page cache works.
+** Jobs are cached until their JobModifyIndex in /v1/jobs moves, checked at
+** most once a second, rather than refetched every few seconds.  With
+** NOMADFS_WATCH the event stream drops changed jobs instead, and the index
+** is only polled while the stream is down.  libfuse2 can't invalidate the
+** kernel's cache, so that still expires on its own (attr_timeout).
 ** Environment Variables: 
-	NOMAD_ADDR			nomad addr.  Example: "https://localhost:4646"
+	NOMAD_ADDR			nomad addr.  Example: "https://localhost:4646" or "unix:///run/nomad.sock"
 	NOMAD_TOKEN			optional nomad token for auth.
 	NOMADFS_LOG			optional log file path.
+	NOMADFS_CACHE_POLICY	optional rules ahead of the defaults below.  See Common/CachePolicy.h.
+	NOMADFS_WATCH		optional "true" to follow Job events from /v1/event/stream.
 ****************************************************************************/
 
 #define FUSE_USE_VERSION 28
@@ -28,23 +36,86 @@
 #include <fstream>
 #include <mutex>
 #include <set>
+#include <map>
 
 #include "StdColors.h"
 #include <fuse.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/Resilience.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/FusePool.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
+#include "../Common/UnixSocket.h"
+#include "../Common/CachePolicy.h"
+#include "../Common/ValueCache.h"
+#include "../Common/ReadBuffer.h"
+#include "../Common/WriteBack.h"
+#include "../Common/SingleFlight.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/JsonList.h"
+#include "../Common/ChangeFeed.h"
 
 using namespace std;
 
 // Global api version is static.
 const string apiVers = "/v1";
 
-// Set logs to other options via nomadFS_LOG or default to std::cout
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  To NOMADFS_LOG if set, else cout.
+Log logs;
 
 // Keep a set of files (jobs) we've created.  Sadly there's no placeholder or null job.
 set<string> createds;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Keep-alive handles so each op doesn't pay a fresh connect.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Adaptive timeouts, retries and a circuit breaker per backend.
+Resilience guard;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// FUSE worker threads (-o max_threads=N,max_idle_threads=N).
+FusePool workers;
+
+// Identical GETs in flight at the same time share one request.
+SingleFlight<string> flights;
+
+// Jobs stay cached until their modify index moves.
+CachePolicy policy("NOMADFS_CACHE_POLICY", "/job/*=index");
+
+// Jobs fetched by getattr for st_size, reused by read.
+ValueCache values(&policy);
+
+// Writes staged per handle until flush submits the job in one go.
+WriteBack pending;
+
+// JobModifyIndex per job ID as of the last /v1/jobs listing.
+map<string, uint64_t> jobIndexes;
+time_t jobIndexesChecked = 0;
+mutex indexLock;
+
+// Job events with NOMADFS_WATCH, and the last event index seen.
+ChangeFeed feed;
+uint64_t eventIndex = 0;
+
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
+
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
 
 // CURL callback
 namespace
@@ -55,12 +126,9 @@ namespace
             std::size_t num,
             char* out)
     {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << GREEN).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -83,65 +151,108 @@ int clientOut(string output, short stream = 1)
 		return 1;
 }
 
+// Route template for timeouts and metrics: /v1/job/* for every job, with
+// any sub resource kept.
+string nomadRoute(const string &path)
+{
+	static const string job = "/v1/job/";
+
+	if (path.compare(0, job.size(), job))
+		return path;
+
+	const size_t end = path.find('/', job.size());
+	return job + '*' + (end == string::npos ? "" : path.substr(end));
+}
+
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
 // TODO: sanitize environment variables for injection vulnerabilities.
-// TODO: change stringstream reference to ptr as we don't always need it.
-int	nomadCURL(string url, stringstream &httpData, string request = "GET", const string data = "")
+// TODO: change string reference to ptr as we don't always need it.
+int	nomadCURL(string url, string &httpData, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
-	const char *addr = getenv("NOMAD_ADDR");
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
+	long httpCode = 0;
+	string addr = getenv("NOMAD_ADDR") ? getenv("NOMAD_ADDR") : "http://localhost:4646", sock;
 	static const string tokenHead = "X-Nomad-Token: ";
 	struct curl_slist *headers = NULL;
-	CURL* curl;
 
-	if (addr)
-		url = (string)addr + url;	// + dc;
-	else
-		url = (string)"http://localhost:4646" + url;
+	UnixSocket::split(addr, sock);
+	url = addr + url;	// + dc;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
 	
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	logs(Log::DBG) << CYAN << url << RESET << endl;
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock here.
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case.
+	// Beware error handling (lack).
+	if (getenv("NOMAD_TOKEN"))
+		headers = curl_slist_append(headers, (tokenHead + getenv("NOMAD_TOKEN")).c_str());
+
+	auto attempt = [&](string &body, long timeout) -> long
 	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(curl = curl_easy_init()))
+		long code = 0;
+		CURL* curl;
+
+		// No global lock: the handle is this thread's until it's released, and
+		// CurlShare locks what's shared, so only BackendLimit caps requests.
+		if (!(curl = pool.acquire(backend)))
 			return -1;
-		
-		// Beware error handling (lack).
-		if (getenv("NOMAD_TOKEN"))
-			headers = curl_slist_append(headers, (tokenHead + getenv("NOMAD_TOKEN")).c_str());
+		share.attach(curl);
+		encoding.prepare(curl);
+		UnixSocket::apply(curl, sock);
 		
 		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str());
 		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &body);
 
 		if (data != "")
 		{
-			#if DEBUG
-			*logs << YELLOW << data << RESET << endl;
-			#endif 
+			logs(Log::DBG) << YELLOW << data << RESET << endl;
 			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
 		}
 		
+		const size_t before = body.size();
+		Trace::Span perform("http", "curl perform");
 		curl_easy_perform(curl);
+		perform.end();
+		share.count(curl, url);
+		encoding.count(curl, url, body.size() - before);
 
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
-	}
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		pool.release(backend, curl);
+		return code;
+	};
+
+	// Timeout adapts to the endpoint's p99 (1s until it has samples).  GETs
+	// and LISTs retry with jitter, and a down backend fails fast.
+	auto transfer = [&](string &body) -> long
+	{
+		BackendLimit::Slot slot(limit, url);
+		return guard.run(request, url, 1000, [&](long timeout) -> long
+		{
+			body.clear();
+			return attempt(body, timeout);
+		});
+	};
+
+	// Concurrent getattrs on the same job wait on one GET.
+	if (request == "GET" && data == "")
+		httpCode = flights.run(SingleFlight<string>::key(request, url, headers), httpData, transfer);
+	else
+		httpCode = transfer(httpData);
+
+	curl_slist_free_all(headers);
+	metrics.request(request, url, httpCode, start);
 
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
+		logs(Log::ERR) << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
 		return httpCode;
 	}
 
@@ -151,21 +262,145 @@ int	nomadCURL(string url, stringstream &httpData, string request = "GET", const
 // CURL wrapper with JSON
 int	nomadCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	if (nomadCURL(url, stream, request, post))
+	string body;
+	if (nomadCURL(url, body, request, post))
 		return -EINVAL;
 
-	stream >> jsonData;
+	if (!HttpBuffer::parseJson(body, jsonData))
+		return -EIO;
+	return 0;
+}
+
+// CURL wrapper for listings.  Keeps just one field from each element.
+int	nomadCURLnames(string url, vector<string> &names, const char *field = "/ID")
+{
+	string body;
+	if (nomadCURL(url, body))
+		return -EINVAL;
+
+	if (!JsonList::names(body, "", field, names))
+		return -EIO;
+	return 0;
+}
+
+// List job IDs, dropping cached jobs whose JobModifyIndex moved or that
+// are gone.  One cheap listing replaces refetching every job on a timer.
+int nomadJobs(vector<string> &ids)
+{
+	Json::Value jobs;
+	map<string, uint64_t> indexes;
+
+	if (nomadCURLjson(apiVers + "/jobs", jobs))
+		return -ENOENT;
+
+	for (Json::Value::const_iterator job = jobs.begin(); job != jobs.end(); ++job)
+	{
+		const string id = (*job)["ID"].asString();
+		ids.push_back(id);
+		indexes[id] = (*job)["JobModifyIndex"].asUInt64();
+	}
+
+	lock_guard<mutex> lk(indexLock);
+	for (map<string, uint64_t>::iterator old = jobIndexes.begin(); old != jobIndexes.end(); ++old)
+	{
+		map<string, uint64_t>::iterator now = indexes.find(old->first);
+		if (now == indexes.end() || now->second != old->second)
+			values.invalidate("/job/" + old->first + ".json");
+	}
+
+	jobIndexes.swap(indexes);
+	jobIndexesChecked = time(NULL);
 	return 0;
 }
 
+// Refresh modify indexes if the last listing is over a second old.
+void nomadIndexCheck()
+{
+	vector<string> ids;
+	{
+		lock_guard<mutex> lk(indexLock);
+		if (time(NULL) - jobIndexesChecked < 1)
+			return;
+		jobIndexesChecked = time(NULL);
+	}
+
+	nomadJobs(ids);
+}
+
+// One event stream request for the Job topic, resuming after the last
+// index seen.  Each event drops its job from the value cache.  Nomad
+// sends {} heartbeats, so a quiet stream stays connected.
+bool nomadWatch()
+{
+	string addr = getenv("NOMAD_ADDR") ? getenv("NOMAD_ADDR") : "http://localhost:4646", sock;
+	struct curl_slist *headers = NULL;
+	CURL *curl;
+
+	UnixSocket::split(addr, sock);
+	const string url = addr + apiVers + "/event/stream?topic=Job"
+		+ (eventIndex ? "&index=" + to_string(eventIndex + 1) : "");
+
+	if (!(curl = curl_easy_init()))
+		return false;
+	if (getenv("NOMAD_TOKEN"))
+		headers = curl_slist_append(headers, ((string)"X-Nomad-Token: " + getenv("NOMAD_TOKEN")).c_str());
+	UnixSocket::apply(curl, sock);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+	// {"Index":N,"Events":[{"Topic":"Job","Key":"<job id>",...}]} per line.
+	const long code = feed.perform(curl, [&](const string &line)
+	{
+		Json::Value batch;
+
+		if (!HttpBuffer::parseJson(line, batch) || !batch.isMember("Events"))
+			return;
+
+		const Json::Value &events = batch["Events"];
+		for (Json::Value::const_iterator event = events.begin(); event != events.end(); ++event)
+			values.invalidate("/job/" + (*event)["Key"].asString() + ".json");
+
+		eventIndex = batch["Index"].asUInt64();
+		feed.changed(events.size());
+	});
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(headers);
+
+	if (code != 200)
+	{
+		if (!feed.stopped())
+			logs(Log::ERR) << RED << "Nomad event stream failed HTTP" << code << RESET << endl;
+		return false;
+	}
+	return true;
+}
+
+// Pretty job JSON via the value cache, as read() presents it.
+int nomadValue(const char *path, ValueCache::Value &job, time_t &mtime)
+{
+	// Chop off pseudo ".json" we added.
+	string p(path);
+	p = p.substr(0, p.length() - 5);
+
+	// Jobs cached by index are only as fresh as the last index check, or
+	// the event stream if that's up.
+	if (policy.ttl(path, 0) == CachePolicy::INDEX && !feed.live())
+		nomadIndexCheck();
+
+	return values.get(path, job, mtime, [&](string &raw)
+	{
+		return nomadCURL(apiVers + p + "?pretty", raw) ? -ENOENT : 0;
+	});
+}
+
 // We need to assume quite a few attrs.
 // Use key trailing slash to identify dir/file.
 int nomad_getattr(const char *path, struct stat *stat)
 {
+	Metrics::Timer timer(metrics, "getattr");
 	string p(path), key;
-	Json::Value keys;
-	stringstream sstream;
+	ValueCache::Value job;
+	time_t mtime;
 
 	stat->st_uid = getuid();
 	stat->st_gid = getgid();
@@ -177,6 +412,9 @@ int nomad_getattr(const char *path, struct stat *stat)
 	// If using rsync, disable timestamp comparisons.
 	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
 
+	if (Metrics::stat(path, *stat) || Trace::stat(path, *stat))
+		return 0;
+
 	// For now we just support jobs endpoint.
 	if (p == "/" || p == "/job")
 	{
@@ -191,64 +429,160 @@ int nomad_getattr(const char *path, struct stat *stat)
 		return 0;
 
 	// Else check if we're in Nomad already.
-	// Chop off ".json" and check if we're 404.  Otherwise we're a file with 600 perms.
-	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p.substr(), sstream))
+	// 404 means no such job.  Otherwise we're a file with 600 perms, and
+	// the job we just fetched gives us our real size.
+	if (nomadValue(path, job, mtime))
 		return -ENOENT;
 
+	stat->st_size = job->size();
+	stat->st_mtime = stat->st_ctime = mtime;
 	return 0;
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
-int nomad_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Everything stats() knows, for the hidden stats file.
+string nomadStats()
+{
+	return metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ values.stats() + '\n'
+		+ ReadBuffer::stats() + '\n'
+		+ pending.stats() + '\n'
+		+ flights.stats() + '\n'
+		+ feed.stats() + '\n'
+		+ limit.stats() + '\n'
+		+ guard.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n'
+		+ workers.stats() + '\n';
+}
+
+// Snapshot the job getattr just fetched for this handle's reads.  Tell the
+// kernel it can keep its cached pages if the job hasn't changed.  Writers
+// get a handle too, starting from the same job unless they truncate.
+int nomad_open(const char *path, struct fuse_file_info *fi)
 {
-	string data, p(path);
-	stringstream stream;
+	Metrics::Timer timer(metrics, "open");
+	ValueCache::Value job;
+	time_t mtime;
 
-	// If we're a new file - just read 0.
-	if (createds.find(path) != createds.end())
+	// Writes dump the trace, see Common/Trace.h.
+	if (!strcmp(path, Trace::control()))
+		return ((fi->flags & O_ACCMODE) != O_WRONLY) ? -EACCES : 0;
+
+	// Read only, and sized by what's read rather than by getattr.
+	if (!strcmp(path, Metrics::file()))
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) new ReadBuffer(make_shared<string>(nomadStats()));
 		return 0;
-	
-	// Chop off pseudo ".json" we added.
-	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p.substr() + "?pretty", stream))
+	}
+
+	// New files and truncating writers have nothing to read, and a writer
+	// that can't get the job starts from nothing rather than failing.
+	if (!(fi->flags & O_TRUNC) && createds.find(path) == createds.end())
 	{
-		clientOut(stream.str(), 2);
-		return -EINVAL;
+		if (!nomadValue(path, job, mtime))
+			fi->keep_cache = values.keep(path);
+		else if ((fi->flags & O_ACCMODE) == O_RDONLY)
+			return -ENOENT;
 	}
 
-	data = stream.str();
-	if (data.length() - offset <= 0)
-		return 0;
+	fi->fh = (uint64_t) new ReadBuffer(job);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		pending.open(fi->fh, job, fi->flags & O_TRUNC);
+	return 0;
+}
+
+// Reads at any offset come out of the open snapshot, spliced if it's big.
+int nomad_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "read");
+	ValueCache::Value job;
+	time_t mtime;
+
+	if (fi && fi->fh)
+		return ReadBuffer::of(fi)->read(bufp, size, offset);
+
+	// If we're a new file - just read 0.
+	if (createds.find(path) != createds.end())
+		job = make_shared<string>();
+	else if (nomadValue(path, job, mtime))
+		return -EINVAL;
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+	return ReadBuffer::read(job, bufp, size, offset);
 }
 
-// Writes are straightforward.  Should verify size < nomad maximum though the API should do that.
-int nomad_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Submit the whole job.  Should verify size < nomad maximum though the API should do that.
+int nomadSubmit(const char *path, const string &job)
 {
-	stringstream stream;
-	char *tmp = new char[size + 1];
+	string body, jobspec;
 
-	// Ugly and shameful but it's const and I'm mixing languages.
-	memcpy(tmp, buf, size);
-	string jobspec = (string) "{\"Job\":" + tmp + "}";
-	delete [] tmp;
+	jobspec.reserve(job.size() + 9);
+	jobspec.append("{\"Job\":").append(job).append("}");
 
-	if (nomadCURL(apiVers + "/jobs", stream, "POST", jobspec.c_str()))
+	if (nomadCURL(apiVers + "/jobs", body, "POST", jobspec))
 	{
-		clientOut(stream.str(), 2);
+		clientOut(body, 2);
 		return -EINVAL;
 	}
 
 	if (createds.find(path) != createds.end())
 		createds.erase(path);
 	
-	clientOut(stream.str());
-	return size;
+	clientOut(body);
+	values.invalidate(path);
+	return 0;
+}
+
+// Submit whatever was written through the handle since the last commit as
+// one job.  0 if there was nothing to write.
+int nomadCommit(const char *path, struct fuse_file_info *fi)
+{
+	WriteBack::Value job;
+	int res;
+
+	if (!fi || !pending.take(fi->fh, job))
+		return 0;
+	if ((res = nomadSubmit(path, *job)))
+		return res;
+
+	// Keep reads on this handle consistent with what we just wrote.
+	ReadBuffer::of(fi)->reset(job);
+	return 0;
+}
+
+// Every close() of the file, so a rejected job shows up as close() failing.
+int nomad_flush(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "flush");
+	return nomadCommit(path, fi);
+}
+
+// Normally flush already committed.  Nobody to tell if this one fails.
+int nomad_release(const char *path, struct fuse_file_info *fi)
+{
+	if (nomadCommit(path, fi))
+		logs(Log::ERR) << RED << "Write on release failed for " << path << RESET << endl;
+
+	pending.close(fi->fh);
+	delete ReadBuffer::of(fi);
+	fi->fh = 0;
+	return 0;
+}
+
+// Stage the chunk at its offset.  The kernel splits big writes into many of
+// these, which used to be submitted as a job each.
+int nomad_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "write");
+	if (!strcmp(path, Trace::control()))
+		return Trace::get().dump() ? size : -EIO;
+	return pending.write(fi->fh, buf, size, offset);
 }
 
 // Return stat of root fs (partition).
@@ -271,9 +605,9 @@ int nomad_statfs(const char *path, struct statvfs *statv)
 // List directory contents.  Currently only /job
 int nomad_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
-	Json::Value jobs;
+	Metrics::Timer timer(metrics, "readdir");
+	vector<string> jobs;
 	string p(path), f;
-	set<string> names;
 
 	if (p == "/")
 	{
@@ -281,51 +615,81 @@ int nomad_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 		return 0;
 	}
 
+	if (p == Metrics::dir())
+	{
+		filler(buf, "stats", NULL, 0);
+		filler(buf, "trace", NULL, 0);
+		return 0;
+	}
+
 	// Ugly API ambiguity /job /jobs
-	if (p == "/job" && nomadCURLjson(apiVers + "/jobs", jobs))
+	if (p == "/job" && nomadJobs(jobs))
 		return -ENOENT;
 
-	for (Json::Value::const_iterator itr = jobs.begin() ; itr != jobs.end() ; itr++ )
-	{
-		string jobname = (*itr)["ID"].asString();
-		filler(buf, (jobname + ".json").c_str(), NULL, 0);
-	}
+	for (vector<string>::iterator job = jobs.begin(); job != jobs.end(); ++job)
+		filler(buf, (*job + ".json").c_str(), NULL, 0);
 
 	return 0;
 }
 
+// Live counters on the mount root, see Common/StatsXattr.h.
+int nomad_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!StatsXattr::matches(path, name))
+		return -ENODATA;
+	return StatsXattr::value(workers.stats() + '\n' + limit.stats() + '\n' + feed.stats() + '\n', value, size);
+}
+
+int nomad_listxattr(const char *path, char *list, size_t size)
+{
+	return StatsXattr::list(path, list, size);
+}
+
 // Need to implement this for truncate/write even though we do nothing.
 int nomad_truncate(const char *path, off_t newsize)
 {
 	return 0;
 }
 
+// Truncating an open handle changes what its flush submits.
+int nomad_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+	const int res = (fi && fi->fh) ? pending.truncate(fi->fh, newsize) : 0;
+
+	// Not a writer's handle, nothing to change.
+	return (res == -EBADF) ? 0 : res;
+}
+
 // Write a blank key
 int nomad_mkdir(const char *path, mode_t mode)
 {
-	return nomad_write(((string)path + '/').c_str(), "", 0, 0, NULL);
+	return nomadSubmit(((string)path + '/').c_str(), "");
 }
 
 // Ignore any problems here but don't dare return failure. 🇺🇸
 int nomad_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+	Metrics::Timer timer(metrics, "create");
 	// Use a local placeholder.
 	// Nomad doesn't have a null/create job as such
 	// But if we create a file, we need to not return -ENOENT on write.
 	createds.insert(path);
+	fi->fh = (uint64_t) new ReadBuffer(make_shared<string>());
+	pending.open(fi->fh, NULL);
 	return 0;
 }
 
 // Nomad uses a GC for dead jobs but we can delete with purge.
 int nomad_unlink(const char *path)
 {
-	stringstream stream;
-	string p(path);
+	Metrics::Timer timer(metrics, "unlink");
+	string body, p(path);
 
 	// Remove the ".json" exention we added.
 	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p + "?purge=true", stream, "DELETE"))
+	if (nomadCURL(apiVers + p + "?purge=true", body, "DELETE"))
 		return -EINVAL;
+	values.invalidate(path);
 	return 0;
 }
 
@@ -338,18 +702,17 @@ int nomad_chmod(const char *path, mode_t mode)
 void* nomad_init(struct fuse_conn_info *conn)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	Resilience::route() = nomadRoute;
 
 	// Set nomadFS_LOGS env var to log destination if necessary.
 	// Default to cout, which is ignored without -d or -f arg.
-	if (getenv("NOMADFS_LOG"))
+	if (getenv("NOMADFS_LOG") && !logs.open(getenv("NOMADFS_LOG")))
 	{
-		if (!(logs = new ofstream(getenv("NOMADFS_LOG"), ofstream::out)))
-		{
-			cerr << RED << "Unable to open log output file for writing: " << getenv("NOMADFS_LOG") << endl;
-			cerr << "Will revert back to std::cout" << RESET << endl;
-			logs = &cout;
-		}
+		cerr << RED << "Unable to open log output file for writing: " << getenv("NOMADFS_LOG") << endl;
+		cerr << "Will revert back to std::cout" << RESET << endl;
 	}
+	logs.start();
 
 	// Set dc global if we need to.
 	//if (getenv("nomadFS_DC"))
@@ -358,12 +721,52 @@ void* nomad_init(struct fuse_conn_info *conn)
 	// Always big writes... 4k may not be enough.
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	// Let libfuse splice big jobs from their memfds into /dev/fuse.
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+	// O_TRUNC with open, so WriteBack doesn't see a separate truncate.
+	conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+	*logs << policy.stats() << endl;
+
+	// Threads have to start after FUSE daemonizes.
+	if (getenv("NOMADFS_WATCH") && !strcmp(getenv("NOMADFS_WATCH"), "true"))
+	{
+		feed.watch("event stream", nomadWatch);
+		feed.start();
+	}
+
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
 	return NULL;
 }
 
 // Free up curl resources.
 void nomad_destroy(void* private_data)
 {
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	feed.stop();
+	*logs << feed.stats() << endl;
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << guard.stats() << endl;
+	*logs << values.stats() << endl;
+	*logs << ReadBuffer::stats() << endl;
+	*logs << pending.stats() << endl;
+	*logs << limit.stats() << endl;
+	*logs << workers.stats() << endl;
+	share.cleanup();
+	*logs << flights.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
 	curl_global_cleanup();
 }
 
@@ -377,17 +780,29 @@ int main(int argc, char *argv[])
 		.unlink = nomad_unlink,
 		.chmod = nomad_chmod,
 		.truncate = nomad_truncate,
-		.read = nomad_read,
+		.open = nomad_open,
 		.write = nomad_write,
 		.statfs = nomad_statfs,
+		.flush = nomad_flush,
+		.release = nomad_release,
+		.getxattr = nomad_getxattr,
+		.listxattr = nomad_listxattr,
 		.readdir = nomad_readdir,
 		.init = nomad_init,
 		.destroy = nomad_destroy,
 		.create = nomad_create,
+		.ftruncate = nomad_ftruncate,
+		.read_buf = nomad_read_buf,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
 		cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << endl;
 	
-	return fuse_main(argc, argv, &fuse, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res = 1;
+
+	if (limit.parse(&args) != -1)
+		res = workers.run(&args, &fuse, sizeof(fuse));
+	fuse_opt_free_args(&args);
+	return res;
 }
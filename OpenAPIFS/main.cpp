@@ -4,9 +4,9 @@
 **
 ** Authored by John Boero
 ** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: openapifs -s -o direct_io /path/to/mount
+** Usage: openapifs -o direct_io /path/to/mount
 **
-** Note single threaded mode is required (-s)
+** Multithreaded, see Common/FusePool.h for -o max_threads and friends.
 ** Note direct_io is required (-o direct_io)
 ** Environment Variables: 
 	API_ADDR			Base api address.
@@ -46,6 +46,17 @@
 #include <sys/xattr.h>
 #include <stdarg.h>
 #include <fuse.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/FusePool.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -61,13 +72,34 @@ using namespace std;
 // Ugly globals as we don't get full process control.
 // Cache the OpenAPI spec
 Json::Value schema;
+
+// Ops only look through this, so concurrent workers never insert members.
+const Json::Value &spec = schema;
 string apiaddr;
 
-// Enable log options.
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  Goes to cout.
+Log logs;
+
+// Keep-alive handles so each op doesn't pay a fresh connect.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// FUSE worker threads (-o max_threads=N,max_idle_threads=N).
+FusePool workers;
+
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
 
 // Global cache locally since libCurl doesn't support it.
 map<string, string> cache;
@@ -83,12 +115,9 @@ namespace
             std::size_t num,
             char* out)
     {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << GREEN).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -122,7 +151,7 @@ void clientHeaders(struct curl_slist **headers)
 		{
 			line = line.substr(2);
 			replace(line.begin(), line.end(), '=', ':');
-			cout << line << endl;
+			logs(Log::DBG) << line << endl;
 			*headers = curl_slist_append(*headers, line.c_str());
 		}
 	}
@@ -131,65 +160,74 @@ void clientHeaders(struct curl_slist **headers)
 // GET raw via libcurl
 // Currently supports request GET (default), POST, LIST.
 // TODO: escape environment variables for injection vulnerabilities.
-int	apiCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
+int	apiCURL(string url, string &httpData, string request = "GET", const string post = "")
 {
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
 	int res = 0, httpCode = 0;
 	struct curl_slist *headers = curl_slist_append(NULL, getenv("API_TOKEN"));
 	CURL* curl;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
 
 	clientHeaders(&headers);
 
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	logs(Log::DBG) << CYAN << url << RESET << endl;
 
+	// No global lock: the handle is ours until it's released, and CurlShare
+	// locks what's shared, so only the slot caps requests to the backend.
 	{
-		lock_guard<mutex> lk(curlmutex);
-	
-		if (!(curl = curl_easy_init()))
-			return -1;
-		
-		if ((res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str())))
-			return res;
+		BackendLimit::Slot slot(limit, url);
 
-		if ((res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str())))
-			return res;
-
-		if (request == "POST" && post != "")
+		if (!(curl = pool.acquire(backend)))
 		{
-			if ((res = curl_easy_setopt(curl, CURLOPT_POST, 1)))
-				return res;
-
-			if ((res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str())))
-				return res;
-	 	}
+			curl_slist_free_all(headers);
+			return -1;
+		}
+		share.attach(curl);
+		encoding.prepare(curl);
 		
-		if ((res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers)))
+		if ((res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
+		||	(request == "POST" && post != ""
+			&& ((res = curl_easy_setopt(curl, CURLOPT_POST, 1))
+			||	(res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str())))))
+		{
+			pool.release(backend, curl);
+			curl_slist_free_all(headers);
 			return res;
+		}
 		
 		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &httpData);
 
 		// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
 		if (access("~/fuseca.pem", F_OK) != -1)
 			curl_easy_setopt(curl, CURLOPT_CAINFO, "~/fuseca.pem");
 
-		#if DEBUG
 		if (post != "")
-			*logs << YELLOW << post << RESET << endl;
-		#endif 
+			logs(Log::DBG) << YELLOW << post << RESET << endl;
 
+		const size_t before = httpData.size();
+		Trace::Span perform("http", "curl perform");
 		curl_easy_perform(curl);
+		perform.end();
+		share.count(curl, url);
+		encoding.count(curl, url, httpData.size() - before);
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
+		pool.release(backend, curl);
 		curl_slist_free_all(headers);
 	}
+	metrics.request(request, url, httpCode, start);
 
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
+		logs(Log::ERR) << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
 		return httpCode;
 	}
 
@@ -198,20 +236,15 @@ int	apiCURL(string url, stringstream &httpData, string request = "GET", const st
 
 int	apiCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	Json::CharReaderBuilder jsonReader;
+	string body, errs;
 	int	res = 0;
 
-	try 
-	{
-		if ((res = apiCURL(url, stream, request, post)))
-			return res;
+	if ((res = apiCURL(url, body, request, post)))
+		return res;
 
-		stream >> jsonData;
-	}
-	catch (const exception &e)
+	if (!HttpBuffer::parseJson(body, jsonData, &errs))
 	{
-		*logs << RED << e.what() << RESET << endl;
+		logs(Log::ERR) << RED << errs << RESET << endl;
 		return 1;
 	}
 	return 0;
@@ -219,8 +252,11 @@ int	apiCURLjson(string url, Json::Value &jsonData, string request = "GET", strin
 
 int api_getattr(const char *path, struct stat *stat)
 {
+	Metrics::Timer timer(metrics, "getattr");
 	const string p(path);
-	Json::Value spec = schema["paths"][p];
+
+	if (Metrics::stat(path, *stat) || Trace::stat(path, *stat))
+		return 0;
 
 	stat->st_uid = getuid();
 	stat->st_gid = getgid();
@@ -245,8 +281,44 @@ int api_getattr(const char *path, struct stat *stat)
 	return 0;
 }
 
+// Only the hidden stats file keeps a handle, a snapshot of the report.
+// The trace control file opens like anything else, see api_write.
+int api_open(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "open");
+
+	if (strcmp(path, Metrics::file()))
+		return 0;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	fi->direct_io = 1;
+	fi->fh = (uint64_t) new string(metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n'
+		+ limit.stats() + '\n'
+		+ workers.stats() + '\n');
+	return 0;
+}
+
+int api_release(const char *path, struct fuse_file_info *fi)
+{
+	delete (string*) fi->fh;
+	fi->fh = 0;
+	return 0;
+}
+
 int api_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	Metrics::Timer timer(metrics, "read");
+
+	if (fi && fi->fh)
+		return HttpBuffer::copyOut(*(string*) fi->fh, buf, size, offset);
+
 	// To prevent double reads, static buffer last read (single thread only!)
 	string buffer, p(path), token, bname, dname;
 	int len = size;
@@ -262,7 +334,7 @@ int api_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 	dname = dirname((char*)path);
 	try
 	{
-		jbuf = schema["paths"][dname];
+		jbuf = spec["paths"][dname];
 		// If post, fetch template with schema.
 		if (bname == "post")
 			buffer = (string)"{\n\t\"$schema\":\"" + getenv("FUSEPATH") + p + ".schema\"\n}\n";
@@ -273,11 +345,8 @@ int api_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 			buffer = jbuf["description"].asString();
 		else if (regex_match(p, (regex)"^(.*)/get([^.]|$)"))
 		{
-			stringstream res;
-			if (apiCURL(apiaddr + dname, res))
+			if (apiCURL(apiaddr + dname, buffer))
 				return -ENOENT;
-			
-			buffer = res.str();
 		}
 		else // Interpret dots ala jq to select json (even without readdir)
 		{
@@ -288,9 +357,7 @@ int api_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 			buffer = jbuf.toStyledString();
 		}
 
-		len = min((ulong)size, (ulong)(buffer.length() - offset));
-
-		strncpy(buf + offset, buffer.c_str() + offset, len);
+		len = HttpBuffer::copyOut(buffer, buf, size, offset);
 	}
 	catch (exception &e)
 	{
@@ -303,8 +370,11 @@ int api_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 
 int api_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	string p(path), dname, verb;
-	stringstream stream;
+	Metrics::Timer timer(metrics, "write");
+	if (!strcmp(path, Trace::control()))
+		return Trace::get().dump() ? size : -EIO;
+
+	string p(path), dname, verb, body;
 
 	verb = basename((char*)path);
 	dname = dirname((char*)path);
@@ -316,13 +386,13 @@ int api_write(const char *path, const char *buf, size_t size, off_t offset, stru
 		return size;
 	}
 
-	else if (apiCURL(apiaddr + p, stream, verb, buf))
+	else if (apiCURL(apiaddr + p, body, verb, buf))
 	{
-		clientOut(stream.str(), 2);
+		clientOut(body, 2);
 		return -EINVAL;
 	}
 	else
-		clientOut(stream.str());
+		clientOut(body);
 	
 	return size;
 }
@@ -363,13 +433,21 @@ void fillArray(Json::Value &array, void *buf, fuse_fill_dir_t filler)
 // we can't use READDIR_PLUS sadly.  I started to implement this in FUSE3 but had issues.
 int api_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
+	Metrics::Timer timer(metrics, "readdir");
 	string p(path);
 	set<string> uniques;
 	smatch match;
-	Json::Value paths = schema["paths"];
+	const Json::Value &paths = spec["paths"];
 	Json::Value desc  = paths[p];
 	Json::Value::Members rootContents = paths.getMemberNames();
 
+	if (p == Metrics::dir())
+	{
+		filler(buf, "stats", NULL, 0);
+		filler(buf, "trace", NULL, 0);
+		return 0;
+	}
+
 	if (p == "/")
 		uniques.insert("clear_cache");
 	else
@@ -386,7 +464,7 @@ int api_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		}
 	}
 
-	cout <<GREEN<< p <<RESET<<endl;
+	logs(Log::DBG) << GREEN << p << RESET << endl;
 
 	regex r("(" + p.substr(1) + "/)[^/]+");
 
@@ -443,6 +521,8 @@ static int api_readlink(const char *path, char *buf, size_t size)
 void* api_init(struct fuse_conn_info *conn)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	logs.start();
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
 	// Did we specify cache expiration seconds?
@@ -453,9 +533,47 @@ void* api_init(struct fuse_conn_info *conn)
 	
 	apiCURLjson(getenv("API_SPEC"), schema);
 
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
+
 	return NULL;
 }
 
+// Free up curl resources.
+void api_destroy(void* private_data)
+{
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << limit.stats() << endl;
+	*logs << workers.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
+	share.cleanup();
+	curl_global_cleanup();
+}
+
+// Live counters on the mount root, see Common/StatsXattr.h.
+int api_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!StatsXattr::matches(path, name))
+		return -ENODATA;
+	return StatsXattr::value(workers.stats() + '\n' + limit.stats() + '\n', value, size);
+}
+
+int api_listxattr(const char *path, char *list, size_t size)
+{
+	return StatsXattr::list(path, list, size);
+}
+
 // Stub required for truncate/write.
 int api_truncate(const char *path, off_t newsize)
 {
@@ -471,11 +589,16 @@ int main(int argc, char *argv[])
 		.getattr = api_getattr,
 		.readlink = api_readlink,
 		.truncate = api_truncate,
+		.open = api_open,
 		.read = api_read,
 		.write = api_write,
 		.statfs = api_statfs,
+		.release = api_release,
+		.getxattr = api_getxattr,
+		.listxattr = api_listxattr,
 		.readdir = api_readdir,
 		.init = api_init,
+		.destroy = api_destroy,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
@@ -487,5 +610,11 @@ int main(int argc, char *argv[])
 	else
 		return 1;
 	
-	return fuse_main(argc, argv, &fuse, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res = 1;
+
+	if (limit.parse(&args) != -1)
+		res = workers.run(&args, &fuse, sizeof(fuse));
+	fuse_opt_free_args(&args);
+	return res;
 }
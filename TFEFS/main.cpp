@@ -4,14 +4,15 @@
 **
 ** Authored by John Boero
 ** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./tfefs -s -o direct_io /path/to/mount
+** Usage: ./tfefs -o direct_io /path/to/mount
 **
-** Note single threaded mode is currently mandatory for tfefs (-s flag)
+** Multithreaded, see Common/FusePool.h for -o max_threads and friends.
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
 ** Environment Variables: 
 	TFE_ADDR			tfe address, or app.terraform.io by default (SaaS)  Example: "http://localhost:8200"
 	TFE_TOKEN			bearer token.
-	TFE_CACHE_EXPIRE	Seconds of inactivity before we flush all cache.  Default 300s.
+	TFE_CACHE_EXPIRE	Seconds a response is cached when no policy rule matches.  Default 300s.
+	TFE_CACHE_POLICY	optional rules ahead of the defaults below.  See Common/CachePolicy.h.
 
 ** This code is kept fairly simple/ugly without object oriented best practices.
 ** TODO: securely destroy strings - https://stackoverflow.com/questions/5698002/how-does-one-securely-clear-stdstring
@@ -27,6 +28,7 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <limits>
 #include <regex>
 #include <libgen.h>
 
@@ -39,6 +41,21 @@
 #include <sys/xattr.h>
 #include <stdarg.h>
 #include <fuse.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/Resilience.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/FusePool.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/JsonList.h"
+#include "../Common/CachePolicy.h"
+#include "../Common/ReadBuffer.h"
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -54,18 +71,78 @@ using namespace std;
 // Global api version.
 const string apiVers = "/api/v2";
 
-// Set logs to other options (ofstream) or default to std::cout
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  Goes to cout.
+Log logs;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Keep-alive handles, one per request in flight.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Adaptive timeouts, retries and a circuit breaker.
+Resilience guard;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// FUSE worker threads (-o max_threads=N,max_idle_threads=N).
+FusePool workers;
+
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
+
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
+
+// Cache lifetimes by API path (without /api/v2 or the query).  Orgs and
+// workspaces barely change, runs, plans and applies move within seconds.
+CachePolicy policy("TFE_CACHE_POLICY",
+	"/workspaces/*/runs=15s;/runs/**=15s;/plans/**=15s;/applies/**=15s;/organizations/**=10m;/workspaces/**=10m");
 
 // Added v0.2 JUN-2020
 // Global cache locally since libCurl doesn't support it.
-// We'll just purge this every few seconds for simplicity.
-map<string, string> cache;
-time_t cache_timestamp = time(NULL);
+// Each response expires on its own, by policy.
+struct Cached
+{
+	string data;
+	time_t expires;
+};
+map<string, Cached> cache;
+mutex cacheLock;
+unsigned long cacheHits = 0, cacheMisses = 0;
 int cache_expiration = 300;
+size_t cacheMax = 4096;
+
+// Make room in the full cache, with cacheLock held.  Expired answers stay
+// only while TFE is down and they're what we serve, and if nothing has
+// expired it starts over, so the cache never passes cacheMax.
+void pruneCache()
+{
+	const time_t now = time(NULL);
+
+	for (map<string, Cached>::iterator it = cache.begin(); it != cache.end(); )
+	{
+		if (it->second.expires <= now && !guard.open(it->first))
+			cache.erase(it++);
+		else
+			++it;
+	}
+
+	for (map<string, Cached>::iterator it = cache.begin(); cache.size() >= cacheMax && it != cache.end(); )
+	{
+		if (it->second.expires <= now)
+			cache.erase(it++);
+		else
+			++it;
+	}
+
+	if (cache.size() >= cacheMax)
+		cache.clear();
+}
 
 // CURL callback
 namespace
@@ -76,12 +153,9 @@ namespace
             std::size_t num,
             char* out)
     {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << GREEN).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -104,120 +178,196 @@ int clientOut(string output, short stream = 1)
 		return 1;
 }
 
+// Route template for timeouts and metrics.  TFE paths alternate resource
+// type and id (/organizations/<org>/workspaces/<ws>), so ids are starred:
+// /api/v2/runs/*, /api/v2/workspaces/*/runs.
+string tfeRoute(const string &path)
+{
+	const string base = apiVers + '/';
+	string out = base;
+	size_t start = base.size(), end;
+	bool id = false;
+
+	if (path.compare(0, base.size(), base))
+		return path;
+
+	for (; start < path.size(); start = end + 1, id = !id)
+	{
+		end = path.find('/', start);
+		if (end == string::npos)
+			end = path.size();
+		out += id ? "*" : path.substr(start, end - start);
+		if (end < path.size())
+			out += '/';
+	}
+	return out;
+}
+
 // tfefs GET raw via libcurl
 // Currently supports request GET (default), POST, LIST.
 // TODO: escape environment variables for injection vulnerabilities.
-int	tfeCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
+int	tfeCURL(string url, string &httpData, string request = "GET", const string post = "")
 {
-	int res = 0, httpCode = 0;
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
+	int res = 0;
+	long httpCode = 0;
 	string tokenHeader = "Authorization: Bearer ";
 	struct curl_slist *headers = curl_slist_append(NULL, (tokenHeader + getenv("TFE_TOKEN")).c_str());
 	headers = curl_slist_append(headers, "Content-Type: application/vnd.api+json");
-	static CURL* curl = curl_easy_init();
+	string cpath = url.substr(0, url.find('?'));
+
+	if (!cpath.compare(0, apiVers.size(), apiVers))
+		cpath = cpath.substr(apiVers.size());
 
 	if (getenv("TFE_ADDR"))
 		url = (string)getenv("TFE_ADDR") + url;
 	else
 		url = "https://app.terraform.io" + url;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
 	
-	// 
-	if (time(NULL) - cache_timestamp > 300)
-		cache.clear();
-	try
-	{
-		string val = cache.at(url);
-		httpData << val;
-		cout << GREEN << "Using cache for " << url << RESET << endl;
-		return 0;
-	}
-	catch (exception e)
+	// Keep serving stale cache while TFE is down.
+	if (request == "GET")
 	{
+		lock_guard<mutex> lk(cacheLock);
+		map<string, Cached>::iterator it = cache.find(url);
+
+		if (it != cache.end() && (time(NULL) < it->second.expires || guard.open(url)))
+		{
+			++cacheHits;
+			httpData = it->second.data;
+			curl_slist_free_all(headers);
+			logs(Log::DBG) << GREEN << "Using cache for " << url << RESET << endl;
+			return 0;
+		}
+		++cacheMisses;
 	}
 
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	logs(Log::DBG) << CYAN << url << RESET << endl;
 
+	auto attempt = [&](long timeout) -> long
 	{
-		lock_guard<mutex> lk(curlmutex);
-		if (!curl)
-			return -1;
+		long code = 0;
+		CURL* curl;
 
-		if (res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
-			return res;
+		// Used to be one static handle behind a global mutex, so one request
+		// at a time.  Now each attempt borrows its own and CurlShare locks
+		// what's shared, so only BackendLimit caps requests.
+		if (!(curl = pool.acquire(backend)))
+			return -1;
+		share.attach(curl);
+		encoding.prepare(curl);
 
-		if (res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
+		if ((res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers)))
+		{
+			pool.release(backend, curl);
 			return res;
+		}
 
 		if (request == "POST" && post != "")
 		{
-			if (res = curl_easy_setopt(curl, CURLOPT_POST, 1))
-				return res;
-
-			if (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str()))
+			if ((res = curl_easy_setopt(curl, CURLOPT_POST, 1))
+			||	(res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str())))
+			{
+				pool.release(backend, curl);
 				return res;
+			}
 	 	}
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
-			return res;
 
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
+		httpData.clear();
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &httpData);
 
 		// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
 		if (access("~/tfefs.pem", F_OK) != -1)
 			curl_easy_setopt(curl, CURLOPT_CAINFO, "~/tfefs.pem");
 
-		#if DEBUG
 		if (post != "")
-			*logs << YELLOW << post << RESET << endl;
-		#endif 
+			logs(Log::DBG) << YELLOW << post << RESET << endl;
 
+		Trace::Span perform("http", "curl perform");
 		curl_easy_perform(curl);
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_slist_free_all(headers);
-		cache[url] = httpData.str();
-		cout << GREEN << "Cache size is " << cache.size() << RESET << endl;
+		perform.end();
+		share.count(curl, url);
+		encoding.count(curl, url, httpData.size());
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		pool.release(backend, curl);
+
+		// Only cache good answers to GETs, not errors.
+		if (code >= 200 && code < 300 && request == "GET")
+		{
+			const double ttl = policy.ttl(cpath, cache_expiration);
+			lock_guard<mutex> lk(cacheLock);
+			if (cache.size() >= cacheMax && !cache.count(url))
+				pruneCache();
+
+			Cached &c = cache[url];
+			c.data = httpData;
+			c.expires = (ttl < 0) ? numeric_limits<time_t>::max() : time(NULL) + (time_t)ttl;
+			logs(Log::DBG) << GREEN << "Cache size is " << cache.size() << RESET << endl;
+		}
+		return code;
+	};
+
+	// Timeout adapts to the endpoint's p99 (5s until it has samples).  GETs
+	// retry with jitter, and an unreachable TFE fails fast.
+	{
+		BackendLimit::Slot slot(limit, url);
+		httpCode = guard.run(request, url, 5000, attempt);
 	}
+	curl_slist_free_all(headers);
+	metrics.request(request, url, httpCode, start);
 
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << RED 
+		logs(Log::ERR) << RED 
 			<< "Couldn't " << request << " " << post << " -> " 
 			<< url << " HTTP" << httpCode 
 			<< RESET << endl;
 		return httpCode;
 	}
 
-	cache_timestamp = time(NULL) + cache_expiration;
 	return res;
 }
 
 int	tfeCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	Json::CharReaderBuilder jsonReader;
+	string body, errs;
 	int	res = 0;
 
-	if (res = tfeCURL(url, stream, request, post))
+	if (res = tfeCURL(url, body, request, post))
 		return res;
 
-	try
-	{
-		stream >> jsonData;
-	}
-	catch (exception e)
-	{
-		cerr <<YELLOW<< "WARNING JSON problem.  Possibly data is too large for maxread: " << e.what() <<RESET<<endl;
-	}
+	if (!HttpBuffer::parseJson(body, jsonData, &errs))
+		logs(Log::WARN) << YELLOW << "JSON problem.  Possibly data is too large for maxread: " << errs << RESET << endl;
+
+	return 0;
+}
+
+// GET wrapper for readdir.  Pulls one field from each data[] element.
+int	tfeCURLnames(string url, vector<string> &names, const char *field = "/id")
+{
+	string body;
+	int	res = 0;
+
+	if (res = tfeCURL(url, body))
+		return res;
+
+	if (!JsonList::names(body, "/data", field, names))
+		logs(Log::WARN) << YELLOW << "JSON problem listing " << url << RESET << endl;
 
 	return 0;
 }
 
 int tfe_getattr(const char *path, struct stat *stat)
 {
+	Metrics::Timer timer(metrics, "getattr");
 	const string p(path);
 	const size_t slashes = count(p.begin(), p.end(), '/');
 	int res = 0;
@@ -233,6 +383,9 @@ int tfe_getattr(const char *path, struct stat *stat)
 	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
 	//stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
 
+	if (Metrics::stat(path, *stat) || Trace::stat(path, *stat))
+		return 0;
+
 	// Some dir levels are actually files.
 	if (regex_match(p, (regex)"/organizations/(.*)/workspaces/(.*)/(vars|json)")
 	||	regex_match(p, (regex)"/organizations/(.*)/workspaces/current-state-version")
@@ -256,96 +409,160 @@ int tfe_getattr(const char *path, struct stat *stat)
 	return 0;
 }
 
-int tfe_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Fetch a file's content, once per open.
+int tfeContent(const char *path, ReadBuffer::Value &value)
 {
-	// To prevent double reads, buffer last read (single thread only!)
-	static string buffer;
-	string p(path), org, workspace, endpoint;
+	string p(path), org, workspace, endpoint, body;
 	const size_t slashes = count(p.begin(), p.end(), '/');
-	Json::Value keys;
-	int len;
 
-	// Use static buffer to prevent repeat CURL ops
-	if (buffer == "")
+	// 4: workspaces, policies, policy-sets
+	if (slashes > 3)
 	{
-		stringstream stream;
+		// Need to rebase to /api/v2/ and filter on org+ws...
+		//?filter%5Bws%5D%5Bname%5D=my-workspace&filter%5Borganization%5D%5Bname%5D=my-organization
+		// filter[workspace][name]
+		// filter[organization][name]
+		// page[number]
+		// page[size]
+		stringstream sp(p);
+		string ignore, type, org, l5, l6, l7;
+		getline(sp, ignore, '/');	// /
+		getline(sp, ignore, '/');	// orgs
+		getline(sp, org, '/');		// JohnBoero
+		getline(sp, type, '/');	// workspaces,policies,etc
+		getline(sp, l5, '/');		// ws, policy, etc
+		getline(sp, l6, '/');		// plans, applies, runs, raw, vars, etc
+		getline(sp, l7, '/');		// plan, run, etc
 
-		// 4: workspaces, policies, policy-sets
-		if (slashes > 3)
+		if (type == "workspaces")
 		{
-			// Need to rebase to /api/v2/ and filter on org+ws...
-			//?filter%5Bws%5D%5Bname%5D=my-workspace&filter%5Borganization%5D%5Bname%5D=my-organization
-			// filter[workspace][name]
-			// filter[organization][name]
-			// page[number]
-			// page[size]
-			stringstream sp(p);
-			string ignore, type, org, l5, l6, l7;
-			getline(sp, ignore, '/');	// /
-			getline(sp, ignore, '/');	// orgs
-			getline(sp, org, '/');		// JohnBoero
-			getline(sp, type, '/');	// workspaces,policies,etc
-			getline(sp, l5, '/');		// ws, policy, etc
-			getline(sp, l6, '/');		// plans, applies, runs, raw, vars, etc
-			getline(sp, l7, '/');		// plan, run, etc
-
-			if (type == "workspaces")
-			{
-				if (l6 == "vars")
-					endpoint = apiVers + "/vars?filter[organization][name]="
-						+ org + "&filter[workspace][name]=" + l5;
-				else if (l6 == "json")
-					endpoint = apiVers + p.substr(0, p.length() - 5);
-				else
-					endpoint = apiVers + '/' + l6 + "/" + l7;
-			}
-			else if (regex_match(type, (regex)"policies|policy-sets|ssh-keys"))
-				endpoint = apiVers + '/' + type + "/" + basename((char*)path);
+			if (l6 == "vars")
+				endpoint = apiVers + "/vars?filter[organization][name]="
+					+ org + "&filter[workspace][name]=" + l5;
+			else if (l6 == "json")
+				endpoint = apiVers + p.substr(0, p.length() - 5);
 			else
-				endpoint = apiVers + '/' + (l6.empty()?l5:l6) + "?filter[organization][name]=" + org 
-					+ "&filter[workspace][name]=" + basename((char*)path);
+				endpoint = apiVers + '/' + l6 + "/" + l7;
 		}
+		else if (regex_match(type, (regex)"policies|policy-sets|ssh-keys"))
+			endpoint = apiVers + '/' + type + "/" + basename((char*)path);
+		else
+			endpoint = apiVers + '/' + (l6.empty()?l5:l6) + "?filter[organization][name]=" + org 
+				+ "&filter[workspace][name]=" + basename((char*)path);
+	}
 
-		if (tfeCURL(endpoint, stream))
-		{
-			clientOut(stream.str(), 2);
-			return -EINVAL;
-		}
-		buffer = stream.str();
+	if (tfeCURL(endpoint, body))
+	{
+		clientOut(body, 2);
+		return -EINVAL;
 	}
 
-	len = min((ulong)size, (ulong)(buffer.length() - offset));
+	value = make_shared<string>(move(body));
+	return 0;
+}
 
-	// We've reached the end of the buffer? (DIRECT_IO)
-	if (offset >= len)
+// Everything stats() knows, for the hidden stats file.
+string tfeStats()
+{
+	string cached;
 	{
-		buffer = "";
+		lock_guard<mutex> lk(cacheLock);
+		cached = "response cache entries=" + to_string(cache.size())
+			+ " hits=" + to_string(cacheHits)
+			+ " misses=" + to_string(cacheMisses);
+	}
+
+	return metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ cached + '\n'
+		+ ReadBuffer::stats() + '\n'
+		+ limit.stats() + '\n'
+		+ guard.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n'
+		+ workers.stats() + '\n';
+}
+
+// Each handle keeps its own content, so reads no longer share one static
+// buffer.  Large state comes back from a memfd by splice.
+int tfe_open(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "open");
+	ReadBuffer::Value value;
+	int res;
+
+	// Writes dump the trace, see Common/Trace.h.
+	if (!strcmp(path, Trace::control()))
+		return ((fi->flags & O_ACCMODE) != O_WRONLY) ? -EACCES : 0;
+
+	// Read only, and sized by what's read rather than by getattr.
+	if (!strcmp(path, Metrics::file()))
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) new ReadBuffer(make_shared<string>(tfeStats()));
 		return 0;
 	}
-	
-	strncpy(buf + offset, buffer.c_str() + offset, len);
-	return len;
+
+	if ((fi->flags & O_ACCMODE) == O_WRONLY)
+		return 0;
+
+	if (res = tfeContent(path, value))
+		return res;
+
+	fi->fh = (uint64_t) new ReadBuffer(value);
+	return 0;
+}
+
+int tfe_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "read");
+	ReadBuffer::Value value;
+	int res;
+
+	if (fi && fi->fh)
+		return ReadBuffer::of(fi)->read(bufp, size, offset);
+
+	if (res = tfeContent(path, value))
+		return res;
+
+	return ReadBuffer::read(value, bufp, size, offset);
+}
+
+int tfe_release(const char *path, struct fuse_file_info *fi)
+{
+	delete ReadBuffer::of(fi);
+	fi->fh = 0;
+	return 0;
 }
 
 int tfe_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	Metrics::Timer timer(metrics, "write");
+	if (!strcmp(path, Trace::control()))
+		return Trace::get().dump() ? size : -EIO;
+
 	string p(path + 1), payload(buf);
 	Json::Value mount, data;
 	Json::StreamWriterBuilder builder;
-	stringstream stream;
+	string body;
 	size_t mlen;
 
 	if ((mlen = p.find('/')) == string::npos)
 		return -ENOTDIR;
 
 	// TODO patch vars...
-	if (tfeCURL(apiVers + '/' + p, stream, "PATCH", payload.c_str()))
+	if (tfeCURL(apiVers + '/' + p, body, "PATCH", payload.c_str()))
 	{
-		clientOut(stream.str(), 2);
+		clientOut(body, 2);
 		return -EINVAL;
 	}
 
-	clientOut(stream.str());
+	clientOut(body);
 	return size;
 }
 
@@ -367,11 +584,11 @@ int tfe_statfs(const char *path, struct statvfs *statv)
 }
 
 // Helper function to readdir list json array
-void fillArray(Json::Value &array, void *buf, fuse_fill_dir_t filler)
+void fillArray(const vector<string> &array, void *buf, fuse_fill_dir_t filler)
 {
-	for (Json::Value::ArrayIndex i = 0; i != array.size(); ++i)
+	for (size_t i = 0; i != array.size(); ++i)
 	{
-		string key = array[i]["id"].asString();
+		string key = array[i];
 		size_t slash = key.find('/');
 		if (slash != string::npos)
 			key = key.substr(0, slash);
@@ -398,18 +615,24 @@ void fillMembers(Json::Value &root, void *buf, fuse_fill_dir_t filler)
 // we can't use READDIR_PLUS sadly.  I started to implement this in FUSE3 but had issues.
 int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
+	Metrics::Timer timer(metrics, "readdir");
 	string p(path);
 	const size_t slashes = count(p.begin(), p.end(), '/');
-	Json::Value keys;
+	vector<string> keys, ids;
 	string org, workspace;
 
 	if (p == "/")					// ROOT
 		filler(buf, "organizations", NULL, 0);
+	else if (p == Metrics::dir())
+	{
+		filler(buf, "stats", NULL, 0);
+		filler(buf, "trace", NULL, 0);
+	}
 	else if (slashes == 1)			// /organizations
 	{
 		// List orgs (GET, not LIST....)
-		tfeCURLjson(apiVers + "/organizations", keys);
-		fillArray(keys["data"], buf, filler);
+		tfeCURLnames(apiVers + "/organizations", keys);
+		fillArray(keys, buf, filler);
 	}
 	else if (slashes == 2)			// /organizations/JohnBoero
 	{
@@ -421,21 +644,15 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 	else if (slashes == 3)			// /organizations/JohnBoero/workspaces
 	{
 		// List via GET, not LIST....
-		tfeCURLjson(apiVers + p +"?page[size]=100", keys);
-		keys = keys["data"];
+		tfeCURLnames(apiVers + p +"?page[size]=100", keys, "/attributes/name");
+		fillArray(keys, buf, filler);
 
-		for (Json::Value::ArrayIndex i = 0; i != keys.size(); ++i)
+		// Second pass for ids is served from cache.
+		if (!regex_match(p, (regex)"(.*)/workspaces"))
 		{
-			string key = keys[i]["attributes"]["name"].asString();
-			size_t slash = key.find('/');
-			if (slash != string::npos)
-			key = key.substr(0, slash);
-
-			filler(buf, key.c_str(), NULL, 0);
+			tfeCURLnames(apiVers + p +"?page[size]=100", ids);
+			fillArray(ids, buf, filler);
 		}
-
-		if (!regex_match(p, (regex)"(.*)/workspaces"))
-			fillArray(keys, buf, filler);
 	}
 	else if (slashes == 4)			// /organizations/JohnBoero/workspaces/test3
 	{
@@ -472,41 +689,74 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		endpoint = apiVers + '/' + endpoint + "?filter[organization][name]=" + org 
 			+ "&filter[workspace][name]=" + ws + "&page[size]=100";
 
-		tfeCURLjson(endpoint, keys);
-		fillArray(keys["data"], buf, filler);
+		tfeCURLnames(endpoint, keys);
+		fillArray(keys, buf, filler);
 	}
 
 	return 0;
 }
 
-static void my_lock(CURL *handle, curl_lock_data data,
-                    curl_lock_access laccess, void *useptr)
-{
-  (void)handle;
-  (void)data;
-  (void)laccess;
-  (void)useptr;
-}
- 
-static void my_unlock(CURL *handle, curl_lock_data data, void *useptr)
-{
-  (void)handle;
-  (void)data;
-  (void)useptr;
-}
-
 void* tfe_init(struct fuse_conn_info *conn)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	Resilience::route() = tfeRoute;
+	logs.start();
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	// Let libfuse splice big state files from their memfds into /dev/fuse.
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
 	// Did we specify cache expiration seconds?
 	if (getenv("TFE_CACHE_EXPIRE"))
 		cache_expiration = atoi(getenv("TFE_CACHE_EXPIRE"));
+	if (getenv("HASHIFUSE_CACHE_MAX"))
+		cacheMax = max(1L, atol(getenv("HASHIFUSE_CACHE_MAX")));
 
+	*logs << policy.stats() << endl;
+
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
 	return NULL;
 }
 
+// Free up curl resources.
+void tfe_destroy(void* private_data)
+{
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << guard.stats() << endl;
+	*logs << ReadBuffer::stats() << endl;
+	*logs << limit.stats() << endl;
+	*logs << workers.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
+	share.cleanup();
+	curl_global_cleanup();
+}
+
+// Live counters on the mount root, see Common/StatsXattr.h.
+int tfe_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!StatsXattr::matches(path, name))
+		return -ENODATA;
+	return StatsXattr::value(workers.stats() + '\n' + limit.stats() + '\n', value, size);
+}
+
+int tfe_listxattr(const char *path, char *list, size_t size)
+{
+	return StatsXattr::list(path, list, size);
+}
+
 // Need to implement this for truncate/write.
 int tfe_truncate(const char *path, off_t newsize)
 {
@@ -521,15 +771,26 @@ int main(int argc, char *argv[])
 	{
 		.getattr = tfe_getattr,
 		.truncate = tfe_truncate,
-		.read = tfe_read,
+		.open = tfe_open,
 		.write = tfe_write,
 		.statfs = tfe_statfs,
+		.release = tfe_release,
+		.getxattr = tfe_getxattr,
+		.listxattr = tfe_listxattr,
 		.readdir = tfe_readdir,
 		.init = tfe_init,
+		.destroy = tfe_destroy,
+		.read_buf = tfe_read_buf,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
 		cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << endl;
 	
-	return fuse_main(argc, argv, &fuse, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res = 1;
+
+	if (limit.parse(&args) != -1)
+		res = workers.run(&args, &fuse, sizeof(fuse));
+	fuse_opt_free_args(&args);
+	return res;
 }
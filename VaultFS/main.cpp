@@ -4,13 +4,19 @@
 **
 ** Authored by John Boero
 ** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./vaultfs -o direct_io /path/to/mount
+** Usage: ./vaultfs /path/to/mount
 **
-** Note direct_io is mandatory right now until we can get key size in getattrs.
+** getattr fetches kv values (cached briefly) to report real sizes, so direct_io
+** is no longer needed there and the kernel page cache works.  Other engines
+** stay 0 bytes and are opened direct_io, as a read can mint a credential.
+** Mounts and LIST results are cached too, for as long as a CachePolicy says:
+** /sys/mounts and mount root listings for 5 minutes by default.
 ** Environment Variables: 
-	VAULT_ADDR		vault addr.  Example: "http://localhost:8200"
+	VAULT_ADDR		vault addr.  Example: "http://localhost:8200" or "unix:///run/vault.sock"
+	VAULT_AGENT_ADDR	optional Vault Agent addr, preferred over VAULT_ADDR like the vault CLI.
 	VAULT_TOKEN		auth token.
 	VAULT_NAMESPACE	optional namespace (enterprise only).
+	VAULTFS_CACHE_POLICY	optional rules ahead of the defaults below.  See Common/CachePolicy.h.
 
 ** This code is kept fairly simple/ugly without object oriented best practices.
 ** TODO: securely destroy strings - https://stackoverflow.com/questions/5698002/how-does-one-securely-clear-stdstring
@@ -27,6 +33,8 @@
 #include <map>
 #include <iostream>
 #include <algorithm>
+#include <memory>
+#include <chrono>
 #include <regex>
 #include <initializer_list>
 //#include <cppcodec/base64_rfc4648.hpp>
@@ -40,6 +48,26 @@
 #include <sys/xattr.h>
 #include <stdarg.h>
 #include <fuse.h>
+#include "../Common/CurlPool.h"
+#include "../Common/CurlShare.h"
+#include "../Common/CurlEncoding.h"
+#include "../Common/Resilience.h"
+#include "../Common/BackendLimit.h"
+#include "../Common/FusePool.h"
+#include "../Common/StatsXattr.h"
+#include "../Common/Metrics.h"
+#include "../Common/OpenMetrics.h"
+#include "../Common/Trace.h"
+#include "../Common/Log.h"
+#include "../Common/UnixSocket.h"
+#include "../Common/CachePolicy.h"
+#include "../Common/ValueCache.h"
+#include "../Common/ReadBuffer.h"
+#include "../Common/WriteBack.h"
+#include "../Common/CurlMulti.h"
+#include "../Common/SingleFlight.h"
+#include "../Common/HttpBuffer.h"
+#include "../Common/JsonList.h"
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -55,14 +83,55 @@ using namespace std;
 // Global api version.
 const string apiVers = "/v1";
 
-// Set logs to other options (ofstream) or default to std::cout
-ostream *logs = &cout;
+// Lines queue to a writer thread, see Common/Log.h.  Goes to cout.
+Log logs;
+
+// Cache lifetimes by path class.  "/" is /sys/mounts itself and "/x/" the
+// LIST of a dir, so "/*/" is every mount's root listing.
+CachePolicy policy("VAULTFS_CACHE_POLICY", "/=5m;/*/=5m");
 
 // Keep/cache a local copy of mount->mount_type for speed.
-static Json::Value gMounts;
+// Swapped whole on refresh so readers always see a complete one.
+static shared_ptr<const Json::Value> gMounts = make_shared<Json::Value>();
+static chrono::steady_clock::time_point gMountsExpire;
+static mutex gMountsLock;
+
+// Keep-alive handles so each op doesn't pay a fresh connect.
+CurlPool pool;
+
+// DNS, TLS sessions and connections shared across every handle.
+CurlShare share;
+
+// Compressed transfers, with bytes saved per backend.
+CurlEncoding encoding;
+
+// Adaptive timeouts, retries and a circuit breaker per backend.
+Resilience guard;
+
+// Cap on requests in flight to each backend (-o max_inflight=N).
+BackendLimit limit;
+
+// FUSE worker threads (-o max_threads=N,max_idle_threads=N).
+FusePool workers;
+
+// Values fetched by getattr for st_size, reused by open and read.
+// LIST bodies too, under their dir's path + '/'.
+ValueCache values(&policy);
+
+// Writes staged per handle until flush POSTs them in one go.
+WriteBack pending;
+
+// All transfers run on one curl_multi event loop thread.
+CurlMulti engine;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Identical GET/LISTs in flight at the same time share one request.
+SingleFlight<string> flights;
+
+// Latency per FUSE op and backend endpoint, read from /.hashifuse/stats.
+Metrics metrics;
+
+// The same histograms for Prometheus, with HASHIFUSE_METRICS.
+OpenMetrics exporter(metrics);
 
 // Store the vault token so we can unsetenv the env var.
 // TODO: use memfd_secret for kernel 5.14+
@@ -77,12 +146,9 @@ namespace
             std::size_t num,
             char* out)
     {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+        ((string*) out)->append(in, size * num);
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
+		(logs(Log::DBG) << GREEN).write(in, size * num) << RESET << endl;
         return size * num;
     }
 }
@@ -116,80 +182,145 @@ void clientHeaders(struct curl_slist **headers)
 		{
 			line = line.substr(2);
 			replace(line.begin(), line.end(), '=', ':');
-			cout << line << endl;
+			logs(Log::DBG) << line << endl;
 			*headers = curl_slist_append(*headers, line.c_str());
 		}
 	}
 }
 
+// Route template for timeouts and metrics: the mount, and outside kv the
+// operation, e.g. /v1/secret/* and /v1/pki/issue/*.  Never one secret.
+// Only peeks at the mounts we have, fetching them would come back here.
+string vaultRoute(const string &path)
+{
+	static const string sys = "/v1/sys/";
+	const size_t mount = path.find('/', 1), op = (mount == string::npos) ? mount : path.find('/', mount + 1);
+	size_t name;
+	bool kv;
+
+	if (!path.compare(0, sys.size(), sys))
+		return path.substr(0, path.find('/', sys.size()));
+	if (op == string::npos)
+		return path;
+
+	{
+		lock_guard<mutex> lk(gMountsLock);
+		const Json::Value &m = (*gMounts)[path.substr(mount + 1, op - mount)];
+		kv = m.isObject() && m["type"].asString() == "kv";
+	}
+
+	if (kv || (name = path.find('/', op + 1)) == string::npos)
+		return path.substr(0, op + 1) + '*';
+	return path.substr(0, name + 1) + '*';
+}
+
 // Vault GET raw via libcurl
 // Currently supports request GET (default), POST, LIST.
 // TODO: escape environment variables for injection vulnerabilities.
-int	vaultCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
+int	vaultCURL(string url, string &httpData, string request = "GET", const string post = "")
 {
-	int res = 0, httpCode = 0;
+	const Metrics::Clock::time_point start = Metrics::Clock::now();
+	int res = 0;
+	long httpCode = 0;
 	string tokenHeader = "X-Vault-Token: ";
 	string nsHeader = "X-Vault-Namespace: ";
 	struct curl_slist *headers = curl_slist_append(NULL, (tokenHeader + vault_token).c_str());
-	CURL* curl;
 
 	if (getenv("VAULT_NAMESPACE"))
 		headers = curl_slist_append(headers, (nsHeader + getenv("VAULT_NAMESPACE")).c_str());
 
 	clientHeaders(&headers);
-	url = (string)getenv("VAULT_ADDR") + url;
 
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	// Talk to a local Vault Agent (TCP or unix socket) if there is one.
+	string addr = getenv("VAULT_AGENT_ADDR") ? getenv("VAULT_AGENT_ADDR") : getenv("VAULT_ADDR"), sock;
+	UnixSocket::split(addr, sock);
+	url = addr + url;
+	const string backend = CurlPool::origin(url);
+	Trace::Span span("http", "request", url);
+
+	logs(Log::DBG) << CYAN << url << RESET << endl;
 
+	// No more global curlmutex here.  Each op gets its own pooled handle and the
+	// transfer itself runs on the curl_multi event loop, so worker threads
+	// only block on their own request.
+	auto attempt = [&](string &body, long timeout) -> long
 	{
-		lock_guard<mutex> lk(curlmutex);
-	
-		if (!(curl = curl_easy_init()))
+		long code = 0;
+		CURL* curl;
+
+		if (!(curl = pool.acquire(backend)))
 			return -1;
+		share.attach(curl);
+		encoding.prepare(curl);
+		UnixSocket::apply(curl, sock);
+		engine.prepare(curl);
 		
-		if (res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
-			return res;
-
-		if (res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
+		if ((res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
+		||	(res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers)))
+		{
+			pool.release(backend, curl);
 			return res;
+		}
 
 		if (request == "POST" && post != "")
 		{
-			if (res = curl_easy_setopt(curl, CURLOPT_POST, 1))
-				return res;
-
-			if (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str()))
+			if ((res = curl_easy_setopt(curl, CURLOPT_POST, 1))
+			||	(res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str())))
+			{
+				pool.release(backend, curl);
 				return res;
-	 	}
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
-			return res;
+			}
+		}
 
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpBuffer::reserve);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &body);
 
 		// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
 		if (access("~/vaultfs.pem", F_OK) != -1)
 			curl_easy_setopt(curl, CURLOPT_CAINFO, "~/vaultfs.pem");
 
-		#if DEBUG
 		if (post != "")
-			*logs << YELLOW << post << RESET << endl;
-		#endif 
+			logs(Log::DBG) << YELLOW << post << RESET << endl;
+
+		const size_t before = body.size();
+		engine.perform(curl);
+		share.count(curl, url);
+		encoding.count(curl, url, body.size() - before);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		pool.release(backend, curl);
+		return code;
+	};
 
-		curl_easy_perform(curl);
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
-	}
+	// Timeout adapts to the endpoint's p99 (5s until it has samples).  GETs
+	// and LISTs retry with jitter, and a down backend fails fast.
+	auto transfer = [&](string &body) -> long
+	{
+		BackendLimit::Slot slot(limit, url);
+		return guard.run(request, url, 5000, [&](long timeout) -> long
+		{
+			body.clear();
+			return attempt(body, timeout);
+		});
+	};
+
+	// Coalesce identical reads.  Client H_ headers are part of the key.
+	if ((request == "GET" || request == "LIST") && post == "")
+		httpCode = flights.run(SingleFlight<string>::key(request, url, headers), httpData, transfer);
+	else
+		httpCode = transfer(httpData);
+
+	curl_slist_free_all(headers);
+	metrics.request(request, url, httpCode, start);
 
 	if (httpCode < 200 || httpCode >= 300)
 	{
-		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
+		logs(Log::ERR) << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
 		return httpCode;
 	}
 
@@ -198,44 +329,79 @@ int	vaultCURL(string url, stringstream &httpData, string request = "GET", const
 
 int	vaultCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
 {
-	stringstream stream;
-	Json::CharReaderBuilder jsonReader;
+	string body, errs;
 	int	res = 0;
 
-	try 
-	{
-		if (res = vaultCURL(url, stream, request, post))
-			return res;
-		
-		stream >> jsonData;
-	}
-	catch (exception e)
+	if (res = vaultCURL(url, body, request, post))
+		return res;
+
+	if (!HttpBuffer::parseJson(body, jsonData, &errs))
 	{
-		*logs << RED << e.what() << RESET << endl;
+		logs(Log::ERR) << RED << errs << RESET << endl;
 		return 1;
 	}
 	return 0;
 }
 
+// LIST wrapper for readdir.  Only data.keys is pulled out of the response.
+// The body is cached under dir + '/' for as long as the policy allows.
+int	vaultCURLkeys(string url, vector<string> &keys, const string &dir)
+{
+	ValueCache::Value value;
+	time_t mtime;
+	int	res = 0;
+
+	if (res = values.get(dir + '/', value, mtime, [&](string &body) { return vaultCURL(url, body, "LIST"); }))
+		return res;
+
+	string body(*value);
+	if (!JsonList::names(body, "/data/keys", "", keys))
+		return 1;
+	return 0;
+}
+
 // Cache /sys/mounts for speed.
 int cacheMounts()
 {
-	Json::Value mounts;
+	shared_ptr<Json::Value> mounts = make_shared<Json::Value>();
 	vector<string> removers;
-	if (vaultCURLjson(apiVers + "/sys/mounts", gMounts))
+	if (vaultCURLjson(apiVers + "/sys/mounts", *mounts))
 		return -EINVAL;
 	
-	for (Json::Value::const_iterator it = gMounts.begin(); it != gMounts.end(); ++it)
+	for (Json::Value::const_iterator it = mounts->begin(); it != mounts->end(); ++it)
 		if (!(it->isObject() && it->isMember("type")))
 			removers.push_back(it.key().asString());
 	
 	// Clear out garbage members that aren't actually mounts with type.
 	for (vector<string>::iterator rm = removers.begin(); rm != removers.end(); ++rm)
-		gMounts.removeMember(*rm);
+		mounts->removeMember(*rm);
 	
+	const double ttl = policy.ttl("/", 300);
+	lock_guard<mutex> lk(gMountsLock);
+	gMounts = mounts;
+	if (ttl < 0)
+		gMountsExpire = chrono::steady_clock::time_point::max();
+	else
+		gMountsExpire = chrono::steady_clock::now()
+			+ chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(ttl));
 	return 0;
 }
 
+// Current mounts, refetched once the policy for "/" says they're stale.
+// If Vault can't be reached we carry on with the ones we have.
+shared_ptr<const Json::Value> getMounts()
+{
+	{
+		lock_guard<mutex> lk(gMountsLock);
+		if (chrono::steady_clock::now() < gMountsExpire)
+			return gMounts;
+	}
+
+	cacheMounts();
+	lock_guard<mutex> lk(gMountsLock);
+	return gMounts;
+}
+
 string getMountType(string path)
 {
 	size_t pos;
@@ -246,14 +412,41 @@ string getMountType(string path)
 	if ((pos = path.find('/')) != string::npos)
 		path = path.substr(0, pos + 1);
 
-	if (gMounts.isMember(path))
-		return gMounts[path]["type"].asString();
+	shared_ptr<const Json::Value> mounts = getMounts();
+	if (mounts->isMember(path))
+		return (*mounts)[path]["type"].asString();
 
 	return "";
 }
 
+int vaultValue(const char *path, ValueCache::Value &value, time_t &mtime);
+
+// Whether getattr may GET a file for its size.  Reads on dynamic secret
+// engines (aws/creds, database/creds, ...) mint a credential and a lease,
+// and some endpoints only take POST, so only kv and read-only sys paths.
+bool sizedPath(const string &path, const string &mountType)
+{
+	return mountType == "kv"
+		|| (mountType == "system" && regex_match(path, (regex)"/?sys/(auth|health|leader|seal-status|policy/.+|policies/.+)"));
+}
+
+// Real size and last change time for files, so we don't need direct_io.
+// Endpoints that can't be read (transit encrypt, etc) stay 0 bytes.
+void statValue(const char *path, struct stat *stat)
+{
+	ValueCache::Value value;
+	time_t mtime;
+
+	if (S_ISREG(stat->st_mode) && !vaultValue(path, value, mtime))
+	{
+		stat->st_size = value->size();
+		stat->st_mtime = stat->st_ctime = mtime;
+	}
+}
+
 int vault_getattr(const char *path, struct stat *stat)
 {
+	Metrics::Timer timer(metrics, "getattr");
 	const string p(path);
 	const size_t slashes = count(p.begin(), p.end(), '/');
 	int res = 0;
@@ -269,6 +462,9 @@ int vault_getattr(const char *path, struct stat *stat)
 	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
 	//stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
 
+	if (Metrics::stat(path, *stat) || Trace::stat(path, *stat))
+		return 0;
+
 	// Due to crude and ambiguous attrs we can't determine secret or dir
 	// In fact, you can have both /path/secret and /path/secret/ which is ugly.
 	// FUSE automatically truncates trailing / during traversal.
@@ -307,7 +503,6 @@ int vault_getattr(const char *path, struct stat *stat)
 			stat->st_mode = S_IFDIR | 0700;
 		else if (regex_match(p, (regex)".*/(encrypt|decrypt|sign|verify|hmac)/.*"))
 			stat->st_mode = S_IFREG | 0600;
-		
 		return 0;
 	}
 	else if (mountType == "system")
@@ -343,37 +538,33 @@ int vault_getattr(const char *path, struct stat *stat)
 			stat->st_mode |= S_IFDIR | 0100;
 	}
 	*/
+	if (sizedPath(p, mountType))
+		statValue(path, stat);
 	return 0;
 }
 
-int vault_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Fetch the contents of a file as we present it.
+int vaultFetch(const char *path, string &raw)
 {
-	static string raw;
 	string p(path + 1), mountType;
 	Json::Value mount, data;
 	Json::StreamWriterBuilder builder;
-	stringstream stream;
-	int res, len;
+	int res;
 	size_t mlen;
 
-	if (offset > 0)
-		return 0;
-	
 	// Allow manual refresh of mounts cache via reading /sys/mounts :)
-	if (p == "/sys/mounts")
+	if (p == "sys/mounts")
 		cacheMounts();
 
-	// Need to get mount type to figure out how to read this path.
-	if (res = vaultCURLjson(apiVers + "/sys/mounts", mount))
-		return -EINVAL;
-
 	if ((mlen = p.find('/')) == string::npos)
 		return -ENOENT;
 	
 	// Need to get the first level of path for mount details.
+	// gMounts is kept by cacheMounts(), no need to GET it on every read.
 	string mpath = p.substr(0, mlen + 1);
-	if (mount.isMember(mpath))
-			mount = mount[mpath];
+	shared_ptr<const Json::Value> mounts = getMounts();
+	if (mounts->isMember(mpath))
+			mount = (*mounts)[mpath];
 		else
 			return -ENOENT;
 
@@ -402,9 +593,8 @@ int vault_read(const char *path, char *buf, size_t size, off_t offset, struct fu
 		}
 		else if (regex_match(p, (regex)"^(.*)/ca/pem$"))
 		{
-			if (res = vaultCURL(apiVers + '/' + p, stream))
+			if (res = vaultCURL(apiVers + '/' + p, raw))
 				return -ENOENT;
-			raw = stream.str();
 		}
 	}
 	else
@@ -420,25 +610,107 @@ int vault_read(const char *path, char *buf, size_t size, off_t offset, struct fu
 		raw = Json::writeString(builder, data);
 	}
 
-	len = min(size, raw.length());
+	return 0;
+}
+
+// Contents via the value cache, so getattr's fetch serves the reads after it.
+int vaultValue(const char *path, ValueCache::Value &value, time_t &mtime)
+{
+	return values.get(path, value, mtime, [&](string &raw) { return vaultFetch(path, raw); });
+}
+
+// Everything stats() knows, for the hidden stats file.
+string vaultStats()
+{
+	return metrics.report()
+		+ exporter.stats() + '\n'
+		+ Trace::get().stats() + '\n'
+		+ logs.stats() + '\n'
+		+ values.stats() + '\n'
+		+ ReadBuffer::stats() + '\n'
+		+ pending.stats() + '\n'
+		+ flights.stats() + '\n'
+		+ limit.stats() + '\n'
+		+ guard.stats() + '\n'
+		+ pool.stats() + '\n'
+		+ share.stats() + '\n'
+		+ encoding.stats() + '\n'
+		+ workers.stats() + '\n';
+}
+
+// Snapshot the value for this handle's reads.  Tell the kernel it can keep
+// its cached pages if the value hasn't changed.  Writers get a handle too,
+// starting from the same value unless they truncate.
+int vault_open(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "open");
+	ValueCache::Value value;
+	time_t mtime;
+
+	// Writes dump the trace, see Common/Trace.h.
+	if (!strcmp(path, Trace::control()))
+		return ((fi->flags & O_ACCMODE) != O_WRONLY) ? -EACCES : 0;
 
-	// We've reached the end of the file? (DIRECT_IO)
-	// Unfortunately this usually means double reads :/
-	if (offset >= len)
+	// Read only, and sized by what's read rather than by getattr.
+	if (!strcmp(path, Metrics::file()))
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) new ReadBuffer(make_shared<string>(vaultStats()));
 		return 0;
-	
-	strncpy(buf + offset, raw.c_str(), len);
-	return len;
+	}
+
+	// Write only endpoints (transit encrypt, pki issue, ...) can't be read,
+	// so a writer that can't get the value starts from nothing.
+	if (!(fi->flags & O_TRUNC))
+	{
+		if (!vaultValue(path, value, mtime))
+			fi->keep_cache = values.keep(path);
+		else if ((fi->flags & O_ACCMODE) == O_RDONLY)
+			return -ENOENT;
+	}
+
+	// Sized 0 by getattr, so the kernel would read nothing.
+	if (!sizedPath(path, getMountType(path)))
+		fi->direct_io = 1;
+
+	fi->fh = (uint64_t) new ReadBuffer(value);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		pending.open(fi->fh, value, fi->flags & O_TRUNC);
+	return 0;
 }
 
-int vault_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Reads at any offset come out of the open snapshot, spliced if it's big.
+int vault_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	string p(path + 1), payload(buf);
+	Metrics::Timer timer(metrics, "read");
+	ValueCache::Value value;
+	time_t mtime;
+
+	if (fi && fi->fh)
+		return ReadBuffer::of(fi)->read(bufp, size, offset);
+
+	if (vaultValue(path, value, mtime))
+		return -ENOENT;
+
+	return ReadBuffer::read(value, bufp, size, offset);
+}
+
+// POST whatever was written through the handle since the last commit as
+// one payload.  0 if there was nothing to write.
+int vaultCommit(const char *path, struct fuse_file_info *fi)
+{
+	string p(path + 1);
+	WriteBack::Value payload;
 	Json::Value mount, data;
 	Json::StreamWriterBuilder builder;
-	stringstream stream;
+	string body;
 	size_t mlen;
 
+	if (!fi || !pending.take(fi->fh, payload))
+		return 0;
+
 	// Need to get mount type to figure out how to read this path.
 	//if (res = vaultCURLjson("/v1/sys/mounts", mount))
 	//	return -EINVAL;
@@ -450,15 +722,53 @@ int vault_write(const char *path, const char *buf, size_t size, off_t offset, st
 	//payload = "{\"data\":" + payload + "}";
 	//p.insert(mlen, "/data");
 
-	if (vaultCURL(apiVers + '/' + p, stream, "POST", payload.c_str()))
+	if (vaultCURL(apiVers + '/' + p, body, "POST", *payload))
 	{
-		clientOut(stream.str(), 2);
+		clientOut(body, 2);
 		return -EINVAL;
 	}
 
 	// Dump any response to client process stdout.
-	clientOut(stream.str());
-	return size;
+	clientOut(body);
+	values.invalidate(path);
+	values.invalidate(((string)path).substr(0, ((string)path).rfind('/') + 1));
+
+	// Keep reads on this handle consistent with what we just wrote.
+	ReadBuffer::of(fi)->reset(payload);
+	return 0;
+}
+
+// Every close() of the file, so a failed POST shows up as close() failing.
+int vault_flush(const char *path, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "flush");
+	return vaultCommit(path, fi);
+}
+
+// Normally flush already committed.  Nobody to tell if this one fails.
+int vault_release(const char *path, struct fuse_file_info *fi)
+{
+	if (vaultCommit(path, fi))
+		logs(Log::ERR) << RED << "Write on release failed for " << path << RESET << endl;
+
+	pending.close(fi->fh);
+	delete ReadBuffer::of(fi);
+	fi->fh = 0;
+	return 0;
+}
+
+// Stage the chunk at its offset.  The kernel splits big writes into many of
+// these, which used to be a POST each of a chunk that wasn't even cut to size.
+int vault_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	Metrics::Timer timer(metrics, "write");
+	if (!strcmp(path, Trace::control()))
+		return Trace::get().dump() ? size : -EIO;
+
+	if (!strchr(path + 1, '/'))
+		return -ENOTDIR;
+
+	return pending.write(fi->fh, buf, size, offset);
 }
 
 // Return stat of root fs (partition).
@@ -479,11 +789,11 @@ int vault_statfs(const char *path, struct statvfs *statv)
 }
 
 // Helper function to readdir list json array
-void fillArray(Json::Value &array, void *buf, fuse_fill_dir_t filler)
+void fillArray(const vector<string> &array, void *buf, fuse_fill_dir_t filler)
 {
-	for (Json::Value::ArrayIndex i = 0; i != array.size(); ++i)
+	for (size_t i = 0; i != array.size(); ++i)
 	{
-		string key = array[i].asString();
+		string key = array[i];
 		size_t slash = key.find('/');
 		if (slash != string::npos)
 			key = key.substr(0, slash);
@@ -516,14 +826,24 @@ void fillAll(void *buf, initializer_list<string> strings, fuse_fill_dir_t filler
 // we can't use READDIR_PLUS sadly.  I started to implement this in FUSE3 but had issues.
 int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
-	Json::Value mount, keys;
+	Metrics::Timer timer(metrics, "readdir");
+	Json::Value mount;
+	vector<string> keys;
 	string p(path), smount, mountType;
 	int res = 0;
 	
+	if (p == Metrics::dir())
+	{
+		fillAll(buf, {"stats", "trace"}, filler);
+		return 0;
+	}
+
+	shared_ptr<const Json::Value> mounts = getMounts();
+
 	// Root?
 	if (p == "/")
 	{	
-		vector<string> members = gMounts.getMemberNames();
+		vector<string> members = mounts->getMemberNames();
 		for(vector<string>::iterator iter = members.begin(); iter != members.end(); ++iter)
 		{
 			// Remove trailing /
@@ -538,8 +858,8 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 	smount = p.substr(0, p.find('/')) + '/';
 
 	// Isolate the single mount we need.
-	if (gMounts.isMember(smount))
-		mount = gMounts[smount];
+	if (mounts->isMember(smount))
+		mount = (*mounts)[smount];
 	else
 		return -ENOENT;
 	
@@ -559,7 +879,7 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 
 			if (vers == "2")
 			{
-				if (res = vaultCURLjson(apiVers + '/' + smount + "metadata/" + secdir, keys, "LIST"))
+				if (res = vaultCURLkeys(apiVers + '/' + smount + "metadata/" + secdir, keys, path))
 					return -ENOENT;
 			}
 		}
@@ -571,15 +891,15 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 		else if (p == smount + "certs/")
 		{
 			fillAll(buf, {"ca", "crl", "ca_chain"}, filler);
-			if (res = vaultCURLjson(apiVers + '/' + smount + "/certs", keys, "LIST"))
+			if (res = vaultCURLkeys(apiVers + '/' + smount + "/certs", keys, path))
 				return -ENOENT;
-			fillArray(keys["data"]["keys"], buf, filler);
+			fillArray(keys, buf, filler);
 		}
 		else if (p == smount + "roles/")
 		{
-			if (res = vaultCURLjson(apiVers + '/' + smount + "/roles", keys, "LIST"))
+			if (res = vaultCURLkeys(apiVers + '/' + smount + "/roles", keys, path))
 				return -ENOENT;
-			fillArray(keys["data"]["keys"], buf, filler);
+			fillArray(keys, buf, filler);
 		}
 		else if (p == smount + "ca/")
 			filler(buf, "pem", NULL, 0);
@@ -625,37 +945,105 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 		}
 		else if (p == "sys/policy/")
 		{
-			if (res = vaultCURLjson(apiVers + "/sys/policies", keys, "LIST"))
+			if (res = vaultCURLkeys(apiVers + "/sys/policies", keys, path))
 				return -ENOENT;
 		}
 	}
 
 	// TODO add other types or inheritance
 	// Generic LIST of secrets if we didn't handle it:
-	if (keys == Json::nullValue)
-		if (res = vaultCURLjson(apiVers + '/' + p, keys, "LIST"))
+	// Vault 404s an empty LIST, so no keys means we haven't listed yet.
+	if (keys.empty())
+		if (res = vaultCURLkeys(apiVers + '/' + p, keys, path))
 			return -ENOENT;
 	
-	fillArray(keys["data"]["keys"], buf, filler);
+	fillArray(keys, buf, filler);
 	return 0;
 }
 
 void* vault_init(struct fuse_conn_info *conn)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	share.init();
+	Resilience::route() = vaultRoute;
+	logs.start();
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	// Let libfuse splice big values from their memfds into /dev/fuse.
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+	// O_TRUNC with open, so WriteBack doesn't see a separate truncate.
+	conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+	// Threads have to start after FUSE daemonizes.
+	if (!engine.start())
+		logs(Log::ERR) << RED << "Unable to start curl_multi engine, falling back to blocking transfers." << RESET << endl;
+
+	*logs << policy.stats() << endl;
 	cacheMounts();
 
+	// Scrape endpoint, if HASHIFUSE_METRICS asks for one.
+	if (!exporter.start())
+		logs(Log::ERR) << RED << "Unable to serve metrics on " << getenv("HASHIFUSE_METRICS") << RESET << endl;
+	Trace::get().start();
+
 	return NULL;
 }
 
+// Free up curl resources.
+void vault_destroy(void* private_data)
+{
+	exporter.stop();
+	*logs << exporter.stats() << endl;
+	Trace::get().stop();
+	*logs << Trace::get().stats() << endl;
+	*logs << logs.stats() << endl;
+	engine.stop();
+	*logs << pool.stats() << endl;
+	pool.clear();
+	*logs << share.stats() << endl;
+	*logs << encoding.stats() << endl;
+	*logs << guard.stats() << endl;
+	*logs << values.stats() << endl;
+	*logs << ReadBuffer::stats() << endl;
+	*logs << pending.stats() << endl;
+	*logs << limit.stats() << endl;
+	*logs << workers.stats() << endl;
+	share.cleanup();
+	*logs << flights.stats() << endl;
+	*logs << metrics.report();
+	logs.stop();
+	curl_global_cleanup();
+}
+
+// Live counters on the mount root, see Common/StatsXattr.h.
+int vault_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!StatsXattr::matches(path, name))
+		return -ENODATA;
+	return StatsXattr::value(workers.stats() + '\n' + limit.stats() + '\n', value, size);
+}
+
+int vault_listxattr(const char *path, char *list, size_t size)
+{
+	return StatsXattr::list(path, list, size);
+}
+
 // Need to implement this for truncate/write.
 int vault_truncate(const char *path, off_t newsize)
 {
 	return 0;
 }
 
+// Truncating an open handle changes what its flush writes.
+int vault_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+	const int res = (fi && fi->fh) ? pending.truncate(fi->fh, newsize) : 0;
+
+	// Not a writer's handle, nothing to change.
+	return (res == -EBADF) ? 0 : res;
+}
+
 // TODO: Could add vault metadata and mount types as xattrs.
 
 int main(int argc, char *argv[])
@@ -668,15 +1056,28 @@ int main(int argc, char *argv[])
 	{
 		.getattr = vault_getattr,
 		.truncate = vault_truncate,
-		.read = vault_read,
+		.open = vault_open,
 		.write = vault_write,
 		.statfs = vault_statfs,
+		.flush = vault_flush,
+		.release = vault_release,
+		.getxattr = vault_getxattr,
+		.listxattr = vault_listxattr,
 		.readdir = vault_readdir,
 		.init = vault_init,
+		.destroy = vault_destroy,
+		.ftruncate = vault_ftruncate,
+		.read_buf = vault_read_buf,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
 		cerr << YELLOW << "WARNING Running a FUSE filesystem as root opens security holes" << endl;
 	
-	return fuse_main(argc, argv, &fuse, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res = 1;
+
+	if (limit.parse(&args) != -1)
+		res = workers.run(&args, &fuse, sizeof(fuse));
+	fuse_opt_free_args(&args);
+	return res;
 }